@@ -0,0 +1,209 @@
+/*
+ * This file is part of wslbridge2 project
+ * Licensed under the GNU General Public License version 3
+ * Copyright (C) 2024 Biswapriyo Nath
+ */
+
+/*
+ * Test client for session statistics of backend. It works as a frontend in
+ * WSL1 or plain Linux, where backend connects through loopback. Backend runs
+ * the command, its output goes to stdout and counters of relay loop are
+ * requested every interval and printed to stderr.
+ *
+ * gcc -O2 -o wsl_stats_client wsl_stats_client.c
+ * ./wsl_stats_client ../bin/wslbridge2-backend 1000 sh -c 'cat /dev/zero' >/dev/null
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Same as FrameCodec.hpp */
+#define FRAME_HEADER_LEN 4
+#define FRAME_WINDOW_INITIAL 0x40000
+#define FRAME_DATA 1
+#define FRAME_WINDOW 5
+#define FRAME_STATS 8
+#define CHANNEL_TERMINAL 0
+#define CHANNEL_CONTROL 1
+#define FRAME_STAT_LEN 9
+
+static const char *stat_names[] = {
+    NULL, "uptime usec", "bytes in", "bytes out", "input reads", "pty reads",
+    "socket sends", "poll wakeups", "send blocked usec", "resizes",
+    "mode switches", "bulk usec"
+};
+
+#define STAT_COUNT (sizeof stat_names / sizeof stat_names[0])
+
+static uint64_t monotonic_msec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int send_frame(int sock, int type, int channel, const void *payload, size_t len)
+{
+    char frame[FRAME_HEADER_LEN + 4];
+    frame[0] = type;
+    frame[1] = channel;
+    frame[2] = len & 0xFF;
+    frame[3] = (len >> 8) & 0xFF;
+    memcpy(frame + FRAME_HEADER_LEN, payload, len);
+    return send(sock, frame, FRAME_HEADER_LEN + len, 0) == (ssize_t)(FRAME_HEADER_LEN + len);
+}
+
+static void print_stats(const unsigned char *payload, size_t len)
+{
+    uint64_t value[STAT_COUNT] = { 0 };
+    for (size_t i = 0; i + FRAME_STAT_LEN <= len; i += FRAME_STAT_LEN)
+    {
+        if (payload[i] >= STAT_COUNT)
+            continue;
+        for (int b = 7; b >= 0; b--)
+            value[payload[i]] = value[payload[i]] << 8 | payload[i + 1 + b];
+    }
+
+    for (size_t i = 1; i < STAT_COUNT; i++)
+        fprintf(stderr, "%s: %llu%s", stat_names[i],
+            (unsigned long long)value[i], i == STAT_COUNT - 1 ? "\n" : ", ");
+    fprintf(stderr, "bytes per pty read: %.0f, bytes per socket send: %.0f\n",
+        value[5] ? (double)value[3] / value[5] : 0.0,
+        value[6] ? (double)value[3] / value[6] : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("usage: %s BACKEND MSEC [command]...\n", argv[0]);
+        return 1;
+    }
+    const int interval = atoi(argv[2]);
+
+    int lsock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof addr;
+    if (bind(lsock, (struct sockaddr*)&addr, sizeof addr) < 0 ||
+        listen(lsock, 1) < 0 ||
+        getsockname(lsock, (struct sockaddr*)&addr, &addrlen) < 0)
+    {
+        printf("socket error: %s\n", strerror(errno));
+        return 1;
+    }
+
+    char port[16];
+    sprintf(port, "%d", ntohs(addr.sin_port));
+
+    pid_t backend = fork();
+    if (backend == 0)
+    {
+        char *args[argc + 9];
+        int n = 0;
+        args[n++] = argv[1];
+        args[n++] = "--cols";
+        args[n++] = "80";
+        args[n++] = "--rows";
+        args[n++] = "24";
+        args[n++] = "--mux";
+        args[n++] = port;
+        args[n++] = "--";
+        for (int i = 3; i < argc; i++)
+            args[n++] = argv[i];
+        args[n] = NULL;
+
+        /* Debug output of backend is not mixed with output of command */
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        execv(argv[1], args);
+        _exit(127);
+    }
+
+    int sock = accept(lsock, NULL, NULL);
+    if (sock < 0)
+    {
+        printf("accept error: %s\n", strerror(errno));
+        return 1;
+    }
+
+    static unsigned char buf[FRAME_HEADER_LEN + 0xFFFF + 4096];
+    size_t have = 0;
+    unsigned long long consumed = 0;
+    uint64_t next = monotonic_msec() + interval;
+
+    while (1)
+    {
+        const uint64_t now = monotonic_msec();
+        if (now >= next)
+        {
+            if (!send_frame(sock, FRAME_STATS, CHANNEL_CONTROL, NULL, 0))
+                break;
+            next = now + interval;
+        }
+
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        if (poll(&pfd, 1, next - now) <= 0)
+            continue;
+
+        const ssize_t ret = recv(sock, buf + have, sizeof buf - have, 0);
+        if (ret <= 0)
+            break;
+        have += ret;
+
+        size_t pos = 0;
+        while (have - pos >= FRAME_HEADER_LEN)
+        {
+            const size_t len = buf[pos + 2] | buf[pos + 3] << 8;
+            if (have - pos < FRAME_HEADER_LEN + len)
+                break;
+
+            const unsigned char *payload = buf + pos + FRAME_HEADER_LEN;
+            if (buf[pos] == FRAME_DATA && buf[pos + 1] == CHANNEL_TERMINAL)
+            {
+                if (write(STDOUT_FILENO, payload, len) < 0)
+                    return 1;
+                consumed += len;
+            }
+            else if (buf[pos] == FRAME_STATS && buf[pos + 1] == CHANNEL_CONTROL)
+                print_stats(payload, len);
+
+            pos += FRAME_HEADER_LEN + len;
+        }
+        memmove(buf, buf + pos, have - pos);
+        have -= pos;
+
+        /* Let backend send more output when half window is written */
+        if (consumed >= FRAME_WINDOW_INITIAL / 2)
+        {
+            const unsigned char credit[4] = {
+                consumed & 0xFF, (consumed >> 8) & 0xFF,
+                (consumed >> 16) & 0xFF, (consumed >> 24) & 0xFF };
+            if (!send_frame(sock, FRAME_WINDOW, CHANNEL_TERMINAL, credit, 4))
+                break;
+            consumed = 0;
+        }
+    }
+
+    fprintf(stderr, "backend closed connection\n");
+
+    /* cleanup */
+    int status;
+    waitpid(backend, &status, 0);
+    close(sock);
+    close(lsock);
+    return 0;
+}
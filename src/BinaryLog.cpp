@@ -0,0 +1,388 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "BinaryLog.hpp"
+
+BinaryLog g_log;
+
+/* Format of each event, %d and %u take a numeric argument, %s takes the text */
+static const char *const log_formats[LOG_EVENTS] = {
+    "log opened: version %u record size %u",
+    "log dropped: %u records",
+    "cols: %d rows: %d in: %d out: %d con: %d mux: %d",
+    "cols: %d rows: %d",
+    "compression is off in named sessions",
+    "session: %s took connection",
+    "session: %s is kept by another backend",
+    "session: %s attached, output missed: %u",
+    "session: %s detached",
+    "master fd: %d child pid: %d pty name: %s",
+    "child pid: %d pipes: %d %d %d",
+    "engine: %s",
+    "engine: poll, uring does not do compression, screen, session or buffer auto",
+    "engine: poll, io_uring is not available",
+    "engine: poll, splice does not do compression, screen or session",
+    "engine: poll, splice pipe is not available",
+    "engine: poll, kernel can not splice pty or socket",
+    "child pid: %d exit status: %d",
+    "bytes in: %u out: %u splices: %u exit status: %d",
+    "pty reads: %u socket sends: %u read arms: %u",
+    "bytes in: %u out: %u ring enters: %u",
+    "spliced bytes: %u",
+    "pty reads: %u socket sends: %u sends avoided: %u",
+    "bytes in: %u out: %u poll wakeups: %u send blocked: %u usec",
+    "deflate batches: %u plain batches: %u bytes: %u -> %u ratio: %.2f cpu: %u usec",
+    "queue peak input: %u output: %u pty write stalls: %u",
+    "resizes applied: %u collapsed: %u",
+    "output mode switches: %u bulk: %u ms",
+    "buffer grows: %u shrinks: %u",
+    "screen floods: %u frames: %u bytes held: %u",
+    "session detaches: %u attaches: %u output missed: %u",
+    "flight recorder: %u events in %s",
+};
+
+static const char *const log_levels[] = { "debug", "info", "warn" };
+
+int log_level(const char *name)
+{
+    for (size_t i = 0; i < sizeof log_levels / sizeof log_levels[0]; i++)
+        if (strcmp(name, log_levels[i]) == 0)
+            return i;
+
+    return -1;
+}
+
+size_t log_format(const struct LogRecord &record, char *out, size_t size)
+{
+    if (record.event >= LOG_EVENTS)
+        return snprintf(out, size, "unknown event: %u", record.event);
+
+    /* Text is stored after numeric arguments, it may be cut but is terminated */
+    const size_t argc = record.argc < LOG_ARGS_MAX ? record.argc : LOG_ARGS_MAX;
+    const char *text = argc < LOG_ARGS_MAX ? record.args[argc].text : "";
+    const int textLen = strnlen(text, (LOG_ARGS_MAX - argc) * sizeof(union LogValue));
+
+    size_t len = 0, arg = 0;
+    for (const char *p = log_formats[record.event]; *p && len + 1 < size; p++)
+    {
+        if (*p != '%')
+        {
+            out[len++] = *p;
+            continue;
+        }
+
+        /* Conversion of printf with its precision, length of integers is added */
+        char spec[16] = "%";
+        size_t specLen = 1;
+        while (p[1] && strchr(".0123456789", p[1]) && specLen < sizeof spec - 4)
+            spec[specLen++] = *++p;
+        const char conv = *++p;
+        if (conv == 'd' || conv == 'u')
+        {
+            spec[specLen++] = 'l';
+            spec[specLen++] = 'l';
+        }
+        spec[specLen++] = conv;
+        spec[specLen] = '\0';
+
+        int ret;
+        if (conv == 's')
+            ret = snprintf(out + len, size - len, "%.*s", textLen, text);
+        else if (arg >= argc)
+            ret = snprintf(out + len, size - len, "?");
+        else if (conv == 'd')
+            ret = snprintf(out + len, size - len, spec, (long long)record.args[arg++].i);
+        else if (conv == 'u')
+            ret = snprintf(out + len, size - len, spec, (unsigned long long)record.args[arg++].u);
+        else
+            ret = snprintf(out + len, size - len, spec, record.args[arg++].f);
+
+        if (ret < 0)
+            break;
+        len += (size_t)ret < size - len ? ret : size - len - 1;
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+BinaryLog::BinaryLog() : head_(0), dropped_(0)
+{
+    for (uint32_t i = 0; i < LOG_RING_RECORDS; i++)
+        ring_[i].turn.store(i, std::memory_order_relaxed);
+}
+
+BinaryLog::~BinaryLog()
+{
+    stop();
+
+    /* Forked process has a copy of the thread object, not the thread */
+    if (thread_.joinable())
+        thread_.detach();
+}
+
+/* Claim a slot, fill it and hand it to the flusher, drop the record if ring is full */
+void BinaryLog::write(int level, int event, std::initializer_list<LogArg> args,
+    const char *text)
+{
+    if (level < level_)
+        return;
+
+    uint32_t pos = head_.load(std::memory_order_relaxed);
+    struct Slot *slot;
+    while (1)
+    {
+        slot = &ring_[pos & (LOG_RING_RECORDS - 1)];
+        const int32_t diff = slot->turn.load(std::memory_order_acquire) - pos;
+        if (diff == 0 && head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        if (diff < 0) /* Flusher has not taken the record of previous round */
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (diff > 0)
+            pos = head_.load(std::memory_order_relaxed);
+    }
+
+    struct LogRecord &record = slot->record;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    record.pid = 0; /* Flusher knows it */
+    record.event = event;
+    record.level = level;
+    record.argc = 0;
+    for (const LogArg &arg : args)
+        if (record.argc < LOG_ARGS_MAX)
+            record.args[record.argc++] = arg.value;
+
+    if (record.argc < LOG_ARGS_MAX)
+    {
+        const size_t room = (LOG_ARGS_MAX - record.argc) * sizeof(union LogValue);
+        char *dest = record.args[record.argc].text;
+        const size_t len = text ? strnlen(text, room - 1) : 0;
+        memcpy(dest, text ? text : "", len);
+        dest[len] = '\0';
+    }
+
+    slot->turn.store(pos + 1, std::memory_order_release);
+}
+
+/* Append record to out as it goes to the sink, out has room for a text line */
+size_t BinaryLog::put(char *out, const struct LogRecord &record)
+{
+    if (binary_)
+    {
+        memcpy(out, &record, sizeof record);
+        memcpy(out + offsetof(struct LogRecord, pid), &owner_, sizeof record.pid);
+        return sizeof record;
+    }
+
+    const size_t len = log_format(record, out, 127);
+    out[len] = '\n';
+    return len + 1;
+}
+
+/* Move records out of the ring, after a notice of records dropped since last time */
+size_t BinaryLog::take(char *out, size_t size)
+{
+    size_t len = 0;
+    const unsigned long long dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped != reported_)
+    {
+        struct LogRecord notice = {};
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        notice.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        notice.event = LOG_DROPPED;
+        notice.level = LOG_LEVEL_WARN;
+        notice.argc = 1;
+        notice.args[0].u = dropped - reported_;
+        len += put(out + len, notice);
+        reported_ = dropped;
+    }
+
+    while (len + 128 <= size)
+    {
+        struct Slot &slot = ring_[tail_ & (LOG_RING_RECORDS - 1)];
+        if (slot.turn.load(std::memory_order_acquire) != tail_ + 1)
+            break;
+
+        len += put(out + len, slot.record);
+        slot.turn.store(tail_ + LOG_RING_RECORDS, std::memory_order_release);
+        tail_++;
+    }
+
+    return len;
+}
+
+/*
+ * Write records to sink until ring is empty. Sink that is full is waited
+ * for msec, if at all, records stay in the ring. Returns false if sink broke.
+ */
+bool BinaryLog::flush(int msec)
+{
+    while (1)
+    {
+        if (pendingLen_ == 0)
+            pendingLen_ = take(pending_, sizeof pending_);
+        if (pendingLen_ == 0)
+            return true;
+
+        const ssize_t writeRet = ::write(fd_, pending_, pendingLen_);
+        if (writeRet < 0 && errno == EINTR)
+            continue;
+        if (writeRet < 0 && errno == EAGAIN)
+        {
+            struct pollfd pfd = { fd_, POLLOUT, 0 };
+            if (msec == 0 || poll(&pfd, 1, msec) <= 0)
+                return true;
+            continue;
+        }
+        if (writeRet <= 0)
+            return false;
+
+        pendingLen_ -= writeRet;
+        memmove(pending_, pending_ + writeRet, pendingLen_);
+    }
+}
+
+void BinaryLog::run()
+{
+    struct pollfd pfd = { wakeFd_, POLLIN, 0 };
+    while (poll(&pfd, 1, LOG_FLUSH_MSEC) >= 0 || errno == EINTR)
+    {
+        /* Records of a broken sink are taken from ring and dropped */
+        if (!flush(0))
+        {
+            close(fd_);
+            fd_ = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        }
+
+        if (pfd.revents)
+            break;
+    }
+}
+
+/* Open a nonblocking sink, a unix socket or a file at path, or stdout */
+static int open_sink(const char *path)
+{
+    struct stat st;
+    if (path && stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof addr.sun_path)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, path);
+
+        const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof addr) != 0)
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    if (path)
+        return open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK | O_CLOEXEC, 0644);
+
+    /* Pipe or terminal is shared, flags of a new file description are our own */
+    if (fstat(STDOUT_FILENO, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)))
+    {
+        const int fd = open("/proc/self/fd/1", O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC);
+        if (fd >= 0)
+            return fd;
+    }
+
+    return fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+}
+
+bool BinaryLog::start(const char *path)
+{
+    fd_ = open_sink(path);
+    if (fd_ < 0)
+        return false;
+
+    wakeFd_ = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd_ < 0)
+    {
+        close(fd_);
+        fd_ = -1;
+        return false;
+    }
+
+    owner_ = getpid();
+    binary_ = path != nullptr;
+
+    /* Binary log starts with a record that tells what it is */
+    if (binary_)
+    {
+        struct LogRecord opened = {};
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        opened.usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        opened.event = LOG_OPENED;
+        opened.level = LOG_LEVEL_INFO;
+        opened.argc = 3;
+        opened.args[0].u = LOG_VERSION;
+        opened.args[1].u = sizeof opened;
+        opened.args[2].u = LOG_MAGIC;
+        pendingLen_ = put(pending_, opened);
+    }
+
+    /* Signals stay with main thread, e.g. SIGCHLD of a signalfd and SIGPIPE of sink */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    thread_ = std::thread(&BinaryLog::run, this);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return true;
+}
+
+void BinaryLog::stop()
+{
+    if (owner_ != getpid() || !thread_.joinable())
+        return;
+
+    const uint64_t one = 1;
+    if (::write(wakeFd_, &one, sizeof one) != sizeof one)
+        perror("write(eventfd)");
+    thread_.join();
+
+    /* Frontend reads stdout after exit, a full pipe can not hold exit */
+    sigset_t pipeSignal, old;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, &old);
+    flush(LOG_EXIT_WAIT_MSEC);
+
+    /* Closed reader is not worth dying for, its signal is taken */
+    const struct timespec now = { 0, 0 };
+    sigtimedwait(&pipeSignal, NULL, &now);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    close(wakeFd_);
+    close(fd_);
+    wakeFd_ = fd_ = -1;
+}
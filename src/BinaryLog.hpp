@@ -0,0 +1,182 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef BINARYLOG_HPP
+#define BINARYLOG_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <initializer_list>
+#include <thread>
+
+/* Records waiting for the flusher, a power of two */
+#define LOG_RING_RECORDS 1024
+
+/* Numeric arguments of a record, text fills the slots after them */
+#define LOG_ARGS_MAX 6
+
+/* Time between flushes, and time to wait for a full sink at exit, in milliseconds */
+#define LOG_FLUSH_MSEC 100
+#define LOG_EXIT_WAIT_MSEC 100
+
+/* First record of a binary log, "wslb2log" in memory of a little endian machine */
+#define LOG_MAGIC 0x676f6c3262736c77ULL
+#define LOG_VERSION 1
+
+enum LogLevel
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+};
+
+/* Events have a fixed format, see log_format(), new ones go at the end */
+enum LogEvent
+{
+    LOG_OPENED,
+    LOG_DROPPED,
+    LOG_CONNECTED,
+    LOG_RESIZE,
+    LOG_COMPRESS_OFF,
+    LOG_SESSION_TOOK,
+    LOG_SESSION_KEPT,
+    LOG_SESSION_ATTACHED,
+    LOG_SESSION_DETACHED,
+    LOG_PTY_CHILD,
+    LOG_PIPE_CHILD,
+    LOG_ENGINE,
+    LOG_URING_UNSUPPORTED,
+    LOG_URING_UNAVAILABLE,
+    LOG_SPLICE_UNSUPPORTED,
+    LOG_SPLICE_UNAVAILABLE,
+    LOG_SPLICE_REFUSED,
+    LOG_CHILD_EXIT,
+    LOG_PIPE_STATS,
+    LOG_URING_READS,
+    LOG_URING_BYTES,
+    LOG_SPLICED,
+    LOG_POLL_READS,
+    LOG_POLL_BYTES,
+    LOG_DEFLATE_STATS,
+    LOG_QUEUE_STATS,
+    LOG_RESIZE_STATS,
+    LOG_MODE_STATS,
+    LOG_BUFFER_STATS,
+    LOG_SCREEN_STATS,
+    LOG_SESSION_STATS,
+    LOG_RECORDER,
+    LOG_EVENTS,
+};
+
+union LogValue
+{
+    int64_t i;
+    uint64_t u;
+    double f;
+    char text[8];
+};
+
+/* Record as it is in the ring and in a binary log, 64 bytes */
+struct LogRecord
+{
+    uint64_t usec;      /* Wall clock time */
+    uint32_t pid;
+    uint16_t event;
+    uint8_t level;
+    uint8_t argc;
+    union LogValue args[LOG_ARGS_MAX];
+};
+
+/* Numeric argument of a record, converted from any integer or double */
+struct LogArg
+{
+    union LogValue value;
+
+    LogArg(int v) { value.i = v; }
+    LogArg(long v) { value.i = v; }
+    LogArg(long long v) { value.i = v; }
+    LogArg(unsigned int v) { value.u = v; }
+    LogArg(unsigned long v) { value.u = v; }
+    LogArg(unsigned long long v) { value.u = v; }
+    LogArg(double v) { value.f = v; }
+};
+
+/*
+ * Log of the backend in fixed size records. Writing a record claims a slot
+ * of a lock-free ring and fills it, it never makes a syscall or waits, so
+ * logging can not stall the relay loop. A full ring drops the record.
+ *
+ * A flusher thread moves records to the sink every LOG_FLUSH_MSEC, as
+ * binary records to a file or unix socket of --log, or as text lines to
+ * stdout. The sink is written without blocking, a sink that does not take
+ * them keeps records in the ring until it fills up, and the count of
+ * dropped records is logged when the sink takes them again. Stdout of the
+ * backend is a pipe that frontend reads only after the backend exits, so
+ * it gets its own nonblocking file description. wslbridge2-logdump turns
+ * a binary log into text. Errors are still printed to stderr at once.
+ */
+class BinaryLog
+{
+private:
+    struct Slot
+    {
+        std::atomic<uint32_t> turn;   /* Position it is free for, position + 1 when full */
+        struct LogRecord record;
+    };
+
+    struct Slot ring_[LOG_RING_RECORDS];
+    std::atomic<uint32_t> head_;
+    std::atomic<unsigned long long> dropped_;
+    uint32_t tail_ = 0;
+    int level_ = LOG_LEVEL_DEBUG;
+    int fd_ = -1;
+    int wakeFd_ = -1;
+    bool binary_ = false;
+    pid_t owner_ = 0;
+    std::thread thread_;
+    unsigned long long reported_ = 0;
+    size_t pendingLen_ = 0;
+    char pending_[LOG_RING_RECORDS / 8 * 128];
+
+    void run();
+    bool flush(int msec);
+    size_t take(char *out, size_t size);
+    size_t put(char *out, const struct LogRecord &record);
+
+public:
+    BinaryLog();
+    ~BinaryLog();
+
+    /* Start flusher, to binary log at path or to stdout if it is null */
+    bool start(const char *path);
+
+    /* Flush all records and stop flusher, only in the process that started it */
+    void stop();
+
+    void setLevel(int level) { level_ = level; }
+    void write(int level, int event, std::initializer_list<LogArg> args,
+        const char *text = nullptr);
+    void write(int level, int event, const char *text)
+    {
+        write(level, event, {}, text);
+    }
+    void write(int level, int event) { write(level, event, {}, nullptr); }
+
+    unsigned long long dropped() const { return dropped_.load(); }
+};
+
+/* Level of name, -1 if it is unknown */
+int log_level(const char *name);
+
+/* Text line of record without newline, returns its length */
+size_t log_format(const struct LogRecord &record, char *out, size_t size);
+
+extern BinaryLog g_log;
+
+#endif /* BINARYLOG_HPP */
@@ -0,0 +1,58 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "BufferTuner.hpp"
+#include "common.hpp"
+#include "nix-sock.h"
+
+BufferTuner::BufferTuner(int sock, bool enabled) :
+    sock_(sock),
+    enabled_(enabled)
+{
+    if (enabled_)
+        apply(false);
+}
+
+void BufferTuner::apply(bool large)
+{
+    if (nix_sock_set_buffer(sock_, large ? TUNE_LARGE_BUFFER : TUNE_SMALL_BUFFER) != 0)
+        perror("setsockopt(buffer)");
+    large_ = large;
+}
+
+void BufferTuner::update(size_t len)
+{
+    if (!enabled_)
+        return;
+
+    /* Periods without any output are not bulk either */
+    const uint64_t now = monotonic_usec();
+    const bool interactive = now - lastUpdate_ >= TUNE_IDLE_USEC;
+    lastUpdate_ = now;
+    if (now - periodStart_ >= TUNE_PERIOD_USEC)
+    {
+        const bool bulk = periodBytes_ >= TUNE_BULK_BYTES &&
+                          now - periodStart_ < 2 * TUNE_PERIOD_USEC;
+        bulkPeriods_ = bulk ? bulkPeriods_ + 1 : 0;
+        periodStart_ = now;
+        periodBytes_ = 0;
+    }
+    periodBytes_ += len;
+
+    if (large_ && (interactive || bulkPeriods_ == 0))
+    {
+        apply(false);
+        shrinks_++;
+    }
+    else if (!large_ && !interactive && bulkPeriods_ >= TUNE_BULK_PERIODS)
+    {
+        apply(true);
+        grows_++;
+    }
+}
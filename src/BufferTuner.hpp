@@ -0,0 +1,58 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef BUFFERTUNER_HPP
+#define BUFFERTUNER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Connection buffers of --buffer auto while interactive and during bulk output */
+#define TUNE_SMALL_BUFFER 16384
+#define TUNE_LARGE_BUFFER (1024 * 1024)
+
+/* Output is bulk when a period has this much, sustained when it lasts */
+#define TUNE_PERIOD_USEC 100000
+#define TUNE_BULK_BYTES 262144
+#define TUNE_BULK_PERIODS 3
+
+/* Output after this much silence is interactive, e.g. a keystroke echo */
+#define TUNE_IDLE_USEC 10000
+
+/*
+ * Sizes buffers of output connection by what it carries, see --buffer.
+ * Small buffers keep little output queued in front of a keystroke echo,
+ * large buffers move a flood in fewer and larger writes. Buffers grow
+ * when output is bulk for some periods in a row and shrink as soon as a
+ * period is not bulk or output is interactive.
+ */
+class BufferTuner
+{
+private:
+    int sock_;
+    bool enabled_;
+    bool large_ = false;
+    uint64_t periodStart_ = 0;
+    uint64_t lastUpdate_ = 0;
+    size_t periodBytes_ = 0;
+    unsigned int bulkPeriods_ = 0;
+    unsigned long grows_ = 0;
+    unsigned long shrinks_ = 0;
+
+    void apply(bool large);
+
+public:
+    BufferTuner(int sock, bool enabled);
+
+    /* Account output about to be sent, buffers change before it is sent. */
+    void update(size_t len);
+
+    bool enabled() const { return enabled_; }
+    unsigned long grows() const { return grows_; }
+    unsigned long shrinks() const { return shrinks_; }
+};
+
+#endif /* BUFFERTUNER_HPP */
@@ -0,0 +1,82 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ChildWatcher.hpp"
+
+ChildWatcher::~ChildWatcher()
+{
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+/* Open fd of child exit, false if kernel has neither pidfd nor signalfd */
+bool ChildWatcher::start()
+{
+#ifdef SYS_pidfd_open
+    fd_ = syscall(SYS_pidfd_open, child_, 0);
+    if (fd_ >= 0)
+        return true;
+#endif
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
+        return false;
+
+    fd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    signalFd_ = fd_ >= 0;
+
+    /* Child may have exited before SIGCHLD was blocked */
+    reap();
+    return signalFd_;
+}
+
+/* Reap child if it exited, false if it still runs */
+bool ChildWatcher::reap()
+{
+    if (exitStatus_ >= 0)
+        return true;
+
+    if (signalFd_)
+    {
+        struct signalfd_siginfo info;
+        while (read(fd_, &info, sizeof info) == sizeof info)
+            ;
+    }
+
+    int status;
+    pid_t ret;
+    while ((ret = waitpid(child_, &status, WNOHANG)) < 0 && errno == EINTR)
+        ;
+    if (ret != child_)
+        return false;
+
+    /* Shell style, 128 + signal number if child was killed */
+    exitStatus_ = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+    return true;
+}
+
+/* Wait up to msec for exit of child, false if it still runs */
+bool ChildWatcher::wait(int msec)
+{
+    struct pollfd pfd = { fd_, POLLIN, 0 };
+    while (!reap())
+    {
+        if (poll(&pfd, 1, msec) <= 0)
+            return reap();
+    }
+
+    return true;
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef CHILDWATCHER_HPP
+#define CHILDWATCHER_HPP
+
+#include <sys/types.h>
+
+/* Time to wait for exit of child after its pty hung up, in milliseconds */
+#define CHILD_EXIT_WAIT_MSEC 1000
+
+/*
+ * Exit of the child in pty as an fd for the relay loop, a pidfd that is
+ * readable once the child exited, or a signalfd of blocked SIGCHLD on
+ * kernels without pidfd, e.g. WSL1. No signal handler closes the
+ * connection, so the loop reads what is left in the pty and sends it
+ * before the exit status. The child is reaped here for its status.
+ */
+class ChildWatcher
+{
+private:
+    pid_t child_;
+    int fd_ = -1;
+    bool signalFd_ = false;
+    int exitStatus_ = -1;
+
+public:
+    ChildWatcher(pid_t child) : child_(child) {}
+    ~ChildWatcher();
+
+    bool start();
+    bool reap();
+    bool wait(int msec);
+
+    int fd() const { return fd_; }
+    bool exited() const { return exitStatus_ >= 0; }
+    int exitStatus() const { return exitStatus_; }
+};
+
+#endif /* CHILDWATCHER_HPP */
@@ -0,0 +1,104 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "DeflateStream.hpp"
+
+/* Negative window bits select raw deflate without zlib header and checksum */
+#define DEFLATE_WINDOW_BITS -15
+
+static unsigned long long thread_cpu_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+Deflater::~Deflater()
+{
+    if (ready_)
+        deflateEnd(&stream_);
+}
+
+bool Deflater::init(int level)
+{
+    memset(&stream_, 0, sizeof stream_);
+    ready_ = deflateInit2(&stream_, level, Z_DEFLATED, DEFLATE_WINDOW_BITS,
+                8, Z_DEFAULT_STRATEGY) == Z_OK;
+    return ready_;
+}
+
+/* Compress buf into out, return compressed length or 0 on error */
+size_t Deflater::compress(const char *buf, size_t len, char *out, size_t outLen)
+{
+    const unsigned long long start = thread_cpu_usec();
+
+    stream_.next_in = (Bytef *)buf;
+    stream_.avail_in = len;
+    stream_.next_out = (Bytef *)out;
+    stream_.avail_out = outLen;
+
+    /* Output must be complete even if avail_out is exactly used up */
+    const int ret = deflate(&stream_, Z_SYNC_FLUSH);
+    if (ret != Z_OK || stream_.avail_in != 0 || stream_.avail_out == 0)
+        return 0;
+
+    const size_t outUsed = outLen - stream_.avail_out;
+    bytesIn_ += len;
+    bytesOut_ += outUsed;
+    cpuUsec_ += thread_cpu_usec() - start;
+    return outUsed;
+}
+
+Inflater::~Inflater()
+{
+    if (ready_)
+        inflateEnd(&stream_);
+}
+
+/* Decompress payload of compressed frames and write it to fd */
+ssize_t Inflater::inflate_to(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (!ready_)
+    {
+        memset(&stream_, 0, sizeof stream_);
+        if (inflateInit2(&stream_, DEFLATE_WINDOW_BITS) != Z_OK)
+            return -1;
+        ready_ = true;
+    }
+
+    ssize_t written = 0;
+    char out[16384];
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        stream_.next_in = (Bytef *)iov[i].iov_base;
+        stream_.avail_in = iov[i].iov_len;
+
+        do
+        {
+            stream_.next_out = (Bytef *)out;
+            stream_.avail_out = sizeof out;
+
+            const int ret = inflate(&stream_, Z_SYNC_FLUSH);
+            if (ret != Z_OK && ret != Z_BUF_ERROR)
+                return -1;
+
+            struct iovec outIov = { out, sizeof out - stream_.avail_out };
+            if (outIov.iov_len && !writev_all(fd, &outIov, 1))
+                return -1;
+            written += outIov.iov_len;
+        }
+        while (stream_.avail_in > 0 || stream_.avail_out == 0);
+    }
+
+    return written;
+}
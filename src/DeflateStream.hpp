@@ -0,0 +1,54 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef DEFLATESTREAM_HPP
+#define DEFLATESTREAM_HPP
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/* Fast levels keep up with the pty, higher levels are rarely worth it */
+#define COMPRESS_DEFAULT_LEVEL 1
+
+/*
+ * Raw deflate stream over terminal output frames. Each compressed frame is
+ * flushed to a byte boundary, so the frontend can write it out at once, but
+ * the dictionary is kept for the whole session.
+ */
+class Deflater
+{
+private:
+    z_stream stream_;
+    bool ready_ = false;
+    unsigned long long bytesIn_ = 0;
+    unsigned long long bytesOut_ = 0;
+    unsigned long long cpuUsec_ = 0;
+
+public:
+    ~Deflater();
+
+    bool init(int level);
+    size_t compress(const char *buf, size_t len, char *out, size_t outLen);
+
+    unsigned long long bytesIn() const { return bytesIn_; }
+    unsigned long long bytesOut() const { return bytesOut_; }
+    unsigned long long cpuUsec() const { return cpuUsec_; }
+};
+
+class Inflater
+{
+private:
+    z_stream stream_;
+    bool ready_ = false;
+
+public:
+    ~Inflater();
+
+    ssize_t inflate_to(int fd, const struct iovec *iov, int iovcnt);
+};
+
+#endif /* DEFLATESTREAM_HPP */
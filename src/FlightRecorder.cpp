@@ -0,0 +1,143 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "FlightRecorder.hpp"
+
+/* Numbers tried for a dump whose file exists */
+#define RECORDER_DUMP_TRIES 100
+
+FlightRecorder g_recorder;
+
+bool FlightRecorder::start(unsigned int events, pid_t child)
+{
+    if (events == 0)
+        return true;
+
+    uint64_t capacity = 1;
+    while (capacity < events && capacity < RECORDER_MAX_EVENTS)
+        capacity <<= 1;
+
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(path_, sizeof path_, "%s/wslbridge2-backend.%d.rec",
+        tmpdir && *tmpdir ? tmpdir : "/tmp", (int)getpid());
+
+    /* TMPDIR may be shared, a file or link of this name is not written through */
+    const int fd = open(path_, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return false;
+
+    mapSize_ = sizeof(struct RecordHeader) + capacity * sizeof(struct RecordEvent);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, mapSize_) == 0)
+        map = mmap(NULL, mapSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const int err = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        unlink(path_);
+        errno = err;
+        return false;
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    const uint64_t mono = clock();
+
+    header_ = (struct RecordHeader *)map;
+    memcpy(header_->magic, RECORDER_MAGIC, sizeof header_->magic);
+    header_->version = RECORDER_VERSION;
+    header_->eventSize = sizeof(struct RecordEvent);
+    header_->capacity = capacity;
+    header_->pid = getpid();
+    header_->child = child;
+    header_->wallOffset = (int64_t)((uint64_t)wall.tv_sec * 1000000000 + wall.tv_nsec - mono);
+    header_->startTime = mono;
+
+    events_ = (struct RecordEvent *)(header_ + 1);
+    mask_ = capacity - 1;
+    owner_ = getpid();
+    return true;
+}
+
+void FlightRecorder::stop()
+{
+    if (!events_ || getpid() != owner_)
+        return;
+
+    events_ = nullptr;
+    munmap(header_, mapSize_);
+    header_ = nullptr;
+    unlink(path_);
+}
+
+/* Only syscalls, it is called in a signal handler */
+void FlightRecorder::discard()
+{
+    if (events_ && getpid() == owner_)
+        unlink(path_);
+}
+
+/* Path of recorder file and number of the dump, no stdio in a signal handler */
+const char *FlightRecorder::dump(char *dumpPath)
+{
+    struct RecordHeader *header = header_;
+    if (!header)
+        return nullptr;
+
+    /* Number of a dump left by an earlier backend of this pid, or of a planted file, is skipped */
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < RECORDER_DUMP_TRIES; tries++)
+    {
+        char number[16];
+        size_t len = sizeof number;
+        unsigned int n = __atomic_add_fetch(&dumps_, 1, __ATOMIC_RELAXED);
+        do
+        {
+            number[--len] = '0' + n % 10;
+            n /= 10;
+        } while (n);
+
+        const size_t pathLen = strlen(path_);
+        memcpy(dumpPath, path_, pathLen);
+        dumpPath[pathLen] = '.';
+        memcpy(dumpPath + pathLen + 1, number + len, sizeof number - len);
+        dumpPath[pathLen + 1 + sizeof number - len] = '\0';
+
+        fd = open(dumpPath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0 && errno != EEXIST)
+            return nullptr;
+    }
+    if (fd < 0)
+        return nullptr;
+
+    /* Copy has the time of dump, an event that did not finish ended before it */
+    struct RecordHeader copy = *header;
+    copy.dumpTime = clock();
+
+    size_t done = 0;
+    while (done < mapSize_)
+    {
+        const char *buf = done < sizeof copy ? (const char *)&copy : (const char *)header;
+        const size_t end = done < sizeof copy ? sizeof copy : mapSize_;
+        const ssize_t ret = write(fd, buf + done, end - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    close(fd);
+    return done == mapSize_ ? dumpPath : nullptr;
+}
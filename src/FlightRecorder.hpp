@@ -0,0 +1,190 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef FLIGHTRECORDER_HPP
+#define FLIGHTRECORDER_HPP
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Default count of events kept, rounded up to a power of two */
+#define RECORDER_DEFAULT_EVENTS 8192
+#define RECORDER_MAX_EVENTS (1 << 20)
+
+/* Size of path of a dump, recorder file and its number */
+#define RECORDER_DUMP_PATH_MAX (PATH_MAX + 16)
+
+/* Recorder file starts with "wslb2rec" */
+#define RECORDER_MAGIC "wslb2rec"
+#define RECORDER_VERSION 1
+
+/* Events have a fixed meaning of value, see wslbridge2-timeline, new ones go at the end */
+enum RecordType
+{
+    RECORD_WAIT,        /* ppoll or io_uring_enter, ready fds | RECORD_WAIT_* flags */
+    RECORD_INPUT_READ,  /* recv of input socket, bytes or -errno */
+    RECORD_PTY_WRITE,   /* Queued input written to pty, bytes */
+    RECORD_PTY_READ,    /* Read of pty output, bytes or -errno */
+    RECORD_SEND,        /* Staged output sent or queued, bytes */
+    RECORD_DRAIN,       /* Queued output sent, bytes */
+    RECORD_WINDOW,      /* Frontend granted output window, bytes */
+    RECORD_RESIZE,      /* Window size applied to pty, cols << 16 | rows */
+    RECORD_SIGNAL,      /* Signal sent to foreground process of pty */
+    RECORD_CHILD_EXIT,  /* Exit status of child */
+    RECORD_ATTACH,      /* Frontend attached to session, output missed */
+    RECORD_DETACH,      /* Connection of session broke */
+    RECORD_DUMP,        /* Dump requested in control channel, number of the dump */
+    RECORD_TYPES,
+};
+
+/* What the relay loop was waiting for, besides the ready count */
+#define RECORD_WAIT_SOCKET  0x100   /* Output queued for a full socket */
+#define RECORD_WAIT_WINDOW  0x200   /* Pty not read, frontend window is used up */
+#define RECORD_WAIT_PTY     0x400   /* Input queued for a full pty */
+
+/* Start of recorder file, 64 bytes */
+struct RecordHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t eventSize;
+    uint32_t capacity;      /* Events in file after header, a power of two */
+    uint32_t pid;
+    uint32_t child;
+    uint32_t reserved;
+    int64_t wallOffset;     /* Wall clock minus monotonic time, in nanoseconds */
+    uint64_t startTime;     /* Monotonic time of start, in nanoseconds */
+    uint64_t dumpTime;      /* Monotonic time of dump, 0 in file of backend */
+    uint8_t padding[8];
+};
+
+/*
+ * One event, 32 bytes. Event n is in slot (n - 1) % capacity and has
+ * seq n, seq is 0 while it is written and check has the low bits of seq,
+ * so an event that was torn by a copy or a crash is recognized.
+ */
+struct RecordEvent
+{
+    uint64_t seq;
+    uint64_t time;          /* Monotonic time of start, in nanoseconds */
+    int64_t value;
+    uint32_t duration;      /* Nanoseconds, UINT32_MAX if longer or not finished */
+    uint16_t type;
+    uint16_t check;
+};
+
+/*
+ * Last events of the relay loop in a circular buffer, for a look at what
+ * the loop did when a session stalled. The buffer is a shared mapping of
+ * a file in TMPDIR, so it is left behind with all its events when the
+ * backend crashes or is killed. Normal exit removes it.
+ *
+ * Recording an event is two reads of the clock and a few stores to the
+ * mapping, it never makes a syscall other than clock_gettime() of vDSO.
+ * dump() copies the buffer to a numbered file next to it, it is async
+ * signal safe and is called for SIGUSR2 and for a recorder request in the
+ * control channel. Each caller has its own buffer for the path of the
+ * dump, SIGUSR2 may come during a dump for a request.
+ * wslbridge2-timeline prints a buffer as a timeline.
+ */
+class FlightRecorder
+{
+private:
+    struct RecordEvent *events_ = nullptr;
+    struct RecordHeader *header_ = nullptr;
+    size_t mapSize_ = 0;
+    uint64_t mask_ = 0;
+    uint64_t seq_ = 0;
+    pid_t owner_ = 0;
+    int dumps_ = 0;
+    char path_[PATH_MAX] = "";
+
+    void fill(uint64_t seq, int type, int64_t value, uint64_t time, uint64_t duration)
+    {
+        struct RecordEvent *event = &events_[(seq - 1) & mask_];
+
+        /* Reader sees seq 0 before any other field changes */
+        __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        event->time = time;
+        event->value = value;
+        event->duration = duration < UINT32_MAX ? duration : UINT32_MAX;
+        event->type = type;
+        event->check = (uint16_t)seq;
+        __atomic_store_n(&event->seq, seq, __ATOMIC_RELEASE);
+    }
+
+public:
+    ~FlightRecorder() { stop(); }
+
+    static uint64_t clock()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    /* Map a buffer of events for this process and child, false if file can not be made */
+    bool start(unsigned int events, pid_t child);
+
+    /* Remove the buffer, only in the process that started it */
+    void stop();
+
+    /* Copy buffer to a new file, its path is written to dumpPath of RECORDER_DUMP_PATH_MAX */
+    const char *dump(char *dumpPath);
+
+    /* Remove file of a backend that is terminated, it did not crash */
+    void discard();
+
+    bool enabled() const { return events_ != nullptr; }
+    const char *path() const { return path_; }
+    unsigned long capacity() const { return mask_ + 1; }
+    int dumps() const { return __atomic_load_n(&dumps_, __ATOMIC_RELAXED); }
+
+    /* Start time of an event, nothing is read while disabled */
+    uint64_t now() const { return events_ ? clock() : 0; }
+
+    /* Event that started at now() and ends here */
+    void record(int type, int64_t value, uint64_t start)
+    {
+        if (events_)
+            fill(++seq_, type, value, start, clock() - start);
+    }
+
+    /* Event without duration */
+    void mark(int type, int64_t value)
+    {
+        if (events_)
+            fill(++seq_, type, value, clock(), 0);
+    }
+
+    /*
+     * Event that is recorded before it ends, e.g. a wait, so a dump or a
+     * crash during it shows it. finish() sets its value and duration, no
+     * other event may be recorded in between.
+     */
+    uint64_t begin(int type, int64_t value)
+    {
+        if (!events_)
+            return 0;
+
+        const uint64_t start = clock();
+        fill(++seq_, type, value, start, UINT32_MAX);
+        return start;
+    }
+
+    void finish(int type, int64_t value, uint64_t start)
+    {
+        if (events_)
+            fill(seq_, type, value, start, clock() - start);
+    }
+};
+
+extern FlightRecorder g_recorder;
+
+#endif /* FLIGHTRECORDER_HPP */
@@ -0,0 +1,178 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <string.h>
+
+#include "common.hpp"
+#include "DeflateStream.hpp"
+#include "FrameCodec.hpp"
+
+size_t frame_encode_header(char *out, uint8_t type, size_t len, uint8_t channel)
+{
+    out[0] = type;
+    out[1] = channel;
+    out[2] = len & 0xFF;
+    out[3] = (len >> 8) & 0xFF;
+    return FRAME_HEADER_LEN;
+}
+
+size_t frame_encode(char *out, uint8_t type, const void *payload, size_t len,
+    uint8_t channel)
+{
+    frame_encode_header(out, type, len, channel);
+    memcpy(out + FRAME_HEADER_LEN, payload, len);
+    return FRAME_HEADER_LEN + len;
+}
+
+size_t frame_encode_window(char *out, uint32_t credit, uint8_t channel)
+{
+    const char payload[4] = {
+        (char)(credit & 0xFF), (char)((credit >> 8) & 0xFF),
+        (char)((credit >> 16) & 0xFF), (char)((credit >> 24) & 0xFF) };
+    return frame_encode(out, FRAME_WINDOW, payload, sizeof payload, channel);
+}
+
+size_t frame_encode_exit(char *out, uint32_t status)
+{
+    const char payload[4] = {
+        (char)(status & 0xFF), (char)((status >> 8) & 0xFF),
+        (char)((status >> 16) & 0xFF), (char)((status >> 24) & 0xFF) };
+    return frame_encode(out, FRAME_EXIT, payload, sizeof payload, CHANNEL_CONTROL);
+}
+
+size_t frame_encode_stat(char *out, uint8_t id, uint64_t value)
+{
+    out[0] = id;
+    for (int i = 0; i < 8; i++)
+        out[1 + i] = (value >> (8 * i)) & 0xFF;
+    return FRAME_STAT_LEN;
+}
+
+uint32_t frame_get_u32(const char *payload)
+{
+    const unsigned char *p = (const unsigned char *)payload;
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint64_t frame_get_u64(const char *payload)
+{
+    return frame_get_u32(payload) | (uint64_t)frame_get_u32(payload + 4) << 32;
+}
+
+/*
+ * Decode as much of buf as possible and return the consumed length.
+ * Stops early when an event frame is complete or the iovec array is full,
+ * the caller should handle those and call again with the rest of buf.
+ */
+size_t FrameDecoder::decode(const char *buf, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len && !eventReady_ && iovcnt_ < FRAME_IOV_MAX)
+    {
+        if (state_ == STATE_HEADER)
+        {
+            size_t need = FRAME_HEADER_LEN - headerLen_;
+            if (need > len - pos)
+                need = len - pos;
+            memcpy(header_ + headerLen_, buf + pos, need);
+            headerLen_ += need;
+            pos += need;
+            if (headerLen_ < FRAME_HEADER_LEN)
+                break;
+
+            headerLen_ = 0;
+            type_ = header_[0];
+            channel_ = header_[1];
+            remain_ = (unsigned char)header_[2] | (unsigned char)header_[3] << 8;
+            eventLen_ = 0;
+            state_ = STATE_PAYLOAD;
+        }
+
+        size_t run = remain_ < len - pos ? remain_ : len - pos;
+        const bool terminalData = channel_ == CHANNEL_TERMINAL &&
+                                  (type_ == FRAME_DATA || type_ == FRAME_DEFLATE);
+        if (terminalData)
+        {
+            /* Plain and compressed runs are never returned together */
+            if (iovcnt_ && type_ != iovType_)
+                break;
+            iovType_ = type_;
+
+            if (run)
+            {
+                iov_[iovcnt_].iov_base = (void *)(buf + pos);
+                iov_[iovcnt_].iov_len = run;
+                iovcnt_++;
+                if (type_ == FRAME_DATA)
+                    dataBytes_ += run;
+            }
+        }
+        else
+        {
+            /* Keep what fits of event payload, the rest is dropped */
+            const size_t keep = run < FRAME_EVENT_MAX - eventLen_ ?
+                                run : FRAME_EVENT_MAX - eventLen_;
+            memcpy(event_ + eventLen_, buf + pos, keep);
+            eventLen_ += keep;
+        }
+        pos += run;
+        remain_ -= run;
+
+        if (remain_ == 0)
+        {
+            state_ = STATE_HEADER;
+            eventReady_ = !terminalData;
+        }
+    }
+
+    return pos;
+}
+
+bool FrameDecoder::takeEvent(uint8_t *type, uint8_t *channel,
+    const char **payload, size_t *len)
+{
+    if (!eventReady_)
+        return false;
+
+    *type = type_;
+    *channel = channel_;
+    *payload = event_;
+    *len = eventLen_;
+    eventReady_ = false;
+    return true;
+}
+
+bool frame_decode_to(FrameDecoder &decoder, const char *buf, size_t len,
+    int fd, FrameEventHandler onEvent, void *ctx, Inflater *inflater)
+{
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        pos += decoder.decode(buf + pos, len - pos);
+
+        if (decoder.iovcnt() && decoder.iovType() == FRAME_DEFLATE)
+        {
+            const ssize_t written = inflater ?
+                inflater->inflate_to(fd, decoder.iov(), decoder.iovcnt()) : -1;
+            if (written < 0)
+                return false;
+            decoder.addDataBytes(written);
+        }
+        else if (!writev_all(fd, decoder.iov(), decoder.iovcnt()))
+            return false;
+        decoder.clearIov();
+
+        uint8_t type, channel;
+        const char *payload;
+        size_t payloadLen;
+        if (decoder.takeEvent(&type, &channel, &payload, &payloadLen))
+            onEvent(type, channel, payload, payloadLen, ctx);
+    }
+
+    return true;
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef FRAMECODEC_HPP
+#define FRAMECODEC_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Length prefixed frames for input socket, enabled with backend --frames
+ * option. Frontends without it use NUL escaped inband information.
+ *
+ * Every frame starts with a 4 bytes header:
+ * type (1 byte), channel (1 byte), payload length (2 bytes, LE).
+ * Frames of unknown type are skipped, so new types can be added freely.
+ *
+ * Version 1 has only terminal channel and the channel byte is always 0.
+ * Version 2 multiplexes all channels in one connection with backend --mux
+ * option, both directions use frames and data is flow controlled per
+ * channel. A peer may send as much data as the window granted to it.
+ * Window is counted in uncompressed bytes.
+ */
+#define FRAME_VERSION 2
+#define FRAME_HEADER_LEN 4
+#define FRAME_PAYLOAD_MAX 0xFFFF
+
+/* Payload of events larger than this is discarded. */
+#define FRAME_EVENT_MAX 256
+
+/* Window size of each channel at start of multiplexed connection. */
+#define FRAME_WINDOW_INITIAL 0x40000
+
+/*
+ * Backend started with --daemon listens on this port and forks a session
+ * for each connection. Connection starts with a setup frame, the rest is
+ * same as a multiplexed connection. Token is shared through environment.
+ */
+#define DAEMON_DEFAULT_PORT 30582
+#define DAEMON_TOKEN_ENV "WSLBRIDGE2_TOKEN"
+
+/*
+ * Backend started with --accept listens on a port chosen by kernel and
+ * prints this line with the port to stdout. Frontend reads it from output
+ * of wsl.exe and connects, the rest is same as a multiplexed connection.
+ */
+#define ACCEPT_PORT_LINE "accept port: "
+
+#define FRAME_IOV_MAX 64
+
+enum FrameType
+{
+    FRAME_DATA = 1,     /* Raw channel data, passed as is. */
+    FRAME_RESIZE = 2,   /* struct winsize of terminal window. */
+    FRAME_SIGNAL = 3,   /* 1 byte signal number for foreground process. */
+    FRAME_CONTROL = 4,  /* 1 byte control code with optional arguments. */
+    FRAME_WINDOW = 5,   /* 4 bytes (LE) more data that peer may send. */
+    FRAME_DEFLATE = 6,  /* Channel data in raw deflate stream, see --compress. */
+    FRAME_SETUP = 7,    /* Daemon token and backend options, NUL terminated. */
+    FRAME_STATS = 8,    /* Empty request, response is a list of counters. */
+    FRAME_EXIT = 9,     /* 4 bytes (LE) exit status of command, last frame. */
+    FRAME_RECORDER = 10, /* Empty request, response is path of recorder dump. */
+};
+
+enum FrameChannel
+{
+    CHANNEL_TERMINAL = 0,   /* Terminal input and output. */
+    CHANNEL_CONTROL = 1,    /* Requests and responses about the session. */
+    CHANNEL_XSERVER = 2,    /* Reserved for X11 forwarding. */
+    CHANNEL_STDERR = 3,     /* Stderr of command in --pipe mode. */
+};
+
+enum FrameControl
+{
+    CONTROL_EOF = 1,    /* Frontend input reached end of file. */
+};
+
+/*
+ * Counters of relay loop, sent by backend in control channel of a
+ * multiplexed connection when frontend sends an empty stats frame there.
+ * Each one is 1 byte id and 8 bytes (LE) value, unknown ids are skipped.
+ */
+enum FrameStat
+{
+    STAT_UPTIME_USEC = 1,   /* Time since relay loop started. */
+    STAT_BYTES_IN = 2,      /* Input data received from frontend. */
+    STAT_BYTES_OUT = 3,     /* Output data sent to frontend, before compression. */
+    STAT_INPUT_READS = 4,   /* Reads of input socket. */
+    STAT_PTY_READS = 5,     /* Reads of pty output. */
+    STAT_SOCKET_SENDS = 6,  /* Sends of pty output to output socket. */
+    STAT_POLL_WAKEUPS = 7,  /* Returns from poll, timeouts included. */
+    STAT_SEND_USEC = 8,     /* Time relay loop was blocked sending output. */
+    STAT_RESIZES = 9,       /* Window sizes applied to pty. */
+    STAT_MODE_SWITCHES = 10, /* Output switches between interactive and bulk. */
+    STAT_BULK_USEC = 11,    /* Time output was sent in bulk mode. */
+};
+
+#define FRAME_STAT_LEN 9
+
+/* Write frame header into out, return header length. */
+size_t frame_encode_header(char *out, uint8_t type, size_t len,
+    uint8_t channel = CHANNEL_TERMINAL);
+
+/* Write whole frame into out, return frame length. */
+size_t frame_encode(char *out, uint8_t type, const void *payload, size_t len,
+    uint8_t channel = CHANNEL_TERMINAL);
+
+/* Write window update frame into out, return frame length. */
+size_t frame_encode_window(char *out, uint32_t credit,
+    uint8_t channel = CHANNEL_TERMINAL);
+
+/* Write exit status frame into out, return frame length. */
+size_t frame_encode_exit(char *out, uint32_t status);
+
+/* Write one counter of stats response into out, return its length. */
+size_t frame_encode_stat(char *out, uint8_t id, uint64_t value);
+
+/* Read 4 or 8 bytes little endian value from payload. */
+uint32_t frame_get_u32(const char *payload);
+uint64_t frame_get_u64(const char *payload);
+
+/*
+ * Incremental decoder for frames. Headers and event payloads may be split
+ * at any chunk boundary. Terminal data payloads are not copied or scanned,
+ * they are returned as iovecs pointing into the chunks passed to decode().
+ * All iovecs returned at once are either plain or compressed data.
+ * All other frames, including data of other channels, are events.
+ */
+class FrameDecoder
+{
+private:
+    enum State { STATE_HEADER, STATE_PAYLOAD };
+
+    State state_ = STATE_HEADER;
+    size_t headerLen_ = 0;
+    char header_[FRAME_HEADER_LEN];
+    uint8_t type_ = 0;
+    uint8_t channel_ = 0;
+    uint8_t iovType_ = FRAME_DATA;
+    size_t remain_ = 0;
+    unsigned long long dataBytes_ = 0;
+    size_t eventLen_ = 0;
+    bool eventReady_ = false;
+    char event_[FRAME_EVENT_MAX];
+    int iovcnt_ = 0;
+    struct iovec iov_[FRAME_IOV_MAX];
+
+public:
+    size_t decode(const char *buf, size_t len);
+
+    struct iovec *iov() { return iov_; }
+    int iovcnt() const { return iovcnt_; }
+    uint8_t iovType() const { return iovType_; }
+    void clearIov() { iovcnt_ = 0; }
+
+    /* Total terminal data decoded, used to grant window to the peer. */
+    unsigned long long dataBytes() const { return dataBytes_; }
+    void addDataBytes(size_t len) { dataBytes_ += len; }
+
+    bool takeEvent(uint8_t *type, uint8_t *channel,
+        const char **payload, size_t *len);
+};
+
+typedef void (*FrameEventHandler)(uint8_t type, uint8_t channel,
+    const char *payload, size_t len, void *ctx);
+
+class Inflater;
+
+/*
+ * Decode a chunk and write its data to fd, return false if write fails.
+ * Compressed data is an error unless inflater is given.
+ */
+bool frame_decode_to(FrameDecoder &decoder, const char *buf, size_t len,
+    int fd, FrameEventHandler onEvent, void *ctx, Inflater *inflater = nullptr);
+
+#endif /* FRAMECODEC_HPP */
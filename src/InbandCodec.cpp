@@ -0,0 +1,130 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <string.h>
+
+#include "InbandCodec.hpp"
+
+static_assert(sizeof(struct winsize) == INBAND_WINSIZE_LEN, "unexpected winsize");
+
+/*
+ * memchr() is used to find NUL characters as the C library implements it
+ * with vector instructions, so runs without NUL are skipped in wide steps.
+ */
+size_t inband_encode(const char *buf, size_t len, char *out)
+{
+    const char *end = buf + len;
+    char *pos = out;
+
+    while (buf < end)
+    {
+        const char *nul = (const char *)memchr(buf, 0, end - buf);
+        const size_t run = (nul ? nul : end) - buf;
+        memcpy(pos, buf, run);
+        pos += run;
+        buf += run;
+
+        if (nul)
+        {
+            *pos++ = 0;
+            *pos++ = INBAND_STX;
+            buf++;
+        }
+    }
+
+    return pos - out;
+}
+
+size_t inband_encode_winsize(const struct winsize *winp, char *out)
+{
+    out[0] = 0;
+    out[1] = INBAND_DLE;
+    memcpy(out + 2, winp, INBAND_WINSIZE_LEN);
+    return 2 + INBAND_WINSIZE_LEN;
+}
+
+/*
+ * Decode as much of buf as possible and return the consumed length.
+ * Stops early when a window size is complete or the iovec array is full,
+ * the caller should handle those and call again with the rest of buf.
+ */
+size_t InbandDecoder::decode(const char *buf, size_t len)
+{
+    static char nul = 0;
+    size_t pos = 0;
+
+    while (pos < len && !winsizeReady_ && iovcnt_ < INBAND_IOV_MAX)
+    {
+        switch (state_)
+        {
+            case STATE_DATA:
+            {
+                const char *found = (const char *)memchr(buf + pos, 0, len - pos);
+                const size_t run = (found ? found - buf : len) - pos;
+                if (run)
+                {
+                    iov_[iovcnt_].iov_base = (void *)(buf + pos);
+                    iov_[iovcnt_].iov_len = run;
+                    iovcnt_++;
+                    pos += run;
+                }
+                if (found)
+                {
+                    state_ = STATE_ESCAPE;
+                    pos++;
+                }
+                break;
+            }
+
+            case STATE_ESCAPE:
+                if (buf[pos] == INBAND_STX)
+                {
+                    iov_[iovcnt_].iov_base = &nul;
+                    iov_[iovcnt_].iov_len = 1;
+                    iovcnt_++;
+                    pos++;
+                }
+                else if (buf[pos] == INBAND_DLE)
+                {
+                    winsizeLen_ = 0;
+                    state_ = STATE_WINSIZE;
+                    pos++;
+                    break;
+                }
+                /* Unknown escape drops the NUL and keeps the character */
+                state_ = STATE_DATA;
+                break;
+
+            case STATE_WINSIZE:
+            {
+                size_t need = INBAND_WINSIZE_LEN - winsizeLen_;
+                if (need > len - pos)
+                    need = len - pos;
+                memcpy(winsize_ + winsizeLen_, buf + pos, need);
+                winsizeLen_ += need;
+                pos += need;
+                if (winsizeLen_ == INBAND_WINSIZE_LEN)
+                {
+                    winsizeReady_ = true;
+                    state_ = STATE_DATA;
+                }
+                break;
+            }
+        }
+    }
+
+    return pos;
+}
+
+bool InbandDecoder::takeWinsize(struct winsize *winp)
+{
+    if (!winsizeReady_)
+        return false;
+
+    memcpy(winp, winsize_, INBAND_WINSIZE_LEN);
+    winsizeReady_ = false;
+    return true;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef INBANDCODEC_HPP
+#define INBANDCODEC_HPP
+
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+/*
+ * Inband information in input socket is escaped with NUL character:
+ * NUL STX          a NUL character from the terminal.
+ * NUL DLE winsize  terminal window size changed, 8 bytes struct winsize.
+ */
+#define INBAND_STX 2
+#define INBAND_DLE 16
+#define INBAND_WINSIZE_LEN 8
+
+#define INBAND_IOV_MAX 64
+
+/* Worst case length of encoded buffer, every byte is a NUL. */
+#define INBAND_ENCODED_MAX(len) (2 * (len))
+
+/* Escape NUL characters of buf into out, return length of encoded data. */
+size_t inband_encode(const char *buf, size_t len, char *out);
+
+/* Encode window size change into out, return length of encoded data. */
+size_t inband_encode_winsize(const struct winsize *winp, char *out);
+
+/*
+ * Incremental decoder for the input socket. Escape sequences may be split
+ * at any chunk boundary, the state is kept until the next chunk arrives
+ * so the caller never has to wait for the rest of a sequence.
+ */
+class InbandDecoder
+{
+private:
+    enum State { STATE_DATA, STATE_ESCAPE, STATE_WINSIZE };
+
+    State state_ = STATE_DATA;
+    size_t winsizeLen_ = 0;
+    bool winsizeReady_ = false;
+    char winsize_[INBAND_WINSIZE_LEN];
+    int iovcnt_ = 0;
+    struct iovec iov_[INBAND_IOV_MAX];
+
+public:
+    size_t decode(const char *buf, size_t len);
+
+    /* Data runs decoded so far, they point into the chunks passed to decode(). */
+    struct iovec *iov() { return iov_; }
+    int iovcnt() const { return iovcnt_; }
+    void clearIov() { iovcnt_ = 0; }
+
+    bool takeWinsize(struct winsize *winp);
+};
+
+#endif /* INBANDCODEC_HPP */
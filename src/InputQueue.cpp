@@ -0,0 +1,89 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "InputQueue.hpp"
+
+InputQueue::InputQueue(int fd) :
+    fd_(fd)
+{
+    const int flags = fcntl(fd_, F_GETFL);
+    if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0)
+        perror("fcntl(O_NONBLOCK)");
+}
+
+/* Write what pty takes now and queue the rest, return false if pty is broken */
+bool InputQueue::write(struct iovec *iov, int iovcnt)
+{
+    /* Queued input goes first, new input can not overtake it */
+    if (!flush())
+        return false;
+
+    while (queue_.empty() && iovcnt > 0)
+    {
+        const ssize_t ret = writev(fd_, iov, iovcnt);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+        {
+            stalls_++;
+            break;
+        }
+        if (ret <= 0)
+            return false;
+
+        written_ += ret;
+        size_t done = ret;
+        while (iovcnt > 0 && done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+        queue_.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    if (queue_.size() > peak_)
+        peak_ = queue_.size();
+    return true;
+}
+
+bool InputQueue::write(const char *buf, size_t len)
+{
+    struct iovec iov = { (void *)buf, len };
+    return write(&iov, 1);
+}
+
+/* Write queued input when pty is writable, return false if pty is broken */
+bool InputQueue::flush()
+{
+    while (!queue_.empty())
+    {
+        const ssize_t ret = ::write(fd_, queue_.data(), queue_.size());
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return true;
+        if (ret <= 0)
+            return false;
+
+        written_ += ret;
+        queue_.erase(0, ret);
+    }
+
+    return true;
+}
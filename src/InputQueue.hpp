@@ -0,0 +1,52 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef INPUTQUEUE_HPP
+#define INPUTQUEUE_HPP
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "FrameCodec.hpp"
+
+/* Input socket is not read while this much input waits for the pty */
+#define INPUT_QUEUE_MAX FRAME_WINDOW_INITIAL
+
+/*
+ * Decoded input on its way to the pty master, which is non-blocking. What
+ * the pty does not take at once, e.g. a paste into a program that is busy
+ * printing, is queued and written when the pty is writable again, so the
+ * relay loop keeps forwarding output meanwhile. A full queue stops reading
+ * of the input socket. In multiplexed connection input window is granted
+ * only for written bytes, so a frontend following its window never fills
+ * the queue and window frames for output are always read.
+ */
+class InputQueue
+{
+private:
+    int fd_;
+    std::string queue_;
+    unsigned long long written_ = 0;
+    size_t peak_ = 0;
+    unsigned long stalls_ = 0;
+
+public:
+    InputQueue(int fd);
+
+    bool write(struct iovec *iov, int iovcnt);
+    bool write(const char *buf, size_t len);
+    bool flush();
+    void clear() { queue_.clear(); }
+
+    bool empty() const { return queue_.empty(); }
+    bool full() const { return queue_.size() >= INPUT_QUEUE_MAX; }
+    unsigned long long written() const { return written_; }
+    size_t peak() const { return peak_; }
+    unsigned long stalls() const { return stalls_; }
+};
+
+#endif /* INPUTQUEUE_HPP */
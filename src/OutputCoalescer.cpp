@@ -0,0 +1,357 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "FrameCodec.hpp"
+#include "OutputCoalescer.hpp"
+#include "OutputCompressor.hpp"
+#include "TrafficClassifier.hpp"
+
+OutputCoalescer::OutputCoalescer(int sock, unsigned int deadlineUsec, bool framed) :
+    sock_(sock),
+    deadlineUsec_(deadlineUsec),
+    headerLen_(framed ? FRAME_HEADER_LEN : 0)
+{
+}
+
+OutputCoalescer::~OutputCoalescer()
+{
+    unsplice();
+}
+
+/* Stage pty output in a pipe, socket must not block a splice of the relay loop */
+bool OutputCoalescer::enableSplice()
+{
+    if (pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        pipe_[0] = pipe_[1] = -1;
+        return false;
+    }
+
+    const int flags = fcntl(sock_, F_GETFL);
+    const int size = fcntl(pipe_[0], F_GETPIPE_SZ);
+    if (flags < 0 || fcntl(sock_, F_SETFL, flags | O_NONBLOCK) != 0 || size <= 0)
+    {
+        unsplice();
+        return false;
+    }
+
+    pipeCapacity_ = size / COALESCE_PAGE_SIZE;
+    return true;
+}
+
+/* Go back to the staging buffer, staged output must be moved out of the pipe */
+void OutputCoalescer::unsplice()
+{
+    if (pipe_[0] < 0)
+        return;
+
+    close(pipe_[0]);
+    close(pipe_[1]);
+    pipe_[0] = pipe_[1] = -1;
+    pipePages_ = pipeCapacity_ = 0;
+}
+
+/* Read staged output out of the pipe, all of it is there already */
+bool OutputCoalescer::readPipe(char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        const ssize_t readRet = read(pipe_[0], buf, len);
+        if (readRet < 0 && errno == EINTR)
+            continue;
+        if (readRet <= 0)
+            return false;
+
+        buf += readRet;
+        len -= readRet;
+    }
+
+    return true;
+}
+
+/* Read available pty output at the end of the staging buffer or pipe */
+ssize_t OutputCoalescer::fill(int fd)
+{
+    char *tail = buffer_ + headerLen_ + length_;
+    const size_t room = sizeof buffer_ - headerLen_ - length_;
+    ssize_t readRet = -1;
+    if (pipe_[0] >= 0)
+    {
+        readRet = splice(fd, NULL, pipe_[1], NULL, room, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (readRet > 0)
+            pipePages_ += (readRet + COALESCE_PAGE_SIZE - 1) / COALESCE_PAGE_SIZE;
+
+        /* Kernel can not splice from pty */
+        if (readRet < 0 && errno == EINVAL)
+        {
+            readPipe(buffer_ + headerLen_, length_);
+            unsplice();
+        }
+    }
+
+    if (pipe_[0] < 0)
+        readRet = read(fd, tail, room);
+    if (readRet <= 0)
+        return readRet;
+
+    const uint64_t now = monotonic_usec();
+    if (length_ == 0)
+    {
+        firstReadTime_ = now;
+        /* Nothing was read for a whole deadline, treat it as keystroke echo */
+        interactive_ = now - lastReadTime_ >= deadlineUsec_;
+    }
+
+    /* Staged bulk output may end with an echo, it is sent at once */
+    if (classifier_)
+        interactive_ = !classifier_->output(readRet);
+
+    lastReadTime_ = now;
+    length_ += readRet;
+    ptyReads_++;
+    return readRet;
+}
+
+/* Check if the staged output should be sent now */
+bool OutputCoalescer::ready()
+{
+    if (length_ == 0)
+        return false;
+
+    if (deadlineUsec_ == 0 || interactive_)
+        return true;
+
+    if (full())
+        return true;
+
+    return monotonic_usec() - firstReadTime_ >= deadlineUsec_;
+}
+
+/* Send all staged output, return false if the socket is broken */
+bool OutputCoalescer::flush()
+{
+    return flushStaged(pipe_[0] >= 0);
+}
+
+/* Send output staged in the pipe or in the buffer */
+bool OutputCoalescer::flushStaged(bool piped)
+{
+    if (length_ == 0)
+        return true;
+
+    const uint64_t start = monotonic_usec();
+    bytesOut_ += length_;
+
+    if (compressor_)
+    {
+        const size_t len = length_;
+        length_ = 0;
+        sockSends_++;
+        const bool submitted = compressor_->submit(buffer_ + headerLen_, len, interactive_);
+
+        /* Time blocked on a full queue is not idle, next read is still bulk */
+        lastReadTime_ = monotonic_usec();
+        sendUsec_ += lastReadTime_ - start;
+        if (classifier_)
+            classifier_->sent();
+        return submitted;
+    }
+
+    bool sent;
+    if (piped)
+        sent = flushPipe();
+    else
+    {
+        if (headerLen_)
+            frame_encode_header(buffer_, FRAME_DATA, length_);
+        sent = write(buffer_, headerLen_ + length_);
+    }
+
+    length_ = 0;
+    sendUsec_ += monotonic_usec() - start;
+    if (classifier_)
+        classifier_->sent();
+    return sent;
+}
+
+/* Send header and splice staged output to socket, queue a copy of what it does not take */
+bool OutputCoalescer::flushPipe()
+{
+    char header[FRAME_HEADER_LEN];
+    if (headerLen_)
+        frame_encode_header(header, FRAME_DATA, length_);
+
+    /* Queued output goes first, new output can not overtake it */
+    if (!drain())
+        return false;
+
+    size_t headerSent = 0, dataSent = 0;
+    while (queue_.empty() && headerSent < headerLen_)
+    {
+        const ssize_t sendRet = ::send(sock_, header + headerSent, headerLen_ - headerSent,
+                                       MSG_DONTWAIT | MSG_MORE);
+        if (sendRet < 0 && errno == EINTR)
+            continue;
+        if (sendRet < 0 && errno == EAGAIN)
+            break;
+        if (sendRet <= 0)
+            return false;
+
+        headerSent += sendRet;
+        sockSends_++;
+    }
+
+    bool unsupported = false;
+    while (queue_.empty() && headerSent == headerLen_ && dataSent < length_)
+    {
+        const ssize_t spliceRet = splice(pipe_[0], NULL, sock_, NULL, length_ - dataSent,
+                                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (spliceRet < 0 && errno == EINTR)
+            continue;
+        if (spliceRet < 0 && errno == EAGAIN)
+            break;
+        if (spliceRet < 0 && errno == EINVAL)
+        {
+            unsupported = true;
+            break;
+        }
+        if (spliceRet <= 0)
+            return false;
+
+        dataSent += spliceRet;
+        splicedBytes_ += spliceRet;
+        sockSends_++;
+    }
+
+    queue_.append(header + headerSent, headerLen_ - headerSent);
+    const size_t queued = queue_.size();
+    queue_.resize(queued + length_ - dataSent);
+    pipePages_ = 0;
+    if (!readPipe(&queue_[queued], length_ - dataSent))
+        return false;
+    if (queue_.size() > queuePeak_)
+        queuePeak_ = queue_.size();
+
+    /* Kernel can not splice to socket, later output is read and sent */
+    if (unsupported)
+        unsplice();
+    return true;
+}
+
+/* Send what socket takes now and queue the rest, return false if socket is broken */
+bool OutputCoalescer::write(const char *buf, size_t len)
+{
+    /* Worker of compressor sends too, the frame goes between its frames */
+    if (compressor_)
+    {
+        sockSends_++;
+        return compressor_->write(buf, len);
+    }
+
+    /* Queued output goes first, new output can not overtake it */
+    if (!drain(false))
+        return false;
+
+    size_t offset = 0;
+    while (queue_.empty() && offset < len)
+    {
+        const ssize_t sendRet = ::send(sock_, buf + offset, len - offset, MSG_DONTWAIT);
+        if (sendRet < 0 && errno == EINTR)
+            continue;
+        if (sendRet < 0 && errno == EAGAIN)
+            break;
+        if (sendRet <= 0)
+            return false;
+
+        offset += sendRet;
+        sockSends_++;
+    }
+
+    queue_.append(buf + offset, len - offset);
+    if (queue_.size() > queuePeak_)
+        queuePeak_ = queue_.size();
+    return true;
+}
+
+/* Send queued output, wait for the socket if asked, return false if it is broken */
+bool OutputCoalescer::drain(bool wait)
+{
+    while (!queue_.empty())
+    {
+        const ssize_t sendRet = ::send(sock_, queue_.data(), queue_.size(), MSG_DONTWAIT);
+        if (sendRet < 0 && errno == EINTR)
+            continue;
+        if (sendRet < 0 && errno == EAGAIN)
+        {
+            if (!wait)
+                return true;
+
+            struct pollfd pfd = { sock_, POLLOUT, 0 };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                return false;
+            continue;
+        }
+        if (sendRet <= 0)
+            return false;
+
+        queue_.erase(0, sendRet);
+        sockSends_++;
+    }
+
+    return true;
+}
+
+/* Drop staged and queued output */
+void OutputCoalescer::discard()
+{
+    if (pipe_[0] >= 0)
+        readPipe(buffer_ + headerLen_, length_);
+    pipePages_ = 0;
+    length_ = 0;
+    queue_.clear();
+}
+
+/* Send generated output after staged output, return false if socket is broken */
+bool OutputCoalescer::send(const char *buf, size_t len)
+{
+    if (!flush())
+        return false;
+
+    interactive_ = false;
+    while (len > 0)
+    {
+        const size_t room = sizeof buffer_ - headerLen_;
+        const size_t chunk = len < room ? len : room;
+        memcpy(buffer_ + headerLen_, buf, chunk);
+        length_ = chunk;
+        if (!flushStaged(false))
+            return false;
+
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+/* Time left until the staged output must be sent, nullptr to wait forever */
+struct timespec *OutputCoalescer::timeout(struct timespec *ts)
+{
+    if (length_ == 0)
+        return nullptr;
+
+    const uint64_t elapsed = monotonic_usec() - firstReadTime_;
+    const uint64_t remain = elapsed < deadlineUsec_ ? deadlineUsec_ - elapsed : 0;
+    return earliest_timeout(ts, remain, nullptr);
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef OUTPUTCOALESCER_HPP
+#define OUTPUTCOALESCER_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <string>
+
+/* Default time to hold pty output before it is sent, in microseconds */
+#define COALESCE_DEFAULT_USEC 500
+
+/* Size of staging buffer, including frame header */
+#define COALESCE_BUFFER_SIZE 16384
+
+/* Minimum free space to keep for the next pty read, smaller reads waste syscalls */
+#define COALESCE_MIN_READ 1024
+
+/* Pipe buffer page of splice path */
+#define COALESCE_PAGE_SIZE 4096
+
+/* Pty is not read while this much output waits for the socket */
+#define COALESCE_QUEUE_MAX 65536
+
+/*
+ * Collects pty output into a staging buffer and sends it to the output
+ * socket in one piece, when the buffer is nearly full or the deadline
+ * since the first staged byte is over. A read after an idle period, e.g.
+ * echo of a keystroke, is sent immediately so typing stays responsive.
+ * With a traffic classifier every read in its interactive mode is sent
+ * immediately and only bulk output is staged.
+ * In multiplexed connection the output is sent as one terminal data frame,
+ * or handed to the compressor if compression is enabled.
+ *
+ * Sending never blocks the relay loop. What the socket does not take at
+ * once is queued and sent when the socket is writable, and the loop stops
+ * reading the pty while the queue is full. Control frames of multiplexed
+ * connection are queued behind the output to keep the stream in order.
+ * The compressor sends from its worker thread, with it all sends block
+ * and control frames are sent by the compressor under its lock.
+ *
+ * With splice enabled, pty output is staged in a pipe instead of the
+ * buffer and moved to the socket with splice(), so it is never copied
+ * into user space. Only the frame header is sent from here. What the
+ * socket does not take at once is read from the pipe into the queue, so
+ * the pipe holds staged output only. If the kernel can not splice the
+ * pty or the socket, staged output is moved to the buffer and the
+ * coalescer goes on reading and sending like without splice. Output in
+ * the pipe is not in data(), so splice is not used with compressor,
+ * screen throttle or session.
+ */
+class OutputCompressor;
+class TrafficClassifier;
+
+class OutputCoalescer
+{
+private:
+    int sock_;
+    unsigned int deadlineUsec_;
+    size_t headerLen_;
+    OutputCompressor *compressor_ = nullptr;
+    TrafficClassifier *classifier_ = nullptr;
+    bool interactive_ = false;
+    size_t length_ = 0;
+    uint64_t firstReadTime_ = 0;
+    uint64_t lastReadTime_ = 0;
+    unsigned long ptyReads_ = 0;
+    unsigned long sockSends_ = 0;
+    unsigned long long bytesOut_ = 0;
+    unsigned long long sendUsec_ = 0;
+    size_t queuePeak_ = 0;
+    std::string queue_;         /* Output waiting for a writable socket */
+    int pipe_[2] = { -1, -1 };  /* Staged output of splice path */
+    size_t pipePages_ = 0;      /* Each splice from pty fills pages of its own */
+    size_t pipeCapacity_ = 0;
+    unsigned long long splicedBytes_ = 0;
+    char buffer_[COALESCE_BUFFER_SIZE];
+
+    bool readPipe(char *buf, size_t len);
+    void unsplice();
+    bool flushStaged(bool piped);
+    bool flushPipe();
+
+public:
+    OutputCoalescer(int sock, unsigned int deadlineUsec, bool framed = false);
+    ~OutputCoalescer();
+
+    /* Stage pty output in a pipe, false if the pipe can not be created */
+    bool enableSplice();
+
+    void setCompressor(OutputCompressor *compressor) { compressor_ = compressor; }
+    void setClassifier(TrafficClassifier *classifier) { classifier_ = classifier; }
+
+    ssize_t fill(int fd);
+    bool ready();
+    bool flush();
+    bool send(const char *buf, size_t len);
+    bool write(const char *buf, size_t len);
+    bool drain(bool wait = false);
+    void discard();
+    struct timespec *timeout(struct timespec *ts);
+
+    size_t length() const { return length_; }
+    const char *data() const { return buffer_ + headerLen_; }
+    void unfill(size_t len) { length_ -= len; }
+    bool full() const
+    {
+        return headerLen_ + length_ + COALESCE_MIN_READ > sizeof buffer_ ||
+               (pipe_[0] >= 0 &&
+                pipePages_ + COALESCE_BUFFER_SIZE / COALESCE_PAGE_SIZE > pipeCapacity_);
+    }
+    bool queued() const { return !queue_.empty(); }
+    size_t queueLength() const { return queue_.size(); }
+    bool blocked() const { return queue_.size() >= COALESCE_QUEUE_MAX; }
+    size_t queuePeak() const { return queuePeak_; }
+    unsigned long ptyReads() const { return ptyReads_; }
+    unsigned long sockSends() const { return sockSends_; }
+    unsigned long sendsAvoided() const
+    {
+        return ptyReads_ > sockSends_ ? ptyReads_ - sockSends_ : 0;
+    }
+    unsigned long long bytesOut() const { return bytesOut_; }
+    unsigned long long sendUsec() const { return sendUsec_; }
+    bool spliced() const { return pipe_[0] >= 0; }
+    unsigned long long splicedBytes() const { return splicedBytes_; }
+};
+
+#endif /* OUTPUTCOALESCER_HPP */
@@ -0,0 +1,139 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <string.h>
+#include <sys/uio.h>
+
+#include "common.hpp"
+#include "OutputCompressor.hpp"
+
+/* Send one frame with header and payload, return false if socket is broken */
+static bool send_frame(int sock, uint8_t type, const char *payload, size_t len)
+{
+    char header[FRAME_HEADER_LEN];
+    frame_encode_header(header, type, len);
+
+    struct iovec iov[] = {
+        { header, sizeof header },
+        { (void *)payload, len }
+    };
+    return writev_all(sock, iov, ARRAYSIZE(iov));
+}
+
+OutputCompressor::OutputCompressor(int sock) :
+    sock_(sock)
+{
+}
+
+OutputCompressor::~OutputCompressor()
+{
+    if (thread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            cond_.notify_all();
+        }
+        thread_.join();
+    }
+}
+
+bool OutputCompressor::start(int level)
+{
+    if (!deflater_.init(level))
+        return false;
+
+    thread_ = std::thread(&OutputCompressor::run, this);
+    return true;
+}
+
+/* Send or queue a batch of output, return false if socket is broken */
+bool OutputCompressor::submit(const char *data, size_t len, bool interactive)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const bool compress = !interactive && len >= COMPRESS_MIN_LEN;
+
+    /* Worker is idle, nothing can be reordered */
+    if (!compress && count_ == 0)
+    {
+        plainBatches_++;
+        std::lock_guard<std::mutex> sendLock(sendMutex_);
+        return !broken_ && send_frame(sock_, FRAME_DATA, data, len);
+    }
+
+    cond_.wait(lock, [this] { return count_ < COMPRESS_QUEUE_LEN || broken_; });
+    if (broken_)
+        return false;
+
+    Batch &batch = queue_[(head_ + count_) % COMPRESS_QUEUE_LEN];
+    memcpy(batch.data, data, len);
+    batch.len = len;
+    batch.compress = compress;
+    count_++;
+    cond_.notify_all();
+    return true;
+}
+
+/* Wait until all queued batches are sent */
+bool OutputCompressor::drain()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return count_ == 0 || broken_; });
+    return !broken_;
+}
+
+/* Send frames of relay loop between frames of worker, return false if socket is broken */
+bool OutputCompressor::write(const char *buf, size_t len)
+{
+    std::lock_guard<std::mutex> sendLock(sendMutex_);
+    struct iovec iov = { (void *)buf, len };
+    return writev_all(sock_, &iov, 1);
+}
+
+bool OutputCompressor::sendBatch(const Batch &batch)
+{
+    if (!batch.compress)
+    {
+        std::lock_guard<std::mutex> sendLock(sendMutex_);
+        return send_frame(sock_, FRAME_DATA, batch.data, batch.len);
+    }
+
+    const size_t len = deflater_.compress(batch.data, batch.len,
+                            deflated_, sizeof deflated_);
+    if (len == 0 || len > FRAME_PAYLOAD_MAX)
+        return false;
+
+    std::lock_guard<std::mutex> sendLock(sendMutex_);
+    return send_frame(sock_, FRAME_DEFLATE, deflated_, len);
+}
+
+void OutputCompressor::run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (1)
+    {
+        cond_.wait(lock, [this] { return count_ > 0 || stop_; });
+        if (count_ == 0)
+            break;
+
+        /* Batch stays queued while it is sent, relay loop sees worker busy */
+        const Batch &batch = queue_[head_];
+        lock.unlock();
+        const bool sent = sendBatch(batch);
+        lock.lock();
+
+        if (!sent)
+            broken_ = true;
+        else if (batch.compress)
+            deflateBatches_++;
+        else
+            plainBatches_++;
+        head_ = (head_ + 1) % COMPRESS_QUEUE_LEN;
+        count_--;
+        cond_.notify_all();
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef OUTPUTCOMPRESSOR_HPP
+#define OUTPUTCOMPRESSOR_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "DeflateStream.hpp"
+#include "FrameCodec.hpp"
+#include "OutputCoalescer.hpp"
+
+/* Output batches smaller than this are not worth compressing */
+#define COMPRESS_MIN_LEN 512
+
+/* Batches waiting for the worker thread before the relay loop blocks */
+#define COMPRESS_QUEUE_LEN 4
+
+/*
+ * Compresses terminal output batches in a worker thread and sends them to
+ * the output socket as deflate frames. Interactive and small batches are
+ * sent uncompressed, directly from the relay loop when nothing is queued,
+ * so keystroke echo never waits for the worker. Every frame, also control
+ * frames of the relay loop, is sent under one lock, so a frame is never
+ * sent into the middle of another one.
+ */
+class OutputCompressor
+{
+private:
+    struct Batch
+    {
+        size_t len;
+        bool compress;
+        char data[COALESCE_BUFFER_SIZE];
+    };
+
+    int sock_;
+    Deflater deflater_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::mutex sendMutex_;  /* Held while a frame is sent */
+    std::condition_variable cond_;
+    Batch queue_[COMPRESS_QUEUE_LEN];
+    size_t head_ = 0;
+    size_t count_ = 0;   /* Includes the batch being sent by worker */
+    bool stop_ = false;
+    bool broken_ = false;
+    unsigned long plainBatches_ = 0;
+    unsigned long deflateBatches_ = 0;
+
+    /* Large enough for a sync flushed deflate of a whole batch */
+    char deflated_[COALESCE_BUFFER_SIZE + 1024];
+
+    void run();
+    bool sendBatch(const Batch &batch);
+
+public:
+    OutputCompressor(int sock);
+    ~OutputCompressor();
+
+    bool start(int level);
+    bool submit(const char *data, size_t len, bool interactive);
+    bool drain();
+    bool write(const char *buf, size_t len);
+
+    unsigned long plainBatches() const { return plainBatches_; }
+    unsigned long deflateBatches() const { return deflateBatches_; }
+    unsigned long long bytesIn() const { return deflater_.bytesIn(); }
+    unsigned long long bytesOut() const { return deflater_.bytesOut(); }
+    unsigned long long cpuUsec() const { return deflater_.cpuUsec(); }
+};
+
+#endif /* OUTPUTCOMPRESSOR_HPP */
@@ -0,0 +1,414 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "common.hpp"
+#include "PipeRelay.hpp"
+
+static void set_nonblock(int fd)
+{
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        perror("fcntl(O_NONBLOCK)");
+}
+
+PipeRelay::PipeRelay(int sock, int stdinFd, int stdoutFd, int stderrFd, pid_t child) :
+    sock_(sock),
+    stdin_(stdinFd),
+    stdout_(stdoutFd),
+    stderr_(stderrFd),
+    child_(child),
+    watcher_(child)
+{
+    set_nonblock(sock_);
+    set_nonblock(stdin_);
+    set_nonblock(stdout_);
+    set_nonblock(stderr_);
+
+    /* Not fatal, default pipes of 64KB only splice less per call */
+    if (fcntl(stdin_, F_SETPIPE_SZ, PIPE_RELAY_PIPE_SIZE) < 0 ||
+        fcntl(stdout_, F_SETPIPE_SZ, PIPE_RELAY_PIPE_SIZE) < 0)
+        perror("fcntl(F_SETPIPE_SZ)");
+
+    if (!watcher_.start())
+        perror("pidfd_open and signalfd");
+}
+
+bool PipeRelay::run()
+{
+    while (1)
+    {
+        /* Output is over and child exited, exit status is the last frame */
+        if (stdout_ < 0 && stderr_ < 0 && exitStatus_ < 0 && outRemain_ == 0 &&
+            watcher_.exited())
+            queueExit();
+
+        const bool sending = outHeaderLeft_ || outRemain_ || !control_.empty();
+        if (exitStatus_ >= 0 && !sending)
+            return true;
+
+        short sockEvents = sending ? POLLOUT : 0;
+        if (inBuffer_.size() < PIPE_RELAY_INPUT_MAX)
+            sockEvents |= POLLIN;
+
+        struct pollfd fds[] = {
+            { sock_, sockEvents, 0 },
+            { sending || outputWindow_ <= 0 ? -1 : stdout_, POLLIN, 0 },
+            { control_.size() < PIPE_RELAY_CONTROL_MAX ? stderr_ : -1, POLLIN, 0 },
+            { inBuffer_.empty() ? -1 : stdin_, POLLOUT, 0 },
+            { watcher_.exited() ? -1 : watcher_.fd(), POLLIN, 0 },
+        };
+
+        if (poll(fds, ARRAYSIZE(fds), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return false;
+        }
+
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && (sockEvents & POLLIN))
+        {
+            if (!receive())
+                return false;
+        }
+        else if (fds[0].revents & (POLLHUP | POLLERR))
+            return false;
+
+        if (fds[3].revents)
+            writeInput();
+
+        if (fds[4].revents)
+            watcher_.reap();
+
+        if (fds[2].revents)
+            readStderr();
+
+        if (fds[1].revents)
+            startOutput(fds[1].revents & POLLHUP);
+
+        if (!flush())
+            return false;
+    }
+}
+
+/* Receive next piece of input frame, false if connection is closed */
+bool PipeRelay::receive()
+{
+    if (inSplice_)
+        return spliceInput();
+
+    ssize_t ret;
+    if (inHeaderLen_ < FRAME_HEADER_LEN)
+    {
+        ret = recv(sock_, inHeader_ + inHeaderLen_, FRAME_HEADER_LEN - inHeaderLen_, 0);
+        if (ret < 0)
+            return errno == EAGAIN || errno == EINTR;
+        if (ret == 0)
+            return false;
+
+        inHeaderLen_ += ret;
+        if (inHeaderLen_ < FRAME_HEADER_LEN)
+            return true;
+
+        inType_ = inHeader_[0];
+        inChannel_ = inHeader_[1];
+        inRemain_ = (uint8_t)inHeader_[2] | (uint8_t)inHeader_[3] << 8;
+        inSplice_ = inType_ == FRAME_DATA && inChannel_ == CHANNEL_TERMINAL &&
+                    stdin_ >= 0 && inBuffer_.empty();
+        inEvent_.clear();
+
+        if (inRemain_ == 0)
+            finishFrame();
+        else if (inSplice_)
+            return spliceInput();
+        return true;
+    }
+
+    /* Input behind buffered input is buffered too, it keeps its order */
+    if (inType_ == FRAME_DATA && inChannel_ == CHANNEL_TERMINAL && stdin_ >= 0)
+    {
+        const size_t len = inBuffer_.size();
+        inBuffer_.resize(len + inRemain_);
+        ret = recv(sock_, &inBuffer_[len], inRemain_, 0);
+        inBuffer_.resize(len + std::max(ret, (ssize_t)0));
+        if (ret < 0)
+            return errno == EAGAIN || errno == EINTR;
+        if (ret == 0)
+            return false;
+
+        inRemain_ -= ret;
+        if (inRemain_ == 0)
+            finishFrame();
+        return true;
+    }
+
+    char buf[4096];
+    ret = recv(sock_, buf, std::min(inRemain_, sizeof buf), 0);
+    if (ret < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (ret == 0)
+        return false;
+
+    /* Data after stdin is closed is dropped, but still consumes window */
+    inRemain_ -= ret;
+    if (inType_ == FRAME_DATA && inChannel_ == CHANNEL_TERMINAL)
+        consumed_ += ret;
+    else if (inEvent_.size() < FRAME_EVENT_MAX)
+        inEvent_.append(buf, std::min((size_t)ret, FRAME_EVENT_MAX - inEvent_.size()));
+
+    if (inRemain_ == 0)
+        finishFrame();
+    return true;
+}
+
+/*
+ * Move data payload from socket to child stdin. When splice can not move
+ * anything and socket has data, stdin is full and the rest is buffered.
+ */
+bool PipeRelay::spliceInput()
+{
+    const ssize_t ret = splice(sock_, NULL, stdin_, NULL, inRemain_,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret > 0)
+    {
+        inRemain_ -= ret;
+        bytesIn_ += ret;
+        consumed_ += ret;
+        splices_++;
+        if (inRemain_ == 0)
+            finishFrame();
+        return true;
+    }
+
+    if (ret == 0)
+        return false;
+
+    char peek;
+    if (errno == EAGAIN)
+        inSplice_ = recv(sock_, &peek, 1, MSG_PEEK | MSG_DONTWAIT) != 1;
+    else if (errno == EPIPE)
+        closeStdin();
+    else if (errno != EINTR)
+    {
+        perror("splice(stdin)");
+        return false;
+    }
+    return true;
+}
+
+/* Write buffered input to child stdin when it has room */
+void PipeRelay::writeInput()
+{
+    const ssize_t ret = write(stdin_, inBuffer_.data(), inBuffer_.size());
+    if (ret > 0)
+    {
+        inBuffer_.erase(0, ret);
+        bytesIn_ += ret;
+        consumed_ += ret;
+        grantWindow();
+    }
+    else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        if (errno != EPIPE)
+            perror("write(stdin)");
+        closeStdin();
+    }
+
+    if (inBuffer_.empty() && inEof_)
+        closeStdin();
+}
+
+void PipeRelay::finishFrame()
+{
+    if (!(inType_ == FRAME_DATA && inChannel_ == CHANNEL_TERMINAL))
+        handleEvent();
+
+    inHeaderLen_ = 0;
+    inSplice_ = false;
+    grantWindow();
+}
+
+/* Let frontend send more input when half window is consumed */
+void PipeRelay::grantWindow()
+{
+    if (consumed_ >= FRAME_WINDOW_INITIAL / 2)
+    {
+        char frame[FRAME_HEADER_LEN + 4];
+        control_.append(frame, frame_encode_window(frame, consumed_));
+        consumed_ = 0;
+    }
+}
+
+void PipeRelay::handleEvent()
+{
+    const char *payload = inEvent_.data();
+    const size_t len = inEvent_.size();
+
+    if (inChannel_ == CHANNEL_CONTROL && inType_ == FRAME_STATS)
+    {
+        const struct { uint8_t id; uint64_t value; } counters[] = {
+            { STAT_BYTES_IN, bytesIn_ },
+            { STAT_BYTES_OUT, bytesOut_ },
+            { STAT_SOCKET_SENDS, splices_ },
+        };
+
+        char frame[FRAME_HEADER_LEN + ARRAYSIZE(counters) * FRAME_STAT_LEN];
+        size_t frameLen = FRAME_HEADER_LEN;
+        for (size_t i = 0; i < ARRAYSIZE(counters); i++)
+            frameLen += frame_encode_stat(frame + frameLen, counters[i].id, counters[i].value);
+        frame_encode_header(frame, FRAME_STATS, frameLen - FRAME_HEADER_LEN, CHANNEL_CONTROL);
+        control_.append(frame, frameLen);
+    }
+    if (inChannel_ != CHANNEL_TERMINAL)
+        return;
+
+    switch (inType_)
+    {
+        case FRAME_SIGNAL:
+            /* Child leads its own process group, like a pty foreground job */
+            if (len == 1 && kill(-child_, (uint8_t)payload[0]) != 0)
+                perror("kill");
+            break;
+
+        case FRAME_CONTROL:
+            /* Buffered input is written before EOF */
+            if (len >= 1 && payload[0] == CONTROL_EOF)
+            {
+                inEof_ = true;
+                if (inBuffer_.empty())
+                    closeStdin();
+            }
+            break;
+
+        case FRAME_WINDOW:
+            if (len == 4)
+                outputWindow_ += frame_get_u32(payload);
+            break;
+
+        default: /* Resize and unknown frames are ignored */
+            break;
+    }
+}
+
+/* Child sees EOF, input data still in flight is dropped */
+void PipeRelay::closeStdin()
+{
+    if (stdin_ < 0)
+        return;
+
+    close(stdin_);
+    stdin_ = -1;
+    inSplice_ = false;
+
+    /* Dropped input still consumes window */
+    consumed_ += inBuffer_.size();
+    inBuffer_.clear();
+    grantWindow();
+}
+
+/* Start a data frame of what child stdout has, or close it at EOF */
+void PipeRelay::startOutput(bool hangup)
+{
+    int avail = 0;
+    if (ioctl(stdout_, FIONREAD, &avail) != 0 || avail <= 0)
+    {
+        if (hangup)
+        {
+            close(stdout_);
+            stdout_ = -1;
+        }
+        return;
+    }
+
+    outRemain_ = std::min((long long)std::min(avail, FRAME_PAYLOAD_MAX), outputWindow_);
+    outputWindow_ -= outRemain_;
+    frame_encode_header(outHeader_, FRAME_DATA, outRemain_);
+    outHeaderLeft_ = FRAME_HEADER_LEN;
+}
+
+/* Stderr is small and rare, it is copied instead of spliced */
+void PipeRelay::readStderr()
+{
+    char frame[FRAME_HEADER_LEN + FRAME_EVENT_MAX];
+    const ssize_t ret = read(stderr_, frame + FRAME_HEADER_LEN, FRAME_EVENT_MAX);
+    if (ret > 0)
+    {
+        frame_encode_header(frame, FRAME_DATA, ret, CHANNEL_STDERR);
+        control_.append(frame, FRAME_HEADER_LEN + ret);
+    }
+    else if (ret == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        close(stderr_);
+        stderr_ = -1;
+    }
+}
+
+/* Send as much pending output as socket takes, false if it is broken */
+bool PipeRelay::flush()
+{
+    while (1)
+    {
+        ssize_t ret;
+        if (outHeaderLeft_)
+        {
+            /* Header waits for payload, both leave in one segment */
+            ret = send(sock_, outHeader_ + FRAME_HEADER_LEN - outHeaderLeft_,
+                       outHeaderLeft_, MSG_NOSIGNAL | MSG_MORE);
+            if (ret > 0)
+                outHeaderLeft_ -= ret;
+        }
+        else if (outRemain_)
+        {
+            ret = splice(stdout_, NULL, sock_, NULL, outRemain_,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret > 0)
+            {
+                outRemain_ -= ret;
+                bytesOut_ += ret;
+                splices_++;
+            }
+        }
+        else if (!control_.empty())
+        {
+            ret = send(sock_, control_.data(), control_.size(), MSG_NOSIGNAL);
+            if (ret > 0)
+                control_.erase(0, ret);
+        }
+        else
+            return true;
+
+        if (ret < 0)
+        {
+            if (errno == EAGAIN)
+                return true;
+            if (errno != EINTR)
+            {
+                perror("send");
+                return false;
+            }
+        }
+    }
+}
+
+/* Exit status is shell style, 128 + signal number if child was killed */
+void PipeRelay::queueExit()
+{
+    exitStatus_ = watcher_.exitStatus();
+
+    char frame[FRAME_HEADER_LEN + 4];
+    control_.append(frame, frame_encode_exit(frame, exitStatus_));
+}
@@ -0,0 +1,102 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef PIPERELAY_HPP
+#define PIPERELAY_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include "ChildWatcher.hpp"
+#include "FrameCodec.hpp"
+
+/* Requested size of child pipes, bigger pipes move more data per splice */
+#define PIPE_RELAY_PIPE_SIZE (1024 * 1024)
+
+/* Stderr is not read while this much control output is waiting */
+#define PIPE_RELAY_CONTROL_MAX 65536
+
+/* Input is not received while this much waits for a full stdin, more than a window */
+#define PIPE_RELAY_INPUT_MAX (2 * FRAME_WINDOW_INITIAL)
+
+/*
+ * Relay of --pipe mode, for commands that do not need a terminal. Child
+ * stdin, stdout and stderr are pipes and the connection is multiplexed.
+ * Terminal data is moved with splice() and never copied to user space:
+ * stdout payload is spliced to the socket after its frame header, stdin
+ * payload is spliced from the socket after its header is received.
+ * Stderr is sent as small data frames of stderr channel between stdout
+ * frames. When stdout and stderr are closed and the child exited, its exit
+ * status is sent and the relay ends. Exit is watched with ChildWatcher in
+ * the poll loop, so a child that closed its output still gets its input.
+ *
+ * All descriptors are non-blocking, a child that does not read its stdin
+ * does not stop its output or the other way around. When stdin is full,
+ * the rest of input is copied to a buffer until stdin takes it, so window
+ * grants behind it are still received. Input window is not granted for
+ * buffered input, so frontend can not send more than one window of it.
+ */
+class PipeRelay
+{
+private:
+    int sock_;
+    int stdin_;
+    int stdout_;
+    int stderr_;
+    pid_t child_;
+    ChildWatcher watcher_;
+    int exitStatus_ = -1;
+
+    /* Frame being received */
+    char inHeader_[FRAME_HEADER_LEN];
+    size_t inHeaderLen_ = 0;
+    uint8_t inType_ = 0;
+    uint8_t inChannel_ = 0;
+    size_t inRemain_ = 0;
+    bool inSplice_ = false;     /* Payload is spliced to child stdin */
+    bool inEof_ = false;        /* Stdin is closed when buffer is written */
+    std::string inEvent_;
+    std::string inBuffer_;      /* Input waiting for a full stdin */
+    unsigned long long consumed_ = 0;
+
+    /* Stdout frame being sent */
+    char outHeader_[FRAME_HEADER_LEN];
+    size_t outHeaderLeft_ = 0;
+    size_t outRemain_ = 0;
+    long long outputWindow_ = FRAME_WINDOW_INITIAL;
+    std::string control_;       /* Whole frames waiting to be sent */
+
+    unsigned long long bytesIn_ = 0;
+    unsigned long long bytesOut_ = 0;
+    unsigned long splices_ = 0;
+
+    bool receive();
+    bool spliceInput();
+    void writeInput();
+    void finishFrame();
+    void grantWindow();
+    void handleEvent();
+    void closeStdin();
+    void startOutput(bool hangup);
+    void readStderr();
+    bool flush();
+    void queueExit();
+
+public:
+    PipeRelay(int sock, int stdinFd, int stdoutFd, int stderrFd, pid_t child);
+
+    /* Relay until child output ends, false if connection is closed. */
+    bool run();
+
+    int exitStatus() const { return exitStatus_; }
+    unsigned long long bytesIn() const { return bytesIn_; }
+    unsigned long long bytesOut() const { return bytesOut_; }
+    unsigned long splices() const { return splices_; }
+};
+
+#endif /* PIPERELAY_HPP */
@@ -0,0 +1,67 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include "common.hpp"
+#include "ResizeDebouncer.hpp"
+
+static bool same_size(const struct winsize *a, const struct winsize *b)
+{
+    return a->ws_row == b->ws_row && a->ws_col == b->ws_col &&
+           a->ws_xpixel == b->ws_xpixel && a->ws_ypixel == b->ws_ypixel;
+}
+
+ResizeDebouncer::ResizeDebouncer(unsigned int intervalMsec) :
+    intervalUsec_((uint64_t)intervalMsec * 1000)
+{
+}
+
+/* Remember the new size, it replaces any size not applied yet */
+void ResizeDebouncer::request(const struct winsize *winp)
+{
+    requests_++;
+    pendingSize_ = *winp;
+
+    /* Storm may end where it started, then nothing changes */
+    pending_ = !appliedOnce_ || !same_size(winp, &appliedSize_);
+}
+
+/* Return true with the size to apply if the interval is over */
+bool ResizeDebouncer::take(struct winsize *winp)
+{
+    if (!pending_)
+        return false;
+
+    const uint64_t now = monotonic_usec();
+    if (appliedOnce_ && now - lastApplyTime_ < intervalUsec_)
+        return false;
+
+    *winp = appliedSize_ = pendingSize_;
+    pending_ = false;
+    appliedOnce_ = true;
+    lastApplyTime_ = now;
+    applied_++;
+    return true;
+}
+
+/* Size was applied without debounce, e.g. of a new connection, it replaces any pending size */
+void ResizeDebouncer::setApplied(const struct winsize *winp)
+{
+    appliedSize_ = *winp;
+    pending_ = false;
+    appliedOnce_ = true;
+    lastApplyTime_ = monotonic_usec();
+}
+
+/* Shorter of other and time left until pending size can be applied */
+struct timespec *ResizeDebouncer::timeout(struct timespec *ts, struct timespec *other)
+{
+    if (!pending_)
+        return other;
+
+    const uint64_t elapsed = monotonic_usec() - lastApplyTime_;
+    const uint64_t remain = elapsed < intervalUsec_ ? intervalUsec_ - elapsed : 0;
+    return earliest_timeout(ts, remain, other);
+}
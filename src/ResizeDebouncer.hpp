@@ -0,0 +1,47 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef RESIZEDEBOUNCER_HPP
+#define RESIZEDEBOUNCER_HPP
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+/* Default minimum time between two pty resizes, in milliseconds */
+#define RESIZE_DEFAULT_MSEC 50
+
+/*
+ * Dragging a terminal window sends a resize for every pixel step, and each
+ * one makes full-screen programs redraw. Only the latest size is kept and
+ * applied at most once per interval. A resize after a quiet interval is
+ * applied at once and the last size of a storm is always applied.
+ */
+class ResizeDebouncer
+{
+private:
+    uint64_t intervalUsec_;
+    bool pending_ = false;
+    bool appliedOnce_ = false;
+    struct winsize pendingSize_ = {};
+    struct winsize appliedSize_ = {};
+    uint64_t lastApplyTime_ = 0;
+    unsigned long requests_ = 0;
+    unsigned long applied_ = 0;
+
+public:
+    ResizeDebouncer(unsigned int intervalMsec);
+
+    void request(const struct winsize *winp);
+    bool take(struct winsize *winp);
+    void setApplied(const struct winsize *winp);
+    struct timespec *timeout(struct timespec *ts, struct timespec *other);
+
+    unsigned long applied() const { return applied_; }
+    unsigned long collapsed() const { return requests_ - applied_; }
+};
+
+#endif /* RESIZEDEBOUNCER_HPP */
@@ -0,0 +1,845 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ScreenModel.hpp"
+
+static const ScreenAttr defaultAttr = {};
+static const ScreenCell defaultBlank = { ' ', {} };
+
+/* DEC special graphics for 0x60 to 0x7E, as used by ESC ( 0 */
+static const uint16_t decGraphics[] = {
+    0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+    0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+    0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+    0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7,
+};
+
+/* Cells taken by a character, rough East Asian width without locale */
+static int char_width(uint32_t cp)
+{
+    if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+        (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x200B && cp <= 0x200F) ||
+        (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE00 && cp <= 0xFE0F))
+        return 0;
+
+    if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF) ||
+        (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+        (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+        (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+        (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD))
+        return 2;
+
+    return 1;
+}
+
+/* Pack UTF-8 bytes of cp into an integer, first byte lowest */
+static uint32_t utf8_pack(uint32_t cp)
+{
+    if (cp < 0x80)
+        return cp;
+    if (cp < 0x800)
+        return (0xC0 | cp >> 6) | (0x80 | (cp & 0x3F)) << 8;
+    if (cp < 0x10000)
+        return (0xE0 | cp >> 12) | (0x80 | (cp >> 6 & 0x3F)) << 8 |
+               (0x80 | (cp & 0x3F)) << 16;
+    return (0xF0 | cp >> 18) | (0x80 | (cp >> 12 & 0x3F)) << 8 |
+           (0x80 | (cp >> 6 & 0x3F)) << 16 | (uint32_t)(0x80 | (cp & 0x3F)) << 24;
+}
+
+static void append_char(std::string &out, uint32_t ch)
+{
+    for (; ch; ch >>= 8)
+        out += (char)(ch & 0xFF);
+}
+
+static void append_color(std::string &out, uint32_t color, int base)
+{
+    char buf[32];
+    if (color & SCREEN_RGB)
+        sprintf(buf, ";%d;2;%u;%u;%u", base + 8, color >> 16 & 0xFF,
+            color >> 8 & 0xFF, color & 0xFF);
+    else if (color <= 8)
+        sprintf(buf, ";%d", base + color - 1);
+    else if (color <= 16)
+        sprintf(buf, ";%d", base + 60 + color - 9);
+    else
+        sprintf(buf, ";%d;5;%u", base + 8, color - 1);
+    out += buf;
+}
+
+static void append_sgr(std::string &out, const ScreenAttr &attr)
+{
+    out += "\033[0";
+    for (int i = 1; i <= 9; i++)
+    {
+        if (attr.flags & 1 << i)
+        {
+            out += ';';
+            out += (char)('0' + i);
+        }
+    }
+    if (attr.fg)
+        append_color(out, attr.fg, 30);
+    if (attr.bg)
+        append_color(out, attr.bg, 40);
+    out += 'm';
+}
+
+static void append_cup(std::string &out, int row, int col)
+{
+    char buf[32];
+    sprintf(buf, "\033[%d;%dH", row + 1, col + 1);
+    out += buf;
+}
+
+ScreenModel::ScreenModel(int rows, int cols) :
+    rows_(0),
+    cols_(0)
+{
+    resize(rows, cols);
+}
+
+void ScreenModel::resize(int rows, int cols)
+{
+    if (rows < 1)
+        rows = 1;
+    if (cols < 1)
+        cols = 1;
+
+    /* Keep top left part of the screen, terminal reflow is not modeled */
+    std::vector<ScreenCell> cells((size_t)rows * cols, defaultBlank);
+    std::vector<ScreenCell> saved((size_t)rows * cols, defaultBlank);
+    for (int r = 0; r < rows && r < rows_; r++)
+    {
+        for (int c = 0; c < cols && c < cols_; c++)
+        {
+            cells[(size_t)r * cols + c] = cells_[(size_t)r * cols_ + c];
+            saved[(size_t)r * cols + c] = saved_[(size_t)r * cols_ + c];
+        }
+    }
+
+    cells_.swap(cells);
+    saved_.swap(saved);
+    rows_ = rows;
+    cols_ = cols;
+    top_ = 0;
+    bottom_ = rows - 1;
+    row_ = row_ < rows ? row_ : rows - 1;
+    col_ = col_ < cols ? col_ : cols - 1;
+    wrapPending_ = false;
+    shownValid_ = false;
+}
+
+/* Erased cells keep background color, like xterm */
+ScreenCell ScreenModel::blank() const
+{
+    ScreenCell cell = defaultBlank;
+    cell.attr.bg = attr_.bg;
+    return cell;
+}
+
+/* Break up a wide character if col is its right half */
+void ScreenModel::splitWide(int row, int col)
+{
+    if (col <= 0 || col >= cols_)
+        return;
+
+    ScreenCell *l = line(row);
+    if (l[col].ch == 0)
+    {
+        l[col - 1] = blank();
+        l[col] = blank();
+    }
+}
+
+void ScreenModel::clear(int row, int from, int to)
+{
+    splitWide(row, from);
+    splitWide(row, to);
+
+    ScreenCell *l = line(row);
+    for (int c = from; c < to; c++)
+        l[c] = blank();
+}
+
+void ScreenModel::scrollUp(int top, int bottom, int count)
+{
+    if (count > bottom - top + 1)
+        count = bottom - top + 1;
+
+    memmove(line(top), line(top + count),
+        sizeof(ScreenCell) * cols_ * (bottom - top + 1 - count));
+    for (int r = bottom - count + 1; r <= bottom; r++)
+        clear(r, 0, cols_);
+}
+
+void ScreenModel::scrollDown(int top, int bottom, int count)
+{
+    if (count > bottom - top + 1)
+        count = bottom - top + 1;
+
+    memmove(line(top + count), line(top),
+        sizeof(ScreenCell) * cols_ * (bottom - top + 1 - count));
+    for (int r = top; r < top + count; r++)
+        clear(r, 0, cols_);
+}
+
+void ScreenModel::lineFeed()
+{
+    wrapPending_ = false;
+    if (row_ == bottom_)
+        scrollUp(top_, bottom_, 1);
+    else if (row_ < rows_ - 1)
+        row_++;
+}
+
+void ScreenModel::put(uint32_t cp)
+{
+    if (graphics_ && cp >= 0x60 && cp <= 0x7E)
+        cp = decGraphics[cp - 0x60];
+
+    const int width = char_width(cp);
+    if (width == 0 || width > cols_)
+        return;
+
+    if (wrapPending_ || col_ + width > cols_)
+    {
+        if (!autowrap_)
+            col_ = cols_ - width;
+        else
+        {
+            col_ = 0;
+            lineFeed();
+        }
+    }
+    wrapPending_ = false;
+
+    ScreenCell *l = line(row_);
+    splitWide(row_, col_);
+    if (insert_ && col_ + width < cols_)
+    {
+        /* Cells shifted past the right margin are lost */
+        splitWide(row_, cols_ - width);
+        memmove(l + col_ + width, l + col_,
+            sizeof(ScreenCell) * (cols_ - col_ - width));
+    }
+    splitWide(row_, col_ + width);
+
+    l[col_].ch = utf8_pack(cp);
+    l[col_].attr = attr_;
+    if (width == 2)
+    {
+        l[col_ + 1].ch = 0;
+        l[col_ + 1].attr = attr_;
+    }
+
+    col_ += width;
+    if (col_ >= cols_)
+    {
+        col_ = cols_ - 1;
+        wrapPending_ = autowrap_;
+    }
+}
+
+void ScreenModel::saveCursor()
+{
+    savedRow_ = row_;
+    savedCol_ = col_;
+    savedAttr_ = attr_;
+}
+
+void ScreenModel::restoreCursor()
+{
+    row_ = savedRow_ < rows_ ? savedRow_ : rows_ - 1;
+    col_ = savedCol_ < cols_ ? savedCol_ : cols_ - 1;
+    attr_ = savedAttr_;
+    wrapPending_ = false;
+}
+
+void ScreenModel::switchScreen(bool alt, bool withCursor)
+{
+    if (alt == altScreen_)
+        return;
+
+    if (alt && withCursor)
+        saveCursor();
+
+    cells_.swap(saved_);
+    altScreen_ = alt;
+
+    if (alt)
+    {
+        for (int r = 0; r < rows_; r++)
+            clear(r, 0, cols_);
+    }
+    else if (withCursor)
+        restoreCursor();
+}
+
+/* Forward sequence to terminal if output is held back */
+void ScreenModel::keepSequence()
+{
+    if (held_ && !seqTooLong_)
+        forward_ += seq_;
+}
+
+void ScreenModel::control(unsigned char c)
+{
+    switch (c)
+    {
+        case '\b':
+            if (col_ > 0)
+                col_--;
+            wrapPending_ = false;
+            break;
+
+        case '\t':
+            col_ = (col_ / 8 + 1) * 8;
+            if (col_ >= cols_)
+                col_ = cols_ - 1;
+            break;
+
+        case '\n': case '\v': case '\f':
+            lineFeed();
+            break;
+
+        case '\r':
+            col_ = 0;
+            wrapPending_ = false;
+            break;
+
+        case '\033':
+            seq_.assign(1, '\033');
+            seqTooLong_ = false;
+            state_ = STATE_ESC;
+            break;
+
+        default: /* Bell and shifts do not change the screen */
+            break;
+    }
+}
+
+void ScreenModel::escape(unsigned char c)
+{
+    state_ = STATE_GROUND;
+
+    switch (c)
+    {
+        case '[':
+            state_ = STATE_CSI;
+            break;
+
+        case ']': case 'P': case '_': case '^': case 'X':
+            state_ = STATE_STRING;
+            break;
+
+        case '(': case ')': case '*': case '+': case '-': case '.': case '/':
+            state_ = STATE_CHARSET;
+            break;
+
+        case 'c': /* Full reset, terminal clears modes and screen */
+            keepSequence();
+            attr_ = defaultAttr;
+            switchScreen(false, false);
+            for (int r = 0; r < rows_; r++)
+                clear(r, 0, cols_);
+            row_ = col_ = 0;
+            top_ = 0;
+            bottom_ = rows_ - 1;
+            cursorVisible_ = autowrap_ = true;
+            insert_ = graphics_ = wrapPending_ = false;
+            shownValid_ = false;
+            break;
+
+        case 'D':
+            lineFeed();
+            break;
+
+        case 'E':
+            col_ = 0;
+            lineFeed();
+            break;
+
+        case 'M':
+            wrapPending_ = false;
+            if (row_ == top_)
+                scrollDown(top_, bottom_, 1);
+            else if (row_ > 0)
+                row_--;
+            break;
+
+        case '7':
+            saveCursor();
+            break;
+
+        case '8':
+            restoreCursor();
+            break;
+
+        default: /* Keypad modes and others are only terminal state */
+            keepSequence();
+            break;
+    }
+}
+
+void ScreenModel::sgr(const std::vector<int> &params)
+{
+    if (params.empty())
+        attr_ = defaultAttr;
+
+    for (size_t i = 0; i < params.size(); i++)
+    {
+        const int p = params[i];
+        uint32_t *color = nullptr;
+
+        if (p == 0)
+            attr_ = defaultAttr;
+        else if (p >= 1 && p <= 9)
+            attr_.flags |= 1 << p;
+        else if (p == 22)
+            attr_.flags &= ~(1 << 1 | 1 << 2);
+        else if (p >= 23 && p <= 29)
+            attr_.flags &= ~(1 << (p - 20) | (p == 25 ? 1 << 6 : 0));
+        else if ((p >= 30 && p <= 37) || (p >= 40 && p <= 47))
+            (p < 40 ? attr_.fg : attr_.bg) = p % 10 + 1;
+        else if ((p >= 90 && p <= 97) || (p >= 100 && p <= 107))
+            (p < 100 ? attr_.fg : attr_.bg) = p % 10 + 9;
+        else if (p == 39)
+            attr_.fg = 0;
+        else if (p == 49)
+            attr_.bg = 0;
+        else if (p == 38 || p == 48)
+            color = p == 38 ? &attr_.fg : &attr_.bg;
+
+        /* Extended colors: 38;5;N or 38;2;R;G;B */
+        if (color && i + 2 < params.size() && params[i + 1] == 5)
+        {
+            *color = (params[i + 2] & 0xFF) + 1;
+            i += 2;
+        }
+        else if (color && i + 4 < params.size() && params[i + 1] == 2)
+        {
+            *color = SCREEN_RGB | (params[i + 2] & 0xFF) << 16 |
+                     (params[i + 3] & 0xFF) << 8 | (params[i + 4] & 0xFF);
+            i += 4;
+        }
+    }
+}
+
+/* DEC private modes, the ones not modeled are forwarded one by one */
+void ScreenModel::setModes(const std::vector<int> &params, bool set)
+{
+    for (const int mode : params)
+    {
+        switch (mode)
+        {
+            case 7: autowrap_ = set; break;
+            case 25: cursorVisible_ = set; break;
+            case 47: case 1047: switchScreen(set, false); break;
+            case 1049: switchScreen(set, true); break;
+
+            default:
+                if (held_)
+                {
+                    char buf[32];
+                    sprintf(buf, "\033[?%d%c", mode, set ? 'h' : 'l');
+                    forward_ += buf;
+                }
+                break;
+        }
+    }
+}
+
+void ScreenModel::csi(unsigned char final)
+{
+    /* seq_ is ESC [ [prefix] params [intermediates] final */
+    const char *p = seq_.c_str() + 2;
+    const char prefix = (*p >= '<' && *p <= '?') ? *p++ : 0;
+
+    std::vector<int> params;
+    bool intermediate = false;
+    int value = -1;
+    for (; *p && p < seq_.c_str() + seq_.size() - 1; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            /* Cut value can not overflow when it is multiplied */
+            value = (value < 0 ? 0 : value * 10) + (*p - '0');
+            if (value > SCREEN_PARAM_MAX)
+                value = SCREEN_PARAM_MAX;
+        }
+        else if (*p == ';' || *p == ':')
+        {
+            params.push_back(value < 0 ? 0 : value);
+            value = -1;
+        }
+        else
+            intermediate = true;
+    }
+    if (value >= 0 || !params.empty())
+        params.push_back(value < 0 ? 0 : value);
+
+    if (prefix == '?' && !intermediate && (final == 'h' || final == 'l'))
+    {
+        setModes(params, final == 'h');
+        return;
+    }
+
+    if (prefix || intermediate)
+    {
+        keepSequence();
+        return;
+    }
+
+    /* First two parameters with default 1, as most sequences use */
+    const int n = params.size() > 0 && params[0] > 0 ? params[0] : 1;
+    const int m = params.size() > 1 && params[1] > 0 ? params[1] : 1;
+    const int mode = params.empty() ? 0 : params[0];
+    ScreenCell *l = line(row_);
+
+    if (final != 'm')
+        wrapPending_ = false;
+
+    switch (final)
+    {
+        case 'A': row_ = row_ - n < 0 ? 0 : row_ - n; break;
+        case 'B': case 'e': row_ = row_ + n >= rows_ ? rows_ - 1 : row_ + n; break;
+        case 'C': case 'a': col_ = col_ + n >= cols_ ? cols_ - 1 : col_ + n; break;
+        case 'D': col_ = col_ - n < 0 ? 0 : col_ - n; break;
+
+        case 'E':
+            row_ = row_ + n >= rows_ ? rows_ - 1 : row_ + n;
+            col_ = 0;
+            break;
+
+        case 'F':
+            row_ = row_ - n < 0 ? 0 : row_ - n;
+            col_ = 0;
+            break;
+
+        case 'G': case '`': col_ = n > cols_ ? cols_ - 1 : n - 1; break;
+        case 'd': row_ = n > rows_ ? rows_ - 1 : n - 1; break;
+
+        case 'H': case 'f':
+            row_ = n > rows_ ? rows_ - 1 : n - 1;
+            col_ = m > cols_ ? cols_ - 1 : m - 1;
+            break;
+
+        case 'J':
+            if (mode == 0)
+            {
+                clear(row_, col_, cols_);
+                for (int r = row_ + 1; r < rows_; r++)
+                    clear(r, 0, cols_);
+            }
+            else if (mode == 1)
+            {
+                for (int r = 0; r < row_; r++)
+                    clear(r, 0, cols_);
+                clear(row_, 0, col_ + 1);
+            }
+            else
+            {
+                for (int r = 0; r < rows_; r++)
+                    clear(r, 0, cols_);
+            }
+            break;
+
+        case 'K':
+            if (mode == 0)
+                clear(row_, col_, cols_);
+            else if (mode == 1)
+                clear(row_, 0, col_ + 1);
+            else
+                clear(row_, 0, cols_);
+            break;
+
+        case 'L':
+            if (row_ >= top_ && row_ <= bottom_)
+                scrollDown(row_, bottom_, n);
+            col_ = 0;
+            break;
+
+        case 'M':
+            if (row_ >= top_ && row_ <= bottom_)
+                scrollUp(row_, bottom_, n);
+            col_ = 0;
+            break;
+
+        case '@':
+        {
+            const int count = n < cols_ - col_ ? n : cols_ - col_;
+            splitWide(row_, col_);
+            splitWide(row_, cols_ - count);
+            memmove(l + col_ + count, l + col_,
+                sizeof(ScreenCell) * (cols_ - col_ - count));
+            clear(row_, col_, col_ + count);
+            break;
+        }
+
+        case 'P':
+        {
+            const int count = n < cols_ - col_ ? n : cols_ - col_;
+            splitWide(row_, col_);
+            splitWide(row_, col_ + count);
+            memmove(l + col_, l + col_ + count,
+                sizeof(ScreenCell) * (cols_ - col_ - count));
+            clear(row_, cols_ - count, cols_);
+            break;
+        }
+
+        case 'X':
+            clear(row_, col_, col_ + n < cols_ ? col_ + n : cols_);
+            break;
+
+        case 'S':
+            scrollUp(top_, bottom_, n);
+            break;
+
+        case 'T': /* With more parameters it is mouse highlight tracking */
+            if (params.size() <= 1)
+                scrollDown(top_, bottom_, n);
+            break;
+
+        case 'm':
+            sgr(params);
+            break;
+
+        case 'r':
+        {
+            const int top = n - 1;
+            const int bottom = params.size() > 1 && params[1] > 0 &&
+                               params[1] <= rows_ ? params[1] - 1 : rows_ - 1;
+            if (top < bottom)
+            {
+                top_ = top;
+                bottom_ = bottom;
+                row_ = col_ = 0;
+                keepSequence();
+            }
+            break;
+        }
+
+        case 's':
+            if (params.empty())
+                saveCursor();
+            else
+                keepSequence();
+            break;
+
+        case 'u':
+            restoreCursor();
+            break;
+
+        case 'h': case 'l':
+            for (const int ansiMode : params)
+            {
+                if (ansiMode == 4)
+                    insert_ = final == 'h';
+            }
+            break;
+
+        default: /* Reports and window operations only concern terminal */
+            keepSequence();
+            break;
+    }
+}
+
+void ScreenModel::feed(const char *buf, size_t len, bool held)
+{
+    held_ = held;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        const unsigned char c = buf[i];
+
+        switch (state_)
+        {
+            case STATE_GROUND:
+                if (utf8Need_ > 0)
+                {
+                    if ((c & 0xC0) == 0x80)
+                    {
+                        codepoint_ = codepoint_ << 6 | (c & 0x3F);
+                        if (--utf8Need_ == 0)
+                            put(codepoint_);
+                        break;
+                    }
+                    utf8Need_ = 0; /* Invalid sequence is dropped */
+                }
+
+                if (c < 0x20)
+                    control(c);
+                else if (c < 0x7F)
+                    put(c);
+                else if (c >= 0xC2 && c <= 0xF4)
+                {
+                    utf8Need_ = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+                    codepoint_ = c & (0x3F >> utf8Need_);
+                }
+                break;
+
+            case STATE_ESC:
+                seq_ += c;
+                escape(c);
+                break;
+
+            case STATE_CSI:
+                if (c == '\033' || c == 0x18 || c == 0x1A)
+                {
+                    state_ = STATE_GROUND;
+                    control(c);
+                }
+                else if (c < 0x20)
+                    control(c); /* Executed in the middle of sequence */
+                else
+                {
+                    seq_ += c;
+                    if (c >= 0x40 && c <= 0x7E)
+                    {
+                        state_ = STATE_GROUND;
+                        csi(c);
+                    }
+                    else if (seq_.size() > SCREEN_SEQ_MAX)
+                        state_ = STATE_GROUND;
+                }
+                break;
+
+            case STATE_STRING:
+                if (c == '\a')
+                {
+                    seq_ += c;
+                    keepSequence();
+                    state_ = STATE_GROUND;
+                }
+                else if (c == '\033')
+                    state_ = STATE_STRING_ESC;
+                else if (seq_.size() < SCREEN_SEQ_MAX)
+                    seq_ += c;
+                else
+                    seqTooLong_ = true;
+                break;
+
+            case STATE_STRING_ESC:
+                if (c == '\\')
+                {
+                    seq_ += "\033\\";
+                    keepSequence();
+                    state_ = STATE_GROUND;
+                }
+                else
+                {
+                    seq_.assign(1, '\033');
+                    seqTooLong_ = false;
+                    seq_ += c;
+                    escape(c);
+                }
+                break;
+
+            case STATE_CHARSET:
+                seq_ += c;
+                state_ = STATE_GROUND;
+                if (seq_[1] == '(')
+                    graphics_ = c == '0';
+                else
+                    keepSequence();
+                break;
+        }
+    }
+}
+
+void ScreenModel::render(std::string &out)
+{
+    /* Paint with plain charset, overwrite mode and hidden cursor */
+    out += "\033[?25l\033[4l\033(B";
+
+    if (altScreen_ != shownAltScreen_)
+    {
+        out += altScreen_ ? "\033[?1049h" : "\033[?1049l";
+        shownAltScreen_ = altScreen_;
+        shownValid_ = false;
+    }
+
+    ScreenAttr current = {};
+    bool currentKnown = false;
+    if (!shownValid_)
+    {
+        out += "\033[0m\033[H\033[2J";
+        shown_.assign(cells_.size(), defaultBlank);
+        shownValid_ = true;
+        currentKnown = true;
+    }
+
+    for (int r = 0; r < rows_; r++)
+    {
+        const ScreenCell *l = &cells_[(size_t)r * cols_];
+        ScreenCell *s = &shown_[(size_t)r * cols_];
+
+        int first = 0;
+        while (first < cols_ && l[first] == s[first])
+            first++;
+        if (first == cols_)
+            continue;
+        if (first > 0 && l[first].ch == 0)
+            first--;
+
+        /* Trailing default blanks are erased instead of written */
+        int end = cols_;
+        while (end > first && l[end - 1] == defaultBlank)
+            end--;
+
+        append_cup(out, r, first);
+        for (int c = first; c < end; c++)
+        {
+            if (l[c].ch == 0)
+                continue;
+            if (!currentKnown || l[c].attr != current)
+            {
+                append_sgr(out, l[c].attr);
+                current = l[c].attr;
+                currentKnown = true;
+            }
+            append_char(out, l[c].ch);
+        }
+
+        if (end < cols_)
+        {
+            if (!currentKnown || current != defaultAttr)
+                out += "\033[0m";
+            current = defaultAttr;
+            currentKnown = true;
+            out += "\033[K";
+        }
+
+        memcpy(s, l, sizeof(ScreenCell) * cols_);
+    }
+
+    /* Scroll region and other modes change cursor, send them first */
+    out += forward_;
+    forward_.clear();
+
+    /* Repeat last character to get terminal into pending wrap too */
+    const ScreenCell &last = cells_[(size_t)row_ * cols_ + col_];
+    if (wrapPending_ && last.ch != 0)
+    {
+        append_cup(out, row_, col_);
+        append_sgr(out, last.attr);
+        append_char(out, last.ch);
+    }
+    else
+        append_cup(out, row_, col_);
+
+    append_sgr(out, attr_);
+    if (graphics_)
+        out += "\033(0";
+    if (insert_)
+        out += "\033[4h";
+    if (cursorVisible_)
+        out += "\033[?25h";
+}
@@ -0,0 +1,132 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef SCREENMODEL_HPP
+#define SCREENMODEL_HPP
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include <string>
+#include <vector>
+
+/* Longest escape sequence kept to forward its side effects, e.g. titles */
+#define SCREEN_SEQ_MAX 512
+
+/* Larger parameter of a sequence is cut to this, like other terminals do */
+#define SCREEN_PARAM_MAX 65535
+
+struct ScreenAttr
+{
+    uint16_t flags;     /* Bit n is set by SGR n, for n 1 to 9 */
+    uint32_t fg;        /* 0 default, 1-256 palette, SCREEN_RGB for 24 bit */
+    uint32_t bg;
+
+    bool operator==(const ScreenAttr &o) const
+    {
+        return flags == o.flags && fg == o.fg && bg == o.bg;
+    }
+    bool operator!=(const ScreenAttr &o) const { return !(*this == o); }
+};
+
+#define SCREEN_RGB 0x1000000
+
+struct ScreenCell
+{
+    uint32_t ch;        /* UTF-8 bytes of character, 0 right of a wide one */
+    ScreenAttr attr;
+
+    bool operator==(const ScreenCell &o) const
+    {
+        return ch == o.ch && attr == o.attr;
+    }
+    bool operator!=(const ScreenCell &o) const { return !(*this == o); }
+};
+
+/*
+ * Model of the visible terminal screen, enough of a VT parser to follow
+ * shell tools and common full-screen programs. It is fed the pty output
+ * and renders the difference between itself and what the terminal shows.
+ *
+ * Sequences that change terminal state but not screen cells, e.g. titles,
+ * mouse and keypad modes, are collected while output is held back and are
+ * sent before the next screen update. Combining characters are dropped.
+ */
+class ScreenModel
+{
+private:
+    enum State { STATE_GROUND, STATE_ESC, STATE_CSI, STATE_STRING,
+                 STATE_STRING_ESC, STATE_CHARSET };
+
+    int rows_;
+    int cols_;
+    std::vector<ScreenCell> cells_;
+    std::vector<ScreenCell> shown_;     /* What terminal shows */
+    std::vector<ScreenCell> saved_;     /* Main screen while alternate is on */
+    bool shownValid_ = false;
+
+    int row_ = 0;
+    int col_ = 0;
+    bool wrapPending_ = false;
+    ScreenAttr attr_ = {};
+    int top_ = 0;
+    int bottom_;
+    int savedRow_ = 0;
+    int savedCol_ = 0;
+    ScreenAttr savedAttr_ = {};
+
+    bool altScreen_ = false;
+    bool shownAltScreen_ = false;
+    bool cursorVisible_ = true;
+    bool autowrap_ = true;
+    bool insert_ = false;
+    bool graphics_ = false;     /* DEC line drawing characters in G0 */
+
+    State state_ = STATE_GROUND;
+    bool held_ = false;
+    bool seqTooLong_ = false;
+    std::string seq_;
+    std::string forward_;   /* Side effect sequences not yet sent */
+    uint32_t codepoint_ = 0;
+    int utf8Need_ = 0;
+
+    ScreenCell blank() const;
+    ScreenCell *line(int row) { return &cells_[(size_t)row * cols_]; }
+    void splitWide(int row, int col);
+    void clear(int row, int from, int to);
+    void scrollUp(int top, int bottom, int count);
+    void scrollDown(int top, int bottom, int count);
+    void lineFeed();
+    void put(uint32_t cp);
+    void control(unsigned char c);
+    void escape(unsigned char c);
+    void csi(unsigned char final);
+    void sgr(const std::vector<int> &params);
+    void setModes(const std::vector<int> &params, bool set);
+    void switchScreen(bool alt, bool withCursor);
+    void saveCursor();
+    void restoreCursor();
+    void keepSequence();
+
+public:
+    ScreenModel(int rows, int cols);
+
+    void resize(int rows, int cols);
+
+    /* Parse pty output, held is true if it is not sent to terminal as is. */
+    void feed(const char *buf, size_t len, bool held);
+
+    /* Append escape sequences that bring the terminal up to date. */
+    void render(std::string &out);
+
+    /* Terminal content is unknown, next render repaints everything. */
+    void invalidate() { shownValid_ = false; }
+
+    /* Terminal is a new one showing its main screen, e.g. after reattach. */
+    void reset() { shownValid_ = false; shownAltScreen_ = false; }
+};
+
+#endif /* SCREENMODEL_HPP */
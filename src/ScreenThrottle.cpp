@@ -0,0 +1,84 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include "common.hpp"
+#include "ScreenThrottle.hpp"
+
+ScreenThrottle::ScreenThrottle(unsigned int fps, const struct winsize *winp) :
+    model_(winp->ws_row, winp->ws_col),
+    periodUsec_(1000000 / (fps ? fps : 1)),
+    threshold_((size_t)winp->ws_row * winp->ws_col)
+{
+}
+
+void ScreenThrottle::resize(const struct winsize *winp)
+{
+    model_.resize(winp->ws_row, winp->ws_col);
+    threshold_ = (size_t)winp->ws_row * winp->ws_col;
+}
+
+/* Feed pty output to the screen, return true if it is held back */
+bool ScreenThrottle::feed(const char *buf, size_t len)
+{
+    const uint64_t now = monotonic_usec();
+    if (now - periodStart_ >= periodUsec_)
+    {
+        periodStart_ = now;
+        periodBytes_ = 0;
+    }
+
+    periodBytes_ += len;
+    if (!flooding_ && periodBytes_ > threshold_)
+    {
+        /* Terminal may miss what was held, repaint it all at first frame */
+        flooding_ = true;
+        floods_++;
+        model_.invalidate();
+        nextFrame_ = now + periodUsec_;
+        frameBytes_ = 0;
+    }
+
+    model_.feed(buf, len, flooding_);
+    if (flooding_)
+    {
+        heldBytes_ += len;
+        frameBytes_ += len;
+    }
+
+    return flooding_;
+}
+
+bool ScreenThrottle::frameDue() const
+{
+    return flooding_ && monotonic_usec() >= nextFrame_;
+}
+
+/* Render screen update, flood is over if output slowed down since last one */
+void ScreenThrottle::frame(std::string &out)
+{
+    model_.render(out);
+    frames_++;
+
+    if (frameBytes_ <= threshold_)
+        flooding_ = false;
+
+    const uint64_t now = monotonic_usec();
+    nextFrame_ += periodUsec_;
+    if (nextFrame_ < now)
+        nextFrame_ = now + periodUsec_;
+    frameBytes_ = 0;
+}
+
+/* Shorter of other and time left until next frame */
+struct timespec *ScreenThrottle::timeout(struct timespec *ts, struct timespec *other)
+{
+    if (!flooding_)
+        return other;
+
+    const uint64_t now = monotonic_usec();
+    const uint64_t remain = nextFrame_ > now ? nextFrame_ - now : 0;
+    return earliest_timeout(ts, remain, other);
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef SCREENTHROTTLE_HPP
+#define SCREENTHROTTLE_HPP
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include <string>
+
+#include "ScreenModel.hpp"
+
+/*
+ * Detects output floods and replaces them with screen updates at a capped
+ * frame rate. Output is a flood when more than a screenful arrives within
+ * one frame period. Pty output is then held back and only the difference
+ * of the visible screen is sent once per frame. When less than a screenful
+ * arrived since the last frame, the final update is sent and output passes
+ * through as is again.
+ */
+class ScreenThrottle
+{
+private:
+    ScreenModel model_;
+    uint64_t periodUsec_;
+    size_t threshold_;
+    bool flooding_ = false;
+    uint64_t periodStart_ = 0;
+    size_t periodBytes_ = 0;
+    uint64_t nextFrame_ = 0;
+    size_t frameBytes_ = 0;
+    unsigned long floods_ = 0;
+    unsigned long frames_ = 0;
+    unsigned long long heldBytes_ = 0;
+
+public:
+    ScreenThrottle(unsigned int fps, const struct winsize *winp);
+
+    void resize(const struct winsize *winp);
+    bool feed(const char *buf, size_t len);
+
+    bool flooding() const { return flooding_; }
+    bool frameDue() const;
+    void frame(std::string &out);
+    void reset() { model_.reset(); }
+    struct timespec *timeout(struct timespec *ts, struct timespec *other);
+
+    unsigned long floods() const { return floods_; }
+    unsigned long frames() const { return frames_; }
+    unsigned long long heldBytes() const { return heldBytes_; }
+};
+
+#endif /* SCREENTHROTTLE_HPP */
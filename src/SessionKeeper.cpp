@@ -0,0 +1,231 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "SessionKeeper.hpp"
+
+/* Abstract address, it goes away with its socket and is per user */
+static socklen_t session_address(const char *name, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    const int len = snprintf(addr->sun_path + 1, sizeof addr->sun_path - 1,
+                             "wslbridge2-%u-%s", (unsigned int)getuid(), name);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+SessionKeeper::SessionKeeper(const char *name, const struct winsize *winp) :
+    name_(name ? name : ""),
+    screen_(winp->ws_row, winp->ws_col)
+{
+}
+
+SessionKeeper::~SessionKeeper()
+{
+    if (handoverSock_ >= 0)
+        close(handoverSock_);
+    if (listenSock_ >= 0)
+        close(listenSock_);
+}
+
+bool SessionKeeper::handover(const char *name, int sock, const struct winsize *winp)
+{
+    const int unixSock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (unixSock < 0)
+        return false;
+
+    /* Nobody listens if there is no session of this name */
+    struct sockaddr_un addr;
+    const socklen_t addrlen = session_address(name, &addr);
+    if (connect(unixSock, (struct sockaddr *)&addr, addrlen) != 0)
+    {
+        close(unixSock);
+        return false;
+    }
+
+    /* Any user may bind an abstract name, the terminal goes to the same user only */
+    struct ucred cred;
+    socklen_t credlen = sizeof cred;
+    if (getsockopt(unixSock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+        cred.uid != getuid())
+    {
+        close(unixSock);
+        return false;
+    }
+
+    struct winsize size = *winp;
+    struct iovec iov = { &size, sizeof size };
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+    /* Session acknowledges when it owns the connection */
+    struct timeval tv = { SESSION_HANDOVER_SEC, 0 };
+    setsockopt(unixSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    char ack = 0;
+    const bool taken = sendmsg(unixSock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof size &&
+                       recv(unixSock, &ack, 1, 0) == 1;
+
+    close(unixSock);
+    return taken;
+}
+
+bool SessionKeeper::listen()
+{
+    if (name_.empty() || name_.size() > SESSION_NAME_MAX)
+        return false;
+
+    listenSock_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listenSock_ < 0)
+        return false;
+
+    struct sockaddr_un addr;
+    const socklen_t addrlen = session_address(name_.c_str(), &addr);
+    if (bind(listenSock_, (struct sockaddr *)&addr, addrlen) != 0 ||
+        ::listen(listenSock_, 1) != 0)
+    {
+        close(listenSock_);
+        listenSock_ = -1;
+        return false;
+    }
+
+    return true;
+}
+
+int SessionKeeper::accept(struct winsize *winp)
+{
+    if (handoverSock_ < 0)
+    {
+        const int conn = accept4(listenSock_, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (conn < 0)
+            return -1;
+
+        /* Only the same user may take over the terminal */
+        struct ucred cred;
+        socklen_t credlen = sizeof cred;
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+            cred.uid != getuid())
+        {
+            close(conn);
+            return -1;
+        }
+
+        handoverSock_ = conn;
+        handoverEnd_ = monotonic_usec() + SESSION_HANDOVER_SEC * 1000000ULL;
+    }
+    else if (expired())
+    {
+        close(handoverSock_);
+        handoverSock_ = -1;
+        return -1;
+    }
+
+    struct winsize size;
+    struct iovec iov = { &size, sizeof size };
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    /* Message has not come yet, relay loop polls for it */
+    int sock = -1;
+    const ssize_t ret = recvmsg(handoverSock_, &msg, MSG_CMSG_CLOEXEC);
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret == (ssize_t)sizeof size && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+        memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+
+    /* Fresh socket has room for the acknowledgment */
+    const char ack = 'a';
+    if (sock >= 0 && send(handoverSock_, &ack, 1, MSG_NOSIGNAL) != 1)
+    {
+        close(sock);
+        sock = -1;
+    }
+
+    close(handoverSock_);
+    handoverSock_ = -1;
+    if (sock < 0)
+        return -1;
+
+    *winp = size;
+    attaches_++;
+    return sock;
+}
+
+bool SessionKeeper::expired() const
+{
+    return handoverSock_ >= 0 && monotonic_usec() >= handoverEnd_;
+}
+
+struct timespec *SessionKeeper::timeout(struct timespec *ts, struct timespec *other)
+{
+    if (handoverSock_ < 0)
+        return other;
+
+    const uint64_t now = monotonic_usec();
+    const uint64_t remain = handoverEnd_ > now ? handoverEnd_ - now : 0;
+    return earliest_timeout(ts, remain, other);
+}
+
+void SessionKeeper::feed(const char *buf, size_t len)
+{
+    if (listenSock_ < 0)
+        return;
+
+    screen_.feed(buf, len, false);
+    if (!attached_)
+        missedBytes_ += len;
+}
+
+void SessionKeeper::resize(const struct winsize *winp)
+{
+    if (listenSock_ >= 0)
+        screen_.resize(winp->ws_row, winp->ws_col);
+}
+
+void SessionKeeper::detach()
+{
+    attached_ = false;
+    detaches_++;
+}
+
+void SessionKeeper::snapshot(std::string &out)
+{
+    screen_.reset();
+    screen_.render(out);
+    attached_ = true;
+}
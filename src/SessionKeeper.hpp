@@ -0,0 +1,84 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef SESSIONKEEPER_HPP
+#define SESSIONKEEPER_HPP
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include <string>
+
+#include "ScreenModel.hpp"
+
+/* Longest session name, it is part of a unix socket address */
+#define SESSION_NAME_MAX 64
+
+/* Time a backend waits for the session to take its connection */
+#define SESSION_HANDOVER_SEC 5
+
+/*
+ * Named session that outlives its connection, see --session. The backend
+ * owning the name listens on an abstract unix socket. A later backend
+ * started with the same name connects to it, passes its frontend
+ * connection and window size with SCM_RIGHTS and exits. The relay loop
+ * polls fd(), which is the connection of a handover in progress while
+ * its message has not come, so a peer that stays silent never blocks it.
+ *
+ * Pty output is also fed to a screen model. While nobody is attached the
+ * output is only kept there, a new connection gets one snapshot of the
+ * screen instead of the output it missed. Modes set by output that is
+ * passed through, e.g. mouse tracking, are not part of the snapshot.
+ */
+class SessionKeeper
+{
+private:
+    std::string name_;
+    int listenSock_ = -1;
+    int handoverSock_ = -1;
+    uint64_t handoverEnd_ = 0;
+    ScreenModel screen_;
+    bool attached_ = true;
+    unsigned long detaches_ = 0;
+    unsigned long attaches_ = 0;
+    unsigned long long missedBytes_ = 0;
+
+public:
+    SessionKeeper(const char *name, const struct winsize *winp);
+    ~SessionKeeper();
+
+    /* Pass connection to a running session, true if the session took it. */
+    static bool handover(const char *name, int sock, const struct winsize *winp);
+
+    /* Own the name, false if another backend has it. */
+    bool listen();
+
+    /* Take a connection passed by handover when fd() is ready or expired(), return it or -1. */
+    int accept(struct winsize *winp);
+
+    /* Handover in progress took longer than SESSION_HANDOVER_SEC. */
+    bool expired() const;
+
+    /* Shorter of other and time left for handover in progress. */
+    struct timespec *timeout(struct timespec *ts, struct timespec *other);
+
+    void feed(const char *buf, size_t len);
+    void resize(const struct winsize *winp);
+    void detach();
+
+    /* Append a full repaint of the screen for a new connection. */
+    void snapshot(std::string &out);
+
+    int fd() const { return handoverSock_ >= 0 ? handoverSock_ : listenSock_; }
+    bool listening() const { return listenSock_ >= 0; }
+    bool attached() const { return attached_; }
+    unsigned long detaches() const { return detaches_; }
+    unsigned long attaches() const { return attaches_; }
+    unsigned long long missedBytes() const { return missedBytes_; }
+};
+
+#endif /* SESSIONKEEPER_HPP */
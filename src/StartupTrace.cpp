@@ -0,0 +1,106 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "StartupTrace.hpp"
+
+static uint64_t clock_usec(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Monotonic time in microseconds */
+uint64_t StartupTrace::now()
+{
+    return monotonic_usec();
+}
+
+void StartupTrace::enable(const char *path)
+{
+    enabled_ = true;
+    path_ = path;
+    wallOffset_ = (int64_t)(clock_usec(CLOCK_REALTIME) - now());
+}
+
+void StartupTrace::phase(const char *name)
+{
+    if (!enabled_)
+        return;
+
+    const uint64_t time = now();
+    if (phase_)
+        events_.push_back({ phase_, phaseStart_, time });
+
+    phase_ = name;
+    phaseStart_ = time;
+}
+
+void StartupTrace::end()
+{
+    if (!enabled_ || !phase_)
+        return;
+
+    events_.push_back({ phase_, phaseStart_, now() });
+    phase_ = nullptr;
+}
+
+void StartupTrace::span(const char *name, uint64_t start)
+{
+    if (enabled_)
+        events_.push_back({ name, start, now() });
+}
+
+void StartupTrace::instant(const char *name)
+{
+    if (!enabled_)
+        return;
+
+    const uint64_t time = now();
+    events_.push_back({ name, time, time });
+}
+
+bool StartupTrace::write()
+{
+    if (!enabled_)
+        return true;
+
+    end();
+    enabled_ = false;
+
+    FILE *file = fopen(path_.c_str(), "w");
+    if (!file)
+    {
+        perror(path_.c_str());
+        return false;
+    }
+
+    const int pid = getpid();
+    fprintf(file, "{\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+        "\"args\":{\"name\":\"%s\"}}", pid, pid, process_);
+
+    /* Names are literals in source, they need no escaping */
+    for (const Event &event : events_)
+    {
+        const unsigned long long ts = event.start + wallOffset_;
+        if (event.end == event.start)
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"p\","
+                "\"ts\":%llu,\"pid\":%d,\"tid\":%d}", event.name, ts, pid, pid);
+        else
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,"
+                "\"dur\":%llu,\"pid\":%d,\"tid\":%d}", event.name, ts,
+                (unsigned long long)(event.end - event.start), pid, pid);
+    }
+
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
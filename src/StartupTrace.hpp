@@ -0,0 +1,60 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef STARTUPTRACE_HPP
+#define STARTUPTRACE_HPP
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Timestamps of session startup phases, written as Chrome trace JSON that
+ * Perfetto and chrome://tracing can open. Phases are measured with the
+ * monotonic clock. Timestamps are shifted to wall clock time, so traces of
+ * frontend and backend can be merged into one timeline.
+ */
+class StartupTrace
+{
+private:
+    struct Event
+    {
+        const char *name;
+        uint64_t start;
+        uint64_t end;   /* Same as start for instant events */
+    };
+
+    bool enabled_ = false;
+    int64_t wallOffset_ = 0;
+    const char *process_;
+    const char *phase_ = nullptr;
+    uint64_t phaseStart_ = 0;
+    std::string path_;
+    std::vector<Event> events_;
+
+public:
+    StartupTrace(const char *process) : process_(process) {}
+
+    /* Start recording, trace is written to path */
+    void enable(const char *path);
+    bool enabled() const { return enabled_; }
+
+    /* End current phase, if any, and start a new one */
+    void phase(const char *name);
+    void end();
+
+    /* Record a phase that started at a known time */
+    void span(const char *name, uint64_t start);
+    void instant(const char *name);
+
+    /* End recording and write trace file, return false if it fails */
+    bool write();
+
+    static uint64_t now();
+};
+
+#endif /* STARTUPTRACE_HPP */
@@ -0,0 +1,99 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <stdio.h>
+
+#include "common.hpp"
+#include "nix-sock.h"
+#include "TrafficClassifier.hpp"
+
+TrafficClassifier::TrafficClassifier(int sock) :
+    sock_(sock)
+{
+}
+
+void TrafficClassifier::setCork(bool cork)
+{
+    if (cork == corked_)
+        return;
+
+    if (nix_sock_cork(sock_, cork) != 0)
+        perror("setsockopt(TCP_CORK)");
+    corked_ = cork;
+}
+
+void TrafficClassifier::setBulk(bool bulk, uint64_t now)
+{
+    if (bulk)
+        bulkStart_ = now;
+    else
+        bulkUsec_ += now - bulkStart_;
+
+    bulk_ = bulk;
+    switches_++;
+}
+
+void TrafficClassifier::input()
+{
+    lastInputTime_ = monotonic_usec();
+    setCork(false);
+}
+
+bool TrafficClassifier::output(size_t len)
+{
+    const uint64_t now = monotonic_usec();
+    const uint64_t gap = now - lastReadTime_;
+    lastReadTime_ = now;
+
+    bulkReads_ = len >= CLASSIFY_BULK_READ && gap < CLASSIFY_BURST_USEC ? bulkReads_ + 1 : 0;
+
+    /* Flood is read in big pieces, a small one after a keystroke is its echo */
+    const bool typing = now - lastInputTime_ < CLASSIFY_ECHO_USEC;
+    if (bulk_ && (gap >= CLASSIFY_IDLE_USEC || (typing && len < CLASSIFY_ECHO_READ)))
+        setBulk(false, now);
+    else if (!bulk_ && bulkReads_ >= CLASSIFY_BULK_READS)
+        setBulk(true, now);
+
+    /* Echo in a flood waits behind the flood, but not for a full segment */
+    setCork(bulk_ && !typing);
+    return bulk_;
+}
+
+void TrafficClassifier::sent()
+{
+    lastReadTime_ = monotonic_usec();
+}
+
+void TrafficClassifier::update(bool ptyPolled)
+{
+    if (!bulk_)
+        return;
+
+    const uint64_t now = monotonic_usec();
+    if (!ptyPolled)
+        lastReadTime_ = now;
+    else if (now - lastReadTime_ >= CLASSIFY_IDLE_USEC)
+    {
+        setBulk(false, now);
+        setCork(false);
+    }
+}
+
+/* Shorter of other and time left until quiet pty ends bulk mode */
+struct timespec *TrafficClassifier::timeout(struct timespec *ts, struct timespec *other)
+{
+    if (!bulk_)
+        return other;
+
+    const uint64_t elapsed = monotonic_usec() - lastReadTime_;
+    const uint64_t remain = elapsed < CLASSIFY_IDLE_USEC ? CLASSIFY_IDLE_USEC - elapsed : 0;
+    return earliest_timeout(ts, remain, other);
+}
+
+uint64_t TrafficClassifier::bulkUsec() const
+{
+    return bulkUsec_ + (bulk_ ? monotonic_usec() - bulkStart_ : 0);
+}
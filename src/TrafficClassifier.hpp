@@ -0,0 +1,76 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef TRAFFICCLASSIFIER_HPP
+#define TRAFFICCLASSIFIER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Pty reads at least this big and this close together are bulk-like */
+#define CLASSIFY_BULK_READ 512
+#define CLASSIFY_BURST_USEC 1000
+
+/* Bulk-like reads in a row that switch output to bulk mode */
+#define CLASSIFY_BULK_READS 4
+
+/* Bulk mode ends when pty is quiet for this long */
+#define CLASSIFY_IDLE_USEC 2000
+
+/* Output this small and this soon after a keystroke is its echo */
+#define CLASSIFY_ECHO_READ 64
+#define CLASSIFY_ECHO_USEC 20000
+
+/*
+ * Picks how pty output is sent from size and timing of pty reads and
+ * recent keystrokes. Interactive output, e.g. an echo, is sent as soon
+ * as it is read. Bulk output is staged until the buffer is full or the
+ * coalesce deadline is over, and a localhost socket is corked so that
+ * only full segments leave. A short quiet time or an echo switches back
+ * and uncorks, which pushes the tail of the flood out. Keystrokes during
+ * a flood uncork the socket for a while, so their echo does not wait for
+ * a full segment.
+ */
+class TrafficClassifier
+{
+private:
+    int sock_;
+    bool bulk_ = false;
+    bool corked_ = false;
+    unsigned int bulkReads_ = 0;
+    uint64_t lastReadTime_ = 0;
+    uint64_t lastInputTime_ = 0;
+    uint64_t bulkStart_ = 0;
+    unsigned long switches_ = 0;
+    uint64_t bulkUsec_ = 0;
+
+    void setBulk(bool bulk, uint64_t now);
+    void setCork(bool cork);
+
+public:
+    TrafficClassifier(int sock);
+
+    /* Frontend sent terminal data. */
+    void input();
+
+    /* Pty read of len bytes, return true if output is bulk now. */
+    bool output(size_t len);
+
+    /* Staged output was sent, time blocked in send is not a quiet pty. */
+    void sent();
+
+    /* Switch back to interactive when bulk output stopped, a pty that is
+       not read because frontend is slow is not quiet. */
+    void update(bool ptyPolled);
+    struct timespec *timeout(struct timespec *ts, struct timespec *other);
+
+    bool bulk() const { return bulk_; }
+    unsigned long switches() const { return switches_; }
+    uint64_t bulkUsec() const;
+};
+
+#endif /* TRAFFICCLASSIFIER_HPP */
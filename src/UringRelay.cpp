@@ -0,0 +1,715 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "BinaryLog.hpp"
+#include "ChildWatcher.hpp"
+#include "common.hpp"
+#include "FlightRecorder.hpp"
+#include "InputQueue.hpp"
+#include "ResizeDebouncer.hpp"
+#include "StartupTrace.hpp"
+#include "UringRelay.hpp"
+
+/* Linux 6.7, newer than kernel headers of many distributions */
+#define URING_OP_READ_MULTISHOT 49
+
+/* Buffer groups of provided buffer rings */
+#define URING_GROUP_OUTPUT 0
+#define URING_GROUP_INPUT 1
+
+/* Request kinds in user data */
+enum
+{
+    URING_READ = 1,
+    URING_RECEIVE = 2,
+    URING_POLL = 3,
+    URING_SEND = 4,
+    URING_CHILD = 5,
+    URING_CANCEL = 6,
+};
+
+/*
+ * Buffers of a ring start at its first byte. The flexible array of
+ * io_uring_buf_ring is behind an empty struct in C++, so it is not used.
+ */
+static struct io_uring_buf *ring_buffer(char *ring, unsigned index)
+{
+    return (struct io_uring_buf *)ring + index;
+}
+
+UringRelay::UringRelay(int inputSock, int outputSock, int mfd, int inputFd,
+    InputQueue &input, ResizeDebouncer &resizer, ChildWatcher &watcher) :
+    inputSock_(inputSock),
+    outputSock_(outputSock),
+    mfd_(mfd),
+    inputFd_(inputFd),
+    input_(input),
+    resizer_(resizer),
+    watcher_(watcher),
+    startTime_(StartupTrace::now())
+{
+}
+
+UringRelay::~UringRelay()
+{
+    /* Requests in flight are cancelled with the ring, before their buffers go */
+    if (ring_ >= 0)
+        close(ring_);
+    if (ringsLen_)
+        munmap(rings_, ringsLen_);
+    if (sqesLen_)
+        munmap(sqes_, sqesLen_);
+    if (buffersLen_)
+        munmap(buffers_, buffersLen_);
+    if (bufRingsLen_)
+        munmap(bufRings_, bufRingsLen_);
+}
+
+bool UringRelay::setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    ring_ = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_ < 0)
+        return false;
+
+    /* Wait with timeout needs Linux 5.11 */
+    const unsigned int features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                                  IORING_FEAT_EXT_ARG;
+    if ((params.features & features) != features)
+        return false;
+
+    ringsLen_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (ringsLen_ < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe))
+        ringsLen_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    rings_ = mmap(NULL, ringsLen_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_, IORING_OFF_SQ_RING);
+    if (rings_ == MAP_FAILED)
+    {
+        ringsLen_ = 0;
+        return false;
+    }
+
+    sqesLen_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = (struct io_uring_sqe *)mmap(NULL, sqesLen_, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+    {
+        sqesLen_ = 0;
+        return false;
+    }
+
+    char *rings = (char *)rings_;
+    sqHead_ = (unsigned *)(rings + params.sq_off.head);
+    sqTail_ = (unsigned *)(rings + params.sq_off.tail);
+    sqArray_ = (unsigned *)(rings + params.sq_off.array);
+    sqMask_ = *(unsigned *)(rings + params.sq_off.ring_mask);
+    sqLocal_ = *sqTail_;
+    cqHead_ = (unsigned *)(rings + params.cq_off.head);
+    cqTail_ = (unsigned *)(rings + params.cq_off.tail);
+    cqMask_ = *(unsigned *)(rings + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    /* Multishot read needs Linux 6.7, its receive and buffer rings are older */
+    union
+    {
+        struct io_uring_probe probe;
+        char buf[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    } probe;
+    memset(&probe, 0, sizeof probe);
+    if (syscall(__NR_io_uring_register, ring_, IORING_REGISTER_PROBE, &probe, 256) != 0 ||
+        probe.probe.last_op < URING_OP_READ_MULTISHOT ||
+        !(probe.probe.ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED))
+        return false;
+
+    buffersLen_ = URING_OUTPUT_BUFFERS * URING_OUTPUT_SIZE +
+                  URING_INPUT_BUFFERS * URING_INPUT_SIZE;
+    buffers_ = (char *)mmap(NULL, buffersLen_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers_ == MAP_FAILED)
+    {
+        buffersLen_ = 0;
+        return false;
+    }
+
+    /* Output is sent from registered buffers, kernel does not map them per send */
+    struct iovec iov = { buffers_, URING_OUTPUT_BUFFERS * URING_OUTPUT_SIZE };
+    if (syscall(__NR_io_uring_register, ring_, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+        return false;
+
+    /* Each buffer ring starts at a page */
+    const size_t page = sysconf(_SC_PAGESIZE);
+    bufRingsLen_ = 2 * page;
+    bufRings_ = (char *)mmap(NULL, bufRingsLen_, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufRings_ == MAP_FAILED)
+    {
+        bufRingsLen_ = 0;
+        return false;
+    }
+
+    const struct { char *ring; unsigned int entries; uint16_t group; } groups[] = {
+        { bufRings_, URING_OUTPUT_BUFFERS, URING_GROUP_OUTPUT },
+        { bufRings_ + page, URING_INPUT_BUFFERS, URING_GROUP_INPUT },
+    };
+    for (size_t i = 0; i < ARRAYSIZE(groups); i++)
+    {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof reg);
+        reg.ring_addr = (uint64_t)(uintptr_t)groups[i].ring;
+        reg.ring_entries = groups[i].entries;
+        reg.bgid = groups[i].group;
+        if (syscall(__NR_io_uring_register, ring_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+            return false;
+    }
+
+    for (int i = 0; i < URING_OUTPUT_BUFFERS; i++)
+        recycleOutput(i);
+    for (int i = 0; i < URING_INPUT_BUFFERS; i++)
+        recycleInput(i);
+
+    /* Multishot read of a tty stops after its first reads if tty may block */
+    const int flags = fcntl(mfd_, F_GETFL);
+    return flags >= 0 && fcntl(mfd_, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+/* Next submission queue entry, published by enter() */
+struct io_uring_sqe *UringRelay::sqe(uint64_t userData)
+{
+    struct io_uring_sqe *entry = &sqes_[sqLocal_ & sqMask_];
+    memset(entry, 0, sizeof *entry);
+    entry->user_data = userData;
+    sqArray_[sqLocal_ & sqMask_] = sqLocal_ & sqMask_;
+    sqLocal_++;
+    return entry;
+}
+
+/* Submit new requests and wait for a completion, false if ring is broken */
+bool UringRelay::enter(struct timespec *wait)
+{
+    __atomic_store_n(sqTail_, sqLocal_, __ATOMIC_RELEASE);
+    const unsigned int submit = sqLocal_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    unsigned int flags = IORING_ENTER_GETEVENTS;
+    if (wait)
+    {
+        ts.tv_sec = wait->tv_sec;
+        ts.tv_nsec = wait->tv_nsec;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    /* Completions that are already there need no wait */
+    const unsigned int waitFor =
+        __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) == *cqHead_ ? 1 : 0;
+
+    /* A send in flight waits for the socket, output that is not sent for the window */
+    const int waitFlags = (sending_ ? RECORD_WAIT_SOCKET : 0) |
+                          (!sending_ && !pending_.empty() ? RECORD_WAIT_WINDOW : 0) |
+                          (polling_ ? RECORD_WAIT_PTY : 0);
+    const uint64_t start = g_recorder.begin(RECORD_WAIT, waitFlags);
+    const long ret = syscall(__NR_io_uring_enter, ring_, submit, waitFor, flags,
+                             wait ? &arg : NULL, sizeof arg);
+    enters_++;
+
+    /* Ready count is the completions */
+    g_recorder.finish(RECORD_WAIT,
+        (__atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) - *cqHead_) | waitFlags, start);
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+    {
+        perror("io_uring_enter");
+        return false;
+    }
+
+    return true;
+}
+
+void UringRelay::recycleOutput(int buffer)
+{
+    struct io_uring_buf_ring *ring = (struct io_uring_buf_ring *)bufRings_;
+    struct io_uring_buf *buf = ring_buffer(bufRings_, outputTail_ & (URING_OUTPUT_BUFFERS - 1));
+    buf->addr = (uint64_t)(uintptr_t)(outputBuffer(buffer) + FRAME_HEADER_LEN);
+    buf->len = URING_OUTPUT_SIZE - FRAME_HEADER_LEN;
+    buf->bid = buffer;
+    __atomic_store_n(&ring->tail, ++outputTail_, __ATOMIC_RELEASE);
+    outputFree_++;
+}
+
+void UringRelay::recycleInput(int buffer)
+{
+    char *page = bufRings_ + bufRingsLen_ / 2;
+    struct io_uring_buf_ring *ring = (struct io_uring_buf_ring *)page;
+    struct io_uring_buf *buf = ring_buffer(page, inputTail_ & (URING_INPUT_BUFFERS - 1));
+    buf->addr = (uint64_t)(uintptr_t)inputBuffer(buffer);
+    buf->len = URING_INPUT_SIZE;
+    buf->bid = buffer;
+    __atomic_store_n(&ring->tail, ++inputTail_, __ATOMIC_RELEASE);
+}
+
+/* Start requests that ended or are needed now */
+void UringRelay::arm()
+{
+    /* After exit of child a single read ends with EAGAIN when pty is drained */
+    if (!reading_ && !hangup_ && outputFree_ > 0)
+    {
+        struct io_uring_sqe *entry = sqe(URING_READ);
+        entry->opcode = childExited_ ? IORING_OP_READ : URING_OP_READ_MULTISHOT;
+        entry->len = childExited_ ? URING_OUTPUT_SIZE - FRAME_HEADER_LEN : 0;
+        entry->fd = mfd_;
+        entry->off = (uint64_t)-1;
+        entry->flags = IOSQE_BUFFER_SELECT;
+        entry->buf_group = URING_GROUP_OUTPUT;
+        reading_ = true;
+        readArms_++;
+    }
+
+    if (!receiving_ && inputOpen_ && held_.size() < URING_INPUT_BUFFERS)
+    {
+        struct io_uring_sqe *entry = sqe(URING_RECEIVE);
+        entry->opcode = IORING_OP_RECV;
+        entry->fd = inputSock_;
+        entry->ioprio = IORING_RECV_MULTISHOT;
+        entry->flags = IOSQE_BUFFER_SELECT;
+        entry->buf_group = URING_GROUP_INPUT;
+        receiving_ = true;
+    }
+
+    if (!watching_ && !childExited_ && watcher_.fd() >= 0)
+    {
+        struct io_uring_sqe *entry = sqe(URING_CHILD);
+        entry->opcode = IORING_OP_POLL_ADD;
+        entry->fd = watcher_.fd();
+        entry->poll32_events = POLLIN;
+        watching_ = true;
+    }
+
+    if (!polling_ && !input_.empty())
+    {
+        struct io_uring_sqe *entry = sqe(URING_POLL);
+        entry->opcode = IORING_OP_POLL_ADD;
+        entry->fd = inputFd_;
+        entry->poll32_events = POLLOUT;
+        polling_ = true;
+    }
+}
+
+/* Pty output in a buffer, or end of the multishot read */
+void UringRelay::onRead(int res, uint32_t flags)
+{
+    g_recorder.mark(RECORD_PTY_READ, res);
+    if (!(flags & IORING_CQE_F_MORE))
+        reading_ = false;
+
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER))
+    {
+        const int buffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        frame_encode_header(outputBuffer(buffer), FRAME_DATA, res);
+        pending_.push_back({ buffer, std::string(), FRAME_HEADER_LEN + (size_t)res, 0, false });
+        outputFree_--;
+        ptyReads_++;
+    }
+    else if (res != -ENOBUFS && res != -ECANCELED) /* Slave side is closed, EIO */
+        hangup_ = true;
+}
+
+/* Multishot read would wait for output of other processes in pty, stop it */
+void UringRelay::onChildExit()
+{
+    childExited_ = true;
+    if (!reading_)
+        return;
+
+    struct io_uring_sqe *entry = sqe(URING_CANCEL);
+    entry->opcode = IORING_OP_ASYNC_CANCEL;
+    entry->addr = URING_READ;
+}
+
+/* Input in a buffer, or end of the multishot receive */
+void UringRelay::onReceive(int res, uint32_t flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        receiving_ = false;
+
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER))
+    {
+        const int buffer = flags >> IORING_CQE_BUFFER_SHIFT;
+        g_recorder.mark(RECORD_INPUT_READ, res);
+        inputReads_++;
+        bytesIn_ += res;
+        held_.push_back(std::make_pair(buffer, (size_t)res));
+        releaseHeld();
+    }
+    else if (res == 0)
+        inputOpen_ = false; /* Frontend closed input, keep output going */
+    else if (res != -ENOBUFS)
+        broken_ = true;
+}
+
+/* Decode input, queue its data for pty, return false if pty is broken */
+bool UringRelay::receive(const char *buf, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        pos += decoder_.decode(buf + pos, len - pos);
+
+        /* Frontend never compresses input */
+        if (decoder_.iovcnt() && decoder_.iovType() == FRAME_DEFLATE)
+            return false;
+        if (!input_.write(decoder_.iov(), decoder_.iovcnt()))
+            return false;
+        decoder_.clearIov();
+
+        uint8_t type, channel;
+        const char *payload;
+        size_t payloadLen;
+        if (decoder_.takeEvent(&type, &channel, &payload, &payloadLen))
+            handleEvent(type, channel, payload, payloadLen);
+    }
+
+    return true;
+}
+
+/* Same frames as handle_frame() of poll loop */
+void UringRelay::handleEvent(uint8_t type, uint8_t channel,
+    const char *payload, size_t len)
+{
+    if (channel == CHANNEL_CONTROL && type == FRAME_STATS)
+        statsRequested_ = true;
+    if (channel == CHANNEL_CONTROL && type == FRAME_RECORDER)
+        recorderRequested_ = true;
+    if (channel != CHANNEL_TERMINAL)
+        return;
+
+    switch (type)
+    {
+        case FRAME_RESIZE:
+            if (len == sizeof(struct winsize))
+            {
+                struct winsize winp;
+                memcpy(&winp, payload, sizeof winp);
+                resizer_.request(&winp);
+            }
+            break;
+
+        case FRAME_SIGNAL:
+            if (len == 1 && ioctl(mfd_, TIOCSIG, (int)payload[0]) != 0)
+                perror("ioctl(TIOCSIG)");
+            if (len == 1)
+                g_recorder.mark(RECORD_SIGNAL, payload[0]);
+            break;
+
+        case FRAME_CONTROL:
+            if (len >= 1 && payload[0] == CONTROL_EOF)
+            {
+                struct termios termp;
+                if (tcgetattr(mfd_, &termp) == 0 &&
+                    !input_.write((const char *)&termp.c_cc[VEOF], 1))
+                    perror("write(VEOF)");
+            }
+            break;
+
+        case FRAME_WINDOW:
+            if (len == 4)
+            {
+                outputWindow_ += frame_get_u32(payload);
+                g_recorder.mark(RECORD_WINDOW, frame_get_u32(payload));
+            }
+            break;
+
+        default: /* Unknown frame types are ignored */
+            break;
+    }
+}
+
+/* Decode received buffers while input queue has room and give them back */
+void UringRelay::releaseHeld()
+{
+    while (!held_.empty() && !input_.full() && !broken_)
+    {
+        const std::pair<int, size_t> held = held_.front();
+        held_.pop_front();
+        if (!receive(inputBuffer(held.first), held.second))
+            broken_ = true;
+        recycleInput(held.first);
+    }
+}
+
+/* Send of a batch completed, a short one leaves the rest for next batch */
+void UringRelay::onSend(int res)
+{
+    sending_ = false;
+    if (res <= 0)
+        broken_ = true; /* EPIPE, frontend is gone */
+    g_recorder.mark(RECORD_SEND, res);
+
+    size_t left = res > 0 ? res : 0;
+    std::vector<Send> unsent;
+    for (Send &send : batch_)
+    {
+        const size_t len = std::min(left, send.len - send.sent);
+        send.sent += len;
+        left -= len;
+
+        if (send.sent < send.len)
+            unsent.push_back(std::move(send));
+        else if (send.buffer >= 0)
+        {
+            bytesOut_ += send.len - FRAME_HEADER_LEN;
+            recycleOutput(send.buffer);
+        }
+    }
+
+    batch_.clear();
+    pending_.insert(pending_.begin(), std::make_move_iterator(unsent.begin()),
+                    std::make_move_iterator(unsent.end()));
+}
+
+void UringRelay::queueControl(const char *frame, size_t len)
+{
+    pending_.push_back({ -1, std::string(frame, len), len, 0, false });
+}
+
+/* Counters of this loop under the ids of poll loop, wakeups are ring enters */
+void UringRelay::queueStats()
+{
+    const struct { uint8_t id; uint64_t value; } counters[] = {
+        { STAT_UPTIME_USEC, StartupTrace::now() - startTime_ },
+        { STAT_BYTES_IN, bytesIn_ },
+        { STAT_BYTES_OUT, bytesOut_ },
+        { STAT_INPUT_READS, inputReads_ },
+        { STAT_PTY_READS, ptyReads_ },
+        { STAT_SOCKET_SENDS, sockSends_ },
+        { STAT_POLL_WAKEUPS, enters_ },
+        { STAT_RESIZES, resizer_.applied() },
+    };
+
+    char frame[FRAME_HEADER_LEN + ARRAYSIZE(counters) * FRAME_STAT_LEN];
+    size_t len = FRAME_HEADER_LEN;
+    for (size_t i = 0; i < ARRAYSIZE(counters); i++)
+        len += frame_encode_stat(frame + len, counters[i].id, counters[i].value);
+    frame_encode_header(frame, FRAME_STATS, len - FRAME_HEADER_LEN, CHANNEL_CONTROL);
+    queueControl(frame, len);
+}
+
+/* Dump flight recorder and queue its path, empty if it is off */
+void UringRelay::queueRecorder()
+{
+    char dumpPath[RECORDER_DUMP_PATH_MAX];
+    g_recorder.mark(RECORD_DUMP, g_recorder.dumps() + 1);
+    const char *path = g_recorder.dump(dumpPath);
+    const size_t pathLen = path ? strlen(path) : 0;
+
+    std::string frame(FRAME_HEADER_LEN + pathLen, '\0');
+    frame_encode_header(&frame[0], FRAME_RECORDER, pathLen, CHANNEL_CONTROL);
+    if (path)
+        memcpy(&frame[FRAME_HEADER_LEN], path, pathLen);
+    queueControl(frame.data(), frame.size());
+}
+
+/*
+ * Send what may leave now in one request. Output beyond the window waits
+ * with everything behind it, except control frames, which have not
+ * started. At hangup the rest of output is sent regardless of window,
+ * like poll loop does.
+ */
+void UringRelay::submitSends()
+{
+    std::deque<Send> later;
+    bool blocked = false;
+    for (Send &send : pending_)
+    {
+        if (send.buffer >= 0 && !send.charged && !blocked)
+        {
+            const long long dataLen = send.len - FRAME_HEADER_LEN;
+            if (hangup_ || outputWindow_ >= dataLen)
+            {
+                outputWindow_ -= dataLen;
+                send.charged = true;
+            }
+            else
+                blocked = true;
+        }
+
+        const bool waits = send.buffer >= 0 && !send.charged;
+        if (waits || batch_.size() == URING_BATCH_MAX)
+            later.push_back(std::move(send));
+        else
+            batch_.push_back(std::move(send));
+    }
+    pending_.swap(later);
+    if (batch_.empty())
+        return;
+
+    for (size_t i = 0; i < batch_.size(); i++)
+    {
+        const Send &send = batch_[i];
+        char *base = send.buffer >= 0 ? outputBuffer(send.buffer) : (char *)send.control.data();
+        iov_[i].iov_base = base + send.sent;
+        iov_[i].iov_len = send.len - send.sent;
+    }
+
+    /* Lone frame, e.g. an echo, is sent from its registered buffer */
+    struct io_uring_sqe *entry = sqe(URING_SEND);
+    entry->fd = outputSock_;
+    entry->off = (uint64_t)-1;
+    if (batch_.size() == 1 && batch_[0].buffer >= 0)
+    {
+        entry->opcode = IORING_OP_WRITE_FIXED;
+        entry->addr = (uint64_t)(uintptr_t)iov_[0].iov_base;
+        entry->len = iov_[0].iov_len;
+        entry->buf_index = 0;
+    }
+    else
+    {
+        entry->opcode = IORING_OP_WRITEV;
+        entry->addr = (uint64_t)(uintptr_t)iov_;
+        entry->len = batch_.size();
+    }
+
+    sending_ = true;
+    sockSends_++;
+}
+
+/* Apply pending window size to pty if resize interval is over */
+void UringRelay::applyResize()
+{
+    struct winsize winp;
+    if (!resizer_.take(&winp))
+        return;
+
+    const uint64_t start = g_recorder.now();
+    if (ioctl(mfd_, TIOCSWINSZ, &winp) != 0)
+        perror("ioctl(TIOCSWINSZ)");
+    g_recorder.record(RECORD_RESIZE, winp.ws_col << 16 | winp.ws_row, start);
+    g_log.write(LOG_LEVEL_DEBUG, LOG_RESIZE, { winp.ws_col, winp.ws_row });
+}
+
+/* Handle completions that are in the queue */
+void UringRelay::reap(StartupTrace &trace)
+{
+    unsigned head = *cqHead_;
+    const unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        const struct io_uring_cqe *cqe = &cqes_[head & cqMask_];
+        switch (cqe->user_data)
+        {
+            case URING_READ:
+                if (ptyReads_ == 0 && cqe->res > 0 && trace.enabled())
+                {
+                    trace.end();
+                    trace.instant("first pty byte");
+                }
+                onRead(cqe->res, cqe->flags);
+                break;
+
+            case URING_RECEIVE:
+                onReceive(cqe->res, cqe->flags);
+                break;
+
+            case URING_POLL:
+            {
+                polling_ = false;
+                const unsigned long long written = input_.written();
+                if (!input_.flush())
+                    broken_ = true;
+                g_recorder.mark(RECORD_PTY_WRITE, input_.written() - written);
+                releaseHeld();
+                break;
+            }
+
+            case URING_SEND:
+                onSend(cqe->res);
+                break;
+
+            case URING_CHILD:
+                watching_ = false;
+                if (watcher_.reap())
+                {
+                    g_recorder.mark(RECORD_CHILD_EXIT, watcher_.exitStatus());
+                    onChildExit();
+                }
+                break;
+        }
+    }
+
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+bool UringRelay::run(StartupTrace &trace)
+{
+    while (!broken_)
+    {
+        /* Let frontend send more input when half window is written to pty */
+        const unsigned long long consumed = input_.written() - inputGranted_;
+        if (consumed >= FRAME_WINDOW_INITIAL / 2)
+        {
+            char frame[FRAME_HEADER_LEN + 4];
+            queueControl(frame, frame_encode_window(frame, consumed));
+            inputGranted_ += consumed;
+        }
+
+        if (statsRequested_)
+        {
+            statsRequested_ = false;
+            queueStats();
+        }
+
+        if (recorderRequested_)
+        {
+            recorderRequested_ = false;
+            queueRecorder();
+        }
+
+        if (!sending_ && !pending_.empty())
+        {
+            submitSends();
+
+            /* Startup is over when first output is on its way */
+            if (ptyReads_ && trace.enabled())
+                trace.write();
+        }
+
+        /* Output of a hung up pty is sent, nothing is in flight that needs buffers */
+        if (hangup_ && !sending_ && pending_.empty())
+            return true;
+
+        arm();
+
+        struct timespec timeout;
+        if (!enter(resizer_.timeout(&timeout, NULL)))
+            return false;
+
+        reap(trace);
+
+        /* Window size of a resize storm settles before pty sees it */
+        applyResize();
+    }
+
+    return false;
+}
@@ -0,0 +1,177 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+#ifndef URINGRELAY_HPP
+#define URINGRELAY_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "FrameCodec.hpp"
+
+/* Pty output buffers, frame header included, they hold one output window */
+#define URING_OUTPUT_BUFFERS 16
+#define URING_OUTPUT_SIZE 16384
+
+/* Buffers of input socket */
+#define URING_INPUT_BUFFERS 8
+#define URING_INPUT_SIZE 4096
+
+/* Submission queue, a wakeup submits at most six requests */
+#define URING_ENTRIES 8
+
+/* Frames in one send, output buffers and a few control frames */
+#define URING_BATCH_MAX 32
+
+class ChildWatcher;
+class InputQueue;
+class ResizeDebouncer;
+class StartupTrace;
+
+/*
+ * Relay loop of --engine uring, for a pty in multiplexed connection. Its
+ * only syscall for moving data is io_uring_enter, which submits requests
+ * and waits for completions of a wakeup in one go.
+ *
+ * The pty is read with a multishot read into a ring of provided buffers,
+ * every completion is a pty read that did not cost a syscall. A buffer
+ * has room for a frame header before its data, so frames of a wakeup go
+ * out with one vectored write, or a lone one with a write of registered
+ * buffer. Only one send is in flight, which keeps the stream in order. A
+ * buffer goes back to the ring when it is sent,
+ * so the pty is not read while all of them wait for the socket or for
+ * output window.
+ *
+ * Input socket is received with a multishot receive into its own buffer
+ * ring. Frames are decoded like in poll loop and their data goes through
+ * the input queue, a poll request waits for the pty while input is queued.
+ * A full input queue holds received buffers, so receiving stops when the
+ * ring is empty.
+ *
+ * Exit of child is a poll request on its fd. The multishot read is then
+ * cancelled and pty is read with single reads until one finds it empty.
+ */
+class UringRelay
+{
+private:
+    struct Send
+    {
+        int buffer;             /* Output buffer, -1 for control frames */
+        std::string control;
+        size_t len;
+        size_t sent;
+        bool charged;           /* Output window is taken for it */
+    };
+
+    int inputSock_;
+    int outputSock_;
+    int mfd_;
+    int inputFd_;
+    InputQueue &input_;
+    ResizeDebouncer &resizer_;
+    ChildWatcher &watcher_;
+
+    int ring_ = -1;
+    void *rings_ = nullptr;
+    size_t ringsLen_ = 0;
+    struct io_uring_sqe *sqes_ = nullptr;
+    size_t sqesLen_ = 0;
+    unsigned *sqHead_ = nullptr;
+    unsigned *sqTail_ = nullptr;
+    unsigned *sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqLocal_ = 0;      /* Tail including requests not yet published */
+    unsigned *cqHead_ = nullptr;
+    unsigned *cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    struct io_uring_cqe *cqes_ = nullptr;
+
+    char *buffers_ = nullptr;   /* Output buffers, then input buffers */
+    size_t buffersLen_ = 0;
+    char *bufRings_ = nullptr;  /* Page of output ring, then of input ring */
+    size_t bufRingsLen_ = 0;
+    uint16_t outputTail_ = 0;
+    uint16_t inputTail_ = 0;
+    unsigned outputFree_ = 0;
+
+    bool reading_ = false;
+    bool receiving_ = false;
+    bool polling_ = false;
+    bool watching_ = false;
+    bool childExited_ = false;
+    bool inputOpen_ = true;
+    bool hangup_ = false;
+    bool broken_ = false;
+    bool statsRequested_ = false;
+    bool recorderRequested_ = false;
+
+    FrameDecoder decoder_;
+    std::deque<Send> pending_;  /* Output and control frames in stream order */
+    std::vector<Send> batch_;   /* Frames of send in flight */
+    struct iovec iov_[URING_BATCH_MAX];
+    bool sending_ = false;
+    std::deque<std::pair<int, size_t>> held_;   /* Input waiting for queue */
+    long long outputWindow_ = FRAME_WINDOW_INITIAL;
+    unsigned long long inputGranted_ = 0;
+
+    uint64_t startTime_;
+    unsigned long enters_ = 0;
+    unsigned long ptyReads_ = 0;
+    unsigned long readArms_ = 0;
+    unsigned long sockSends_ = 0;
+    unsigned long inputReads_ = 0;
+    unsigned long long bytesIn_ = 0;
+    unsigned long long bytesOut_ = 0;
+
+    struct io_uring_sqe *sqe(uint64_t userData);
+    bool enter(struct timespec *wait);
+    void reap(StartupTrace &trace);
+    char *outputBuffer(int buffer) { return buffers_ + buffer * URING_OUTPUT_SIZE; }
+    char *inputBuffer(int buffer)
+    {
+        return buffers_ + URING_OUTPUT_BUFFERS * URING_OUTPUT_SIZE + buffer * URING_INPUT_SIZE;
+    }
+    void recycleOutput(int buffer);
+    void recycleInput(int buffer);
+    void arm();
+    void onRead(int res, uint32_t flags);
+    void onReceive(int res, uint32_t flags);
+    void onSend(int res);
+    void onChildExit();
+    bool receive(const char *buf, size_t len);
+    void handleEvent(uint8_t type, uint8_t channel, const char *payload, size_t len);
+    void releaseHeld();
+    void queueControl(const char *frame, size_t len);
+    void queueStats();
+    void queueRecorder();
+    void submitSends();
+    void applyResize();
+
+public:
+    UringRelay(int inputSock, int outputSock, int mfd, int inputFd,
+        InputQueue &input, ResizeDebouncer &resizer, ChildWatcher &watcher);
+    ~UringRelay();
+
+    /* Set up ring, false if kernel lacks a feature and poll loop is needed. */
+    bool setup();
+
+    /* Relay until pty hangs up and its output is sent, false if connection breaks. */
+    bool run(StartupTrace &trace);
+
+    unsigned long enters() const { return enters_; }
+    unsigned long ptyReads() const { return ptyReads_; }
+    unsigned long readArms() const { return readArms_; }
+    unsigned long sockSends() const { return sockSends_; }
+    unsigned long long bytesIn() const { return bytesIn_; }
+    unsigned long long bytesOut() const { return bytesOut_; }
+};
+
+#endif /* URINGRELAY_HPP */
@@ -4,10 +4,15 @@
  * Copyright (C) 2019 Biswapriyo Nath.
  */
 
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "common.hpp"
+
 void fatalv(const char *fmt, va_list ap)
 {
     vfprintf(stderr, fmt, ap);
@@ -33,3 +38,48 @@ void fatalPerror(const char *msg)
     /* Avoid calling exit, which would call global destructors */
     _exit(1);
 }
+
+/* Write all iovecs, iov is modified to track partial writes. */
+bool writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t ret = writev(fd, iov, iovcnt);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return true;
+}
+
+uint64_t monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct timespec *earliest_timeout(struct timespec *ts, uint64_t remainUsec,
+    struct timespec *other)
+{
+    if (other && (uint64_t)other->tv_sec * 1000000 + other->tv_nsec / 1000 < remainUsec)
+        return other;
+
+    ts->tv_sec = remainUsec / 1000000;
+    ts->tv_nsec = (remainUsec % 1000000) * 1000;
+    return ts;
+}
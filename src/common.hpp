@@ -7,10 +7,15 @@
 #ifndef COMMON_HPP
 #define COMMON_HPP
 
+#include <stdarg.h>
+#include <stdint.h>
+
 #define WSLBRIDGE2_VERSION v0.13
 
 #define XSTRINGIFY(x) #x
 #define STRINGIFY(x) XSTRINGIFY(x)
+#define WXSTRINGIFY(x) L ## #x
+#define WSTRINGIFY(x) WXSTRINGIFY(x)
 
 #ifndef ARRAYSIZE
 #define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
@@ -22,4 +27,15 @@ void fatal(const char *fmt, ...)
 void fatalv(const char *fmt, va_list ap) __attribute__((noreturn));
 void fatalPerror(const char *msg) __attribute__((noreturn));
 
+struct iovec;
+bool writev_all(int fd, struct iovec *iov, int iovcnt);
+
+/* Monotonic time in microseconds */
+uint64_t monotonic_usec(void);
+
+/* Timeout of remainUsec in ts, or other if it is earlier, for one ppoll() of several deadlines */
+struct timespec;
+struct timespec *earliest_timeout(struct timespec *ts, uint64_t remainUsec,
+    struct timespec *other);
+
 #endif /* COMMON_HPP */
@@ -14,6 +14,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 // Need linux-headers package. Should be after sys/socket.h.
@@ -21,6 +22,71 @@
 
 #define VSOCK_BUFFER_SIZE 0x10000
 
+// Tuning of sockets created after nix_sock_tune, 0 keeps the default.
+static unsigned int bufferSize = 0;
+static unsigned int notsentLowat = 0;
+
+void nix_sock_tune(const unsigned int size, const unsigned int lowat)
+{
+    bufferSize = size;
+    notsentLowat = lowat;
+}
+
+// Set buffers of a vsock or IPv4 socket to size bytes, return 0 on success.
+int nix_sock_set_buffer(const int sock, const unsigned int size)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) != 0)
+        return -1;
+
+    const int val = size;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, sizeof val) != 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, sizeof val) != 0)
+        return -1;
+
+    // Buffer of vsock transport is the credit the peer may send, it is
+    // clamped by min and max. Transports without it accept and ignore it.
+    if (addr.ss_family == AF_VSOCK)
+    {
+        const unsigned long long vmSize = size;
+        if (setsockopt(sock, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE, &vmSize, sizeof vmSize) != 0 ||
+            setsockopt(sock, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MIN_SIZE, &vmSize, sizeof vmSize) != 0 ||
+            setsockopt(sock, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE, &vmSize, sizeof vmSize) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// Hold partial segments of IPv4 socket until uncorked, vsock is left as is.
+int nix_sock_cork(const int sock, const bool cork)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof addr;
+    if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) != 0)
+        return -1;
+
+    // Vsock sends what it has, there are no partial segments to hold.
+    if (addr.ss_family != AF_INET)
+        return 0;
+
+    const int flag = cork;
+    return setsockopt(sock, IPPROTO_TCP, TCP_CORK, &flag, sizeof flag);
+}
+
+// Apply tuning to a new IPv4 socket, kernel autotunes its buffers by default.
+static void tune_local(const int sock)
+{
+    if (bufferSize && nix_sock_set_buffer(sock, bufferSize) != 0)
+        perror("setsockopt(buffer)");
+
+    // Unsent data waits in the process, a keystroke echo queues behind less.
+    if (notsentLowat &&
+        setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notsentLowat, sizeof notsentLowat) != 0)
+        perror("setsockopt(TCP_NOTSENT_LOWAT)");
+}
+
 // Return IPv4 family socket.
 int nix_local_create(void)
 {
@@ -34,14 +100,16 @@ int nix_local_create(void)
     const int reuseRet = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof flag);
     assert(reuseRet == 0);
 
+    tune_local(sock);
     return sock;
 }
 
-// Accept IPv4 socket and return accepted socket.
+// Accept IPv4 socket and return accepted socket, -1 on timeout or error.
 int nix_local_accept(const int sock)
 {
     const int acceptSock = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
-    assert(acceptSock > 0);
+    if (acceptSock < 0)
+        return -1;
 
     const int flag = true;
     const int nodelayRet = setsockopt(acceptSock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
@@ -50,6 +118,7 @@ int nix_local_accept(const int sock)
     const int reuseRet = setsockopt(acceptSock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof flag);
     assert(reuseRet == 0);
 
+    tune_local(acceptSock);
     return acceptSock;
 }
 
@@ -94,28 +163,21 @@ int nix_vsock_create(void)
     const int sock = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
     assert(sock > 0);
 
-    const int val = VSOCK_BUFFER_SIZE;
-    const int sndbufRet = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &val, sizeof val);
-    assert(sndbufRet == 0);
-
-    const int rcvbufRet = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &val, sizeof val);
-    assert(rcvbufRet == 0);
+    const int bufRet = nix_sock_set_buffer(sock, bufferSize ? bufferSize : VSOCK_BUFFER_SIZE);
+    assert(bufRet == 0);
 
     return sock;
 }
 
-// Accept vsocket and return accepted socket.
+// Accept vsocket and return accepted socket, -1 on timeout or error.
 int nix_vsock_accept(const int sock)
 {
     const int acceptSock = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
-    assert(acceptSock > 0);
-
-    const int val = VSOCK_BUFFER_SIZE;
-    const int sndbufRet = setsockopt(acceptSock, SOL_SOCKET, SO_SNDBUF, &val, sizeof val);
-    assert(sndbufRet == 0);
+    if (acceptSock < 0)
+        return -1;
 
-    const int rcvbufRet = setsockopt(acceptSock, SOL_SOCKET, SO_RCVBUF, &val, sizeof val);
-    assert(rcvbufRet == 0);
+    const int bufRet = nix_sock_set_buffer(acceptSock, bufferSize ? bufferSize : VSOCK_BUFFER_SIZE);
+    assert(bufRet == 0);
 
     return acceptSock;
 }
@@ -136,15 +198,15 @@ int nix_vsock_connect(const unsigned int port)
     return sock;
 }
 
-// Create and listen to a vsocket and return it.
+// Create and listen to a vsocket and return it, any port if *port is 0.
 int nix_vsock_listen(unsigned int *port)
 {
     const int sock = nix_vsock_create();
 
-    // Bind to any available port and context ID.
+    // Bind to given or any available port and any context ID.
     struct sockaddr_vm addr = { 0 };
     addr.svm_family = AF_VSOCK;
-    addr.svm_port = VMADDR_PORT_ANY;
+    addr.svm_port = *port ? *port : VMADDR_PORT_ANY;
     addr.svm_cid = VMADDR_CID_ANY;
     const int bindRet = bind(sock, (struct sockaddr *)&addr, sizeof addr);
     assert(bindRet == 0);
@@ -160,3 +222,62 @@ int nix_vsock_listen(unsigned int *port)
     *port = addr.svm_port;
     return sock;
 }
+
+// Return unix family socket.
+int nix_unix_create(void)
+{
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(sock > 0);
+
+    if (bufferSize && nix_sock_set_buffer(sock, bufferSize) != 0)
+        perror("setsockopt(buffer)");
+
+    return sock;
+}
+
+// Accept unix socket and return accepted socket, -1 on timeout or error.
+int nix_unix_accept(const int sock)
+{
+    const int acceptSock = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (acceptSock < 0)
+        return -1;
+
+    if (bufferSize && nix_sock_set_buffer(acceptSock, bufferSize) != 0)
+        perror("setsockopt(buffer)");
+
+    return acceptSock;
+}
+
+// Create and connect with a unix socket at path and return it.
+int nix_unix_connect(const char *path)
+{
+    const int sock = nix_unix_create();
+
+    // Path must fit, WSL1 shares the socket file with Windows through DrvFs.
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    assert(strlen(path) < sizeof addr.sun_path);
+    strcpy(addr.sun_path, path);
+    const int connectRet = connect(sock, (struct sockaddr *)&addr, sizeof addr);
+    assert(connectRet == 0);
+
+    return sock;
+}
+
+// Create and listen to a unix socket at path and return it.
+int nix_unix_listen(const char *path)
+{
+    const int sock = nix_unix_create();
+
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    assert(strlen(path) < sizeof addr.sun_path);
+    strcpy(addr.sun_path, path);
+    const int bindRet = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    assert(bindRet == 0);
+
+    const int listenRet = listen(sock, -1);
+    assert(listenRet == 0);
+
+    return sock;
+}
@@ -7,14 +7,27 @@
 #ifndef NIX_SOCK_H
 #define NIX_SOCK_H
 
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Tune sockets created after this call: size of send and receive buffers
+// and TCP_NOTSENT_LOWAT of IPv4 sockets in bytes, 0 keeps the default.
+void nix_sock_tune(const unsigned int size, const unsigned int lowat);
+
+// Set buffers of a vsock or IPv4 socket to size bytes, return 0 on success.
+int nix_sock_set_buffer(const int sock, const unsigned int size);
+
+// Hold partial segments of IPv4 socket until uncorked, vsock is left as is.
+// Return 0 on success.
+int nix_sock_cork(const int sock, const bool cork);
+
 // Return IPv4 family socket.
 int nix_local_create(void);
 
-// Accept IPv4 socket and return accepted socket.
+// Accept IPv4 socket and return accepted socket, -1 on timeout or error.
 int nix_local_accept(const int sock);
 
 // Create and connect with a localhost socket and return it.
@@ -26,15 +39,27 @@ int nix_local_listen(const unsigned short port);
 // Return vsock family socket.
 int nix_vsock_create(void);
 
-// Accept vsocket and return accepted socket.
+// Accept vsocket and return accepted socket, -1 on timeout or error.
 int nix_vsock_accept(const int sock);
 
 // Create and connect with a vsocket and return it.
 int nix_vsock_connect(const unsigned int port);
 
-// Create and listen to a vsocket and return it.
+// Create and listen to a vsocket and return it, any port if *port is 0.
 int nix_vsock_listen(unsigned int *port);
 
+// Return unix family socket.
+int nix_unix_create(void);
+
+// Accept unix socket and return accepted socket, -1 on timeout or error.
+int nix_unix_accept(const int sock);
+
+// Create and connect with a unix socket at path and return it.
+int nix_unix_connect(const char *path);
+
+// Create and listen to a unix socket at path and return it.
+int nix_unix_listen(const char *path);
+
 #ifdef __cplusplus
 }
 #endif
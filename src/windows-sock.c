@@ -6,8 +6,10 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <string.h>
 #include <winsock2.h>
 #include <hvsocket.h>
+#include <afunix.h>
 
 #include "windows-sock.h"
 
@@ -71,6 +73,7 @@ SOCKET win_local_accept(const SOCKET sock)
 }
 
 // Create and connect with a localhost socket and return it.
+// Return INVALID_SOCKET if nobody listens on the port.
 SOCKET win_local_connect(const unsigned short port)
 {
     const SOCKET sock = win_local_create();
@@ -82,7 +85,11 @@ SOCKET win_local_connect(const unsigned short port)
     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
     const int connectRet = WSAConnect(sock, (const struct sockaddr *)&addr,
                                 sizeof addr, NULL, NULL, NULL, NULL);
-    assert(connectRet == 0);
+    if (connectRet != 0)
+    {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
 
     return sock;
 }
@@ -136,6 +143,7 @@ SOCKET win_vsock_accept(const SOCKET sock)
 }
 
 // Create and connect with a hyperv socket and return it.
+// Return INVALID_SOCKET if nobody listens on the port.
 SOCKET win_vsock_connect(const GUID *VmId, const unsigned int port)
 {
     const SOCKET sock = win_vsock_create();
@@ -152,7 +160,11 @@ SOCKET win_vsock_connect(const GUID *VmId, const unsigned int port)
     addr.ServiceId.Data1 = port;
     const int connectRet = WSAConnect(sock, (const struct sockaddr *)&addr,
                                 sizeof addr, NULL, NULL, NULL, NULL);
-    assert(connectRet == 0);
+    if (connectRet != 0)
+    {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
 
     return sock;
 }
@@ -187,3 +199,35 @@ int win_vsock_listen(const SOCKET sock, const GUID *VmId)
 
     return port;
 }
+
+// Return unix socket listening on a Windows path, for WSL1.
+SOCKET win_unix_listen(const char *path)
+{
+    const SOCKET sock = WSASocketW(AF_UNIX, SOCK_STREAM, 0,
+                            NULL, 0, WSA_FLAG_OVERLAPPED);
+    assert(sock > 0);
+
+    SOCKADDR_UN addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    assert(strlen(path) < sizeof addr.sun_path);
+    strcpy(addr.sun_path, path);
+    const int bindRet = bind(sock, (struct sockaddr *)&addr, sizeof addr);
+    assert(bindRet == 0);
+
+    // Listen for only one connection.
+    const int listenRet = listen(sock, 1);
+    assert(listenRet == 0);
+
+    return sock;
+}
+
+// Accept unix socket and return accepted socket.
+SOCKET win_unix_accept(const SOCKET sock)
+{
+    const SOCKET acceptSock = WSAAccept(sock, NULL, NULL, NULL, 0);
+    assert(acceptSock > 0);
+
+    // Server socket is no longer needed.
+    closesocket(sock);
+    return acceptSock;
+}
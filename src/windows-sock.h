@@ -21,6 +21,7 @@ SOCKET win_local_create(void);
 SOCKET win_local_accept(const SOCKET sock);
 
 // Create and connect with a localhost socket and return it.
+// Return INVALID_SOCKET if nobody listens on the port.
 SOCKET win_local_connect(const unsigned short port);
 
 // Listen to a localhost socket and return the port.
@@ -33,11 +34,18 @@ SOCKET win_vsock_create(void);
 SOCKET win_vsock_accept(const SOCKET sock);
 
 // Create and connect with a hyperv socket and return it.
+// Return INVALID_SOCKET if nobody listens on the port.
 SOCKET win_vsock_connect(const GUID *VmId, const unsigned int port);
 
 // Listen to a hyperv socket and return the port.
 int win_vsock_listen(const SOCKET sock, const GUID *VmId);
 
+// Return unix socket listening on a Windows path, for WSL1.
+SOCKET win_unix_listen(const char *path);
+
+// Accept unix socket and return accepted socket.
+SOCKET win_unix_accept(const SOCKET sock);
+
 #ifdef __cplusplus
 }
 #endif
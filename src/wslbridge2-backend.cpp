@@ -5,16 +5,21 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
 #include <pty.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <unistd.h>
 #include <wordexp.h>
 #include <limits.h> // PIPE_BUF
@@ -22,8 +27,30 @@
 #include <string>
 #include <vector>
 
+#include "BinaryLog.hpp"
+#include "BufferTuner.hpp"
+#include "ChildWatcher.hpp"
 #include "common.hpp"
+#include "FlightRecorder.hpp"
+#include "FrameCodec.hpp"
+#include "InbandCodec.hpp"
+#include "InputQueue.hpp"
 #include "nix-sock.h"
+#include "OutputCoalescer.hpp"
+#include "OutputCompressor.hpp"
+#include "PipeRelay.hpp"
+#include "ResizeDebouncer.hpp"
+#include "ScreenThrottle.hpp"
+#include "SessionKeeper.hpp"
+#include "StartupTrace.hpp"
+#include "TrafficClassifier.hpp"
+#include "UringRelay.hpp"
+
+/* Default time an unused shell of daemon session pool is kept */
+#define POOL_IDLE_DEFAULT_SEC 600
+
+/* Time frontend has to connect to port of --accept */
+#define ACCEPT_TIMEOUT_SEC 30
 
 /* Check if backend is invoked from WSL2 or WSL1 */
 static bool IsVmMode(void)
@@ -35,6 +62,261 @@ static bool IsVmMode(void)
         return false;
 }
 
+/* Monotonic time of process start, with clock tick resolution */
+static uint64_t process_start_time(void)
+{
+    char stat[1024];
+    FILE *file = fopen("/proc/self/stat", "r");
+    if (!file)
+        return 0;
+
+    const size_t len = fread(stat, 1, sizeof stat - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+
+    /* Field 22 is start time in ticks after boot, count from end of comm */
+    const char *pos = strrchr(stat, ')');
+    unsigned long long ticks;
+    if (!pos || sscanf(pos + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+            "%*u %*u %*d %*d %*d %*d %*d %*d %llu", &ticks) != 1)
+        return 0;
+
+    struct timespec boot;
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+    const uint64_t sinceStart = (uint64_t)boot.tv_sec * 1000000 + boot.tv_nsec / 1000 -
+                                ticks * 1000000 / sysconf(_SC_CLK_TCK);
+    return StartupTrace::now() - sinceStart;
+}
+
+/* State of relay loop shared with input handlers */
+struct RelayContext
+{
+    int mfd;
+    InputQueue *input;      /* Data and end of input on their way to pty */
+    long long outputWindow; /* Output data frontend can accept, mux only */
+    ScreenThrottle *screen; /* Screen model of --screen mode or nullptr */
+    ResizeDebouncer *resizer;
+    SessionKeeper *session;
+    bool statsRequested;    /* Frontend waits for counters, mux only */
+    bool recorderRequested; /* Frontend waits for path of recorder dump, mux only */
+};
+
+/* Counters of relay loop not kept by its helpers */
+struct RelayStats
+{
+    uint64_t startTime;
+    unsigned long long bytesIn;
+    unsigned long inputReads;
+    unsigned long pollWakeups;
+};
+
+/* Queue relay counters in control channel, return false if socket is broken */
+static bool send_stats(OutputCoalescer &coalescer, const struct RelayStats *stats,
+    const ResizeDebouncer &resizer, const TrafficClassifier &classifier)
+{
+    const struct { uint8_t id; uint64_t value; } counters[] = {
+        { STAT_UPTIME_USEC, StartupTrace::now() - stats->startTime },
+        { STAT_BYTES_IN, stats->bytesIn },
+        { STAT_BYTES_OUT, coalescer.bytesOut() },
+        { STAT_INPUT_READS, stats->inputReads },
+        { STAT_PTY_READS, coalescer.ptyReads() },
+        { STAT_SOCKET_SENDS, coalescer.sockSends() },
+        { STAT_POLL_WAKEUPS, stats->pollWakeups },
+        { STAT_SEND_USEC, coalescer.sendUsec() },
+        { STAT_RESIZES, resizer.applied() },
+        { STAT_MODE_SWITCHES, classifier.switches() },
+        { STAT_BULK_USEC, classifier.bulkUsec() },
+    };
+
+    char frame[FRAME_HEADER_LEN + ARRAYSIZE(counters) * FRAME_STAT_LEN];
+    size_t len = FRAME_HEADER_LEN;
+    for (size_t i = 0; i < ARRAYSIZE(counters); i++)
+        len += frame_encode_stat(frame + len, counters[i].id, counters[i].value);
+    frame_encode_header(frame, FRAME_STATS, len - FRAME_HEADER_LEN, CHANNEL_CONTROL);
+
+    return coalescer.write(frame, len);
+}
+
+/* Dump flight recorder and queue its path in control channel, empty if it is off */
+static bool send_recorder(OutputCoalescer &coalescer)
+{
+    char dumpPath[RECORDER_DUMP_PATH_MAX];
+    g_recorder.mark(RECORD_DUMP, g_recorder.dumps() + 1);
+    const char *path = g_recorder.dump(dumpPath);
+    const size_t pathLen = path ? strlen(path) : 0;
+
+    std::string frame(FRAME_HEADER_LEN + pathLen, '\0');
+    frame_encode_header(&frame[0], FRAME_RECORDER, pathLen, CHANNEL_CONTROL);
+    if (path)
+        memcpy(&frame[FRAME_HEADER_LEN], path, pathLen);
+    return coalescer.write(frame.data(), frame.size());
+}
+
+/* Dump flight recorder for SIGUSR2, its path is known from the pid */
+static void dump_recorder(int signum)
+{
+    static char dumpPath[RECORDER_DUMP_PATH_MAX];
+    const int savedErrno = errno;
+    g_recorder.dump(dumpPath);
+    errno = savedErrno;
+}
+
+/* Terminated backend leaves no recorder file, then it dies of the signal as before */
+static void discard_recorder(int signum)
+{
+    g_recorder.discard();
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+/* Queue window size received from frontend, relay loop applies it later */
+static void resize_pty(const struct winsize *winp, void *ctx)
+{
+    const struct RelayContext *relay = (struct RelayContext *)ctx;
+    relay->resizer->request(winp);
+}
+
+/* Set window size of pty and of screen models following its output */
+static void set_pty_size(const struct RelayContext *relay, const struct winsize *winp)
+{
+    const uint64_t start = g_recorder.now();
+    const int ret = ioctl(relay->mfd, TIOCSWINSZ, winp);
+    if (ret != 0)
+        perror("ioctl(TIOCSWINSZ)");
+    g_recorder.record(RECORD_RESIZE, winp->ws_col << 16 | winp->ws_row, start);
+
+    if (relay->screen)
+        relay->screen->resize(winp);
+    relay->session->resize(winp);
+
+    g_log.write(LOG_LEVEL_DEBUG, LOG_RESIZE, { winp->ws_col, winp->ws_row });
+}
+
+/*
+ * Window left after a screen repaint was framed. A repaint is sent whole,
+ * it may be larger than the window, then the window is used up but not
+ * below zero, or pty would not be read again until frontend made up for it.
+ */
+static long long charge_window(long long window, unsigned long long framed)
+{
+    return window > (long long)framed ? window - (long long)framed : 0;
+}
+
+/* Apply pending window size to pty if resize interval is over */
+static void apply_resize(const struct RelayContext *relay)
+{
+    struct winsize winp;
+    if (relay->resizer->take(&winp))
+        set_pty_size(relay, &winp);
+}
+
+/* Handle resize, signal, control and window frames received in input socket */
+static void handle_frame(uint8_t type, uint8_t channel,
+    const char *payload, size_t len, void *ctx)
+{
+    struct RelayContext *relay = (struct RelayContext *)ctx;
+    const int mfd = relay->mfd;
+
+    /* Control channel only has stats and recorder requests now, others are dropped */
+    if (channel == CHANNEL_CONTROL && type == FRAME_STATS)
+        relay->statsRequested = true;
+    if (channel == CHANNEL_CONTROL && type == FRAME_RECORDER)
+        relay->recorderRequested = true;
+    if (channel != CHANNEL_TERMINAL)
+        return;
+
+    switch (type)
+    {
+        case FRAME_RESIZE:
+            if (len == sizeof(struct winsize))
+            {
+                struct winsize winp;
+                memcpy(&winp, payload, sizeof winp);
+                resize_pty(&winp, ctx);
+            }
+            break;
+
+        case FRAME_SIGNAL:
+            /* Send signal to foreground process group of pty */
+            if (len == 1 && ioctl(mfd, TIOCSIG, (int)payload[0]) != 0)
+                perror("ioctl(TIOCSIG)");
+            if (len == 1)
+                g_recorder.mark(RECORD_SIGNAL, payload[0]);
+            break;
+
+        case FRAME_CONTROL:
+            /* End of input behaves like EOF character typed after queued input */
+            if (len >= 1 && payload[0] == CONTROL_EOF)
+            {
+                struct termios termp;
+                if (tcgetattr(mfd, &termp) == 0 &&
+                    !relay->input->write((const char *)&termp.c_cc[VEOF], 1))
+                    perror("write(VEOF)");
+            }
+            break;
+
+        case FRAME_WINDOW:
+            if (len == 4)
+            {
+                relay->outputWindow += frame_get_u32(payload);
+                g_recorder.mark(RECORD_WINDOW, frame_get_u32(payload));
+            }
+            break;
+
+        default: /* Unknown frame types are ignored */
+            break;
+    }
+}
+
+/* Decode frames and queue their data for pty, return false if pty is broken */
+static bool queue_frames(FrameDecoder &decoder, const char *buf, size_t len,
+    struct RelayContext *relay)
+{
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        pos += decoder.decode(buf + pos, len - pos);
+
+        /* Frontend never compresses input */
+        if (decoder.iovcnt() && decoder.iovType() == FRAME_DEFLATE)
+            return false;
+        if (!relay->input->write(decoder.iov(), decoder.iovcnt()))
+            return false;
+        decoder.clearIov();
+
+        uint8_t type, channel;
+        const char *payload;
+        size_t payloadLen;
+        if (decoder.takeEvent(&type, &channel, &payload, &payloadLen))
+            handle_frame(type, channel, payload, payloadLen, relay);
+    }
+
+    return true;
+}
+
+/* Decode in-band input of old frontend, like queue_frames() */
+static bool queue_inband(InbandDecoder &decoder, const char *buf, size_t len,
+    struct RelayContext *relay)
+{
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        pos += decoder.decode(buf + pos, len - pos);
+
+        if (!relay->input->write(decoder.iov(), decoder.iovcnt()))
+            return false;
+        decoder.clearIov();
+
+        struct winsize winp;
+        if (decoder.takeWinsize(&winp))
+            resize_pty(&winp, relay);
+    }
+
+    return true;
+}
+
 static void usage(const char *prog)
 {
     printf("\nwslbridge2-backend %s : Backend for wslbridge2, should be executed by frontend.\n",
@@ -44,15 +326,76 @@ static void usage(const char *prog)
     printf("\n");
     printf("Usage: %s [options] [--] [command]...\n", prog);
     printf("Options:\n");
+    printf("  -a, --session NAME\n");
+    printf("                 Keeps pty of session NAME when connection drops,\n");
+    printf("                 next backend with NAME passes its connection to it.\n");
+    printf("                 Requires --mux.\n");
+    printf("  -b, --buffer SIZE|auto\n");
+    printf("                 Sets send and receive buffers of connection to SIZE\n");
+    printf("                 bytes, auto grows them during bulk pty output and\n");
+    printf("                 shrinks them when output is interactive.\n");
+    printf("  -A, --accept   Listens on a free port for one multiplexed connection,\n");
+    printf("                 prints the port instead of connecting to frontend.\n");
     printf("  -c, --cols N   Sets N columns for pty.\n");
+    printf("  -C, --coalesce USEC\n");
+    printf("                 Holds bulk pty output up to USEC microseconds\n");
+    printf("                 to send it in larger pieces, 0 disables (default %d).\n",
+        COALESCE_DEFAULT_USEC);
+    printf("  -D, --daemon PORT\n");
+    printf("                 Starts a session for each connection to PORT,\n");
+    printf("                 options come with connection (see %s).\n",
+        DAEMON_TOKEN_ENV);
     printf("  -e, --env VAR  Copies VAR into the WSL environment.\n");
     printf("  -e VAR=VAL     Sets VAR to VAL in the WSL environment.\n");
+    printf("  -E, --engine poll|uring|splice\n");
+    printf("                 Relays pty of --mux with poll or with io_uring, or with\n");
+    printf("                 poll and splice of output, falls back to poll if kernel or\n");
+    printf("                 options do not allow it.\n");
+    printf("  -F, --frames VERSION\n");
+    printf("                 Uses length prefixed frames in input socket.\n");
+    printf("  -g, --log FILE Writes log as binary records to FILE, or to unix socket\n");
+    printf("                 FILE, instead of text to stdout. See wslbridge2-logdump.\n");
+    printf("  -G, --log-level debug|info|warn\n");
+    printf("                 Logs events of LEVEL and above (default debug).\n");
     printf("  -h, --help     Shows this usage information.\n");
+    printf("  -I, --pool-idle SEC\n");
+    printf("                 Retires warm shells of --pool unused for SEC seconds,\n");
+    printf("                 0 keeps them (default %d).\n", POOL_IDLE_DEFAULT_SEC);
+    printf("  -k, --recorder EVENTS\n");
+    printf("                 Keeps last EVENTS relay events in a file in TMPDIR that\n");
+    printf("                 is left after a crash and copied for SIGUSR2, 0 disables\n");
+    printf("                 (default %d). See wslbridge2-timeline.\n",
+        RECORDER_DEFAULT_EVENTS);
     printf("  -l, --login    Starts a login shell.\n");
+    printf("  -L, --loopback Connects through localhost even if vsock is available,\n");
+    printf("                 e.g. to benchmark it in plain Linux.\n");
+    printf("  -M, --mux PORT Uses one connection for all channels.\n");
+    printf("  -n, --pipe     Connects command to pipes instead of pty,\n");
+    printf("                 requires --mux.\n");
+    printf("  -N, --notsent-lowat BYTES\n");
+    printf("                 Keeps at most BYTES unsent in localhost connection\n");
+    printf("                 (TCP_NOTSENT_LOWAT), less output waits before an echo.\n");
     printf("  -p, --path dir Starts in certain path.\n");
+    printf("  -P, --pool N   Keeps N shells started for next --daemon sessions.\n");
     printf("  -r, --rows N   Sets N rows for pty.\n");
+    printf("  -R, --resize MSEC\n");
+    printf("                 Applies window resizes at most once per MSEC\n");
+    printf("                 milliseconds, 0 applies them at once (default %d).\n",
+        RESIZE_DEFAULT_MSEC);
     printf("  -s, --show     Shows hidden backend window and debug output.\n");
-    printf("  -x, --xmod     Dummy mode just to start a WSL2 session.\n\n");
+    printf("  -S, --screen FPS\n");
+    printf("                 Sends screen updates at most FPS times per second\n");
+    printf("                 instead of output floods.\n");
+    printf("  -T, --trace-startup FILE\n");
+    printf("                 Writes startup phases to FILE as Chrome trace JSON.\n");
+    printf("  -u, --unix PATH\n");
+    printf("                 Uses one connection to unix socket PATH for all\n");
+    printf("                 channels instead of --mux, e.g. in WSL1.\n");
+    printf("  -x, --xmod     Dummy mode just to start a WSL2 session.\n");
+    printf("  -z, --compress LEVEL\n");
+    printf("                 Compresses bulk output with deflate LEVEL 1-9,\n");
+    printf("                 requires --mux.\n");
+    printf("\n");
 
     exit(0);
 }
@@ -71,6 +414,383 @@ struct ChildParams
     std::string cwd;
 };
 
+/* Set up environment and directory of pty child and exec its program */
+static void exec_child(struct ChildParams &childParams, bool loginMode)
+{
+    int res;
+
+    for (char *const &setting : childParams.env)
+        putenv(setting);
+
+    /* Changed directory should affect in child process */
+    if (!childParams.cwd.empty())
+    {
+        wordexp_t expanded_cwd;
+        wordexp(childParams.cwd.c_str(), &expanded_cwd, 0);
+        if (expanded_cwd.we_wordc != 1)
+        {
+            fprintf(stderr,
+                "path expansion failed, word expanded to %ld paths",
+                expanded_cwd.we_wordc);
+        }
+
+        res = chdir(expanded_cwd.we_wordv[0]);
+        wordfree(&expanded_cwd);
+        if (res != 0)
+            perror("chdir");
+    }
+
+    if (childParams.argv.empty())
+    {
+        const char *shell = "/bin/sh";
+#ifdef use_getpwuid
+        struct passwd *pw = getpwuid(getuid());
+        assert(pw != NULL);
+        if (pw->pw_shell != NULL)
+            shell = pw->pw_shell;
+#else
+        if (getenv("SHELL"))
+            shell = getenv("SHELL");
+#endif
+        childParams.argv.push_back(strdup(shell));
+    }
+
+    childParams.prog = childParams.argv[0];
+    if (loginMode)
+    {
+        std::string argv0 = childParams.argv[0];
+        const std::size_t pos = argv0.find_last_of('/');
+        if (pos != std::string::npos)
+            argv0 = argv0.substr(pos + 1);
+
+        argv0 = '-' + argv0;
+        childParams.argv[0] = strdup(argv0.c_str());
+    }
+    childParams.argv.push_back(NULL);
+
+    res = execvp(childParams.prog.c_str(), childParams.argv.data());
+    if (res != 0)
+        perror("execvp");
+
+    /*
+     * Do not use exit() because it performs clean-up
+     * related to user-mode constructs in the library.
+     * Status is the one of shell for a command not found.
+     */
+    _exit(127);
+}
+
+/* Run child with pipes instead of pty and relay them, see PipeRelay */
+static void relay_pipes(int sock, struct ChildParams &childParams,
+    bool loginMode, StartupTrace &trace)
+{
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0 ||
+        pipe2(err, O_CLOEXEC) != 0)
+        fatalPerror("pipe2");
+
+    const pid_t child = fork();
+    if (child == 0)
+    {
+        /* Forwarded signals reach the whole job, like a pty foreground group */
+        setpgid(0, 0);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        exec_child(childParams, loginMode);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    trace.end();
+    if (child < 0)
+    {
+        perror("fork");
+        return;
+    }
+
+    /* Closed reader shows up as EPIPE, child keeps default disposition */
+    signal(SIGPIPE, SIG_IGN);
+    g_log.write(LOG_LEVEL_DEBUG, LOG_PIPE_CHILD, { child, in[1], out[0], err[0] });
+
+    PipeRelay relay(sock, in[1], out[0], err[0], child);
+    if (!relay.run())
+        kill(-child, SIGHUP); /* Frontend is gone, as if pty hung up */
+
+    g_log.write(LOG_LEVEL_INFO, LOG_PIPE_STATS,
+        { relay.bytesIn(), relay.bytesOut(), relay.splices(), relay.exitStatus() });
+}
+
+/* Read setup frame of daemon session into argv, return false if it is invalid */
+static bool read_setup(int sock, const std::string &token,
+    const char *prog, std::vector<char*> &setupArgv)
+{
+    /* Connection that does not send setup in time is dropped */
+    struct timeval tv = { 5, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    char header[FRAME_HEADER_LEN];
+    if (recv(sock, header, sizeof header, MSG_WAITALL) != sizeof header ||
+        header[0] != FRAME_SETUP)
+        return false;
+
+    const size_t len = (uint8_t)header[2] | (uint8_t)header[3] << 8;
+    std::vector<char> payload(len);
+    if (len == 0 || recv(sock, payload.data(), len, MSG_WAITALL) != (ssize_t)len ||
+        payload[len - 1] != '\0')
+        return false;
+
+    if (token != payload.data())
+        return false;
+
+    setupArgv.push_back(strdup(prog));
+    for (size_t pos = token.size() + 1; pos < len; pos += strlen(&payload[pos]) + 1)
+        setupArgv.push_back(strdup(&payload[pos]));
+    setupArgv.push_back(NULL);
+
+    tv.tv_sec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    return true;
+}
+
+/* Shell of daemon session pool, started before its connection comes */
+struct WarmShell
+{
+    pid_t child;    /* 0 if session has none */
+    int mfd;
+    char ptyname[16];
+    int reportFd;   /* Hit or miss is reported to daemon, -1 if not pooled */
+};
+
+struct PoolParams
+{
+    unsigned int size;
+    unsigned int idleSec;   /* Warm shells are retired after this, 0 never */
+    struct ChildParams *shell;
+    struct winsize winp;
+};
+
+/* Options deciding what runs in pty, warm shell is used if they match */
+static std::string shell_key(const struct ChildParams &params, bool loginMode)
+{
+    std::string key(1, loginMode ? 'l' : '-');
+    key.append(params.cwd);
+    for (const char *setting : params.env)
+        key.append(1, '\0').append(setting);
+
+    key.append(1, '\0');
+    for (const char *arg : params.argv)
+        key.append(1, '\0').append(arg);
+
+    return key;
+}
+
+static void discard_warm(struct WarmShell *warm)
+{
+    kill(warm->child, SIGKILL);
+    close(warm->mfd);
+    waitpid(warm->child, NULL, 0);
+    warm->child = 0;
+}
+
+/*
+ * Pool member: start shell in a pty and take the next connection, so the
+ * shell has already started when the terminal connects. Member retires
+ * when nobody connects in idle time. Only returns with a connection.
+ */
+static int wait_warm(int listenSock, bool vmMode, const std::string &token,
+    const char *prog, std::vector<char*> &setupArgv,
+    struct PoolParams &pool, bool loginMode, struct WarmShell *warm)
+{
+    warm->child = forkpty(&warm->mfd, warm->ptyname, NULL, &pool.winp);
+    if (warm->child == 0)
+        exec_child(*pool.shell, loginMode);
+
+    int sock = -1;
+    if (warm->child > 0)
+        sock = vmMode ? nix_vsock_accept(listenSock) : nix_local_accept(listenSock);
+    else
+        perror("forkpty");
+
+    if (sock < 0 || !read_setup(sock, token, prog, setupArgv))
+    {
+        /* Nobody connected in time, or connection was bad */
+        const char event = sock < 0 ? 'i' : 'x';
+        if (write(warm->reportFd, &event, 1) != 1)
+            perror("write");
+        if (warm->child > 0)
+            discard_warm(warm);
+        _exit(1);
+    }
+
+    prctl(PR_SET_PDEATHSIG, 0);
+    close(listenSock);
+    return sock;
+}
+
+/*
+ * Listen on port and fork a session for each connection, so a new terminal
+ * does not launch wsl.exe. With a pool, members wait with a warm shell and
+ * accept connections themselves, daemon only accepts when pool is empty.
+ * Only returns in the forked process, with the connected socket and the
+ * backend options of that session.
+ */
+static int serve_sessions(unsigned int port, bool vmMode,
+    const char *prog, std::vector<char*> &setupArgv,
+    struct PoolParams &pool, bool loginMode, struct WarmShell *warm)
+{
+    const char *env = getenv(DAEMON_TOKEN_ENV);
+    const std::string token = env ? env : "";
+    if (token.empty())
+        fatal("daemon requires a token in %s\n", DAEMON_TOKEN_ENV);
+
+    /* Sessions must not see the token */
+    unsetenv(DAEMON_TOKEN_ENV);
+
+    const int listenSock = vmMode ? nix_vsock_listen(&port) : nix_local_listen(port);
+    printf("daemon port: %u pool: %u\n", port, pool.size);
+    fflush(stdout);
+
+    /* Members waiting in accept() retire after idle time */
+    if (pool.idleSec)
+    {
+        struct timeval tv = { (time_t)pool.idleSec, 0 };
+        setsockopt(listenSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    }
+
+    if (pool.winp.ws_col == 0 || pool.winp.ws_row == 0)
+    {
+        pool.winp.ws_col = 80;
+        pool.winp.ws_row = 24;
+    }
+
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) != 0)
+        fatalPerror("pipe2");
+
+    /* Finished sessions are reaped by kernel */
+    signal(SIGCHLD, SIG_IGN);
+
+    unsigned int idle = 0;
+    bool hold = false; /* Pool is not refilled after retirement until used */
+    unsigned long hits = 0, misses = 0, retired = 0;
+    const auto print_pool = [&]()
+    {
+        printf("pool hits: %lu misses: %lu retired: %lu\n", hits, misses, retired);
+        fflush(stdout);
+    };
+
+    while (1)
+    {
+        while (!hold && idle < pool.size)
+        {
+            const pid_t pid = fork();
+            if (pid == 0)
+            {
+                /* Idle member goes away with daemon, session does not */
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                signal(SIGCHLD, SIG_DFL);
+                close(report[0]);
+                warm->reportFd = report[1];
+                return wait_warm(listenSock, vmMode, token, prog, setupArgv,
+                                 pool, loginMode, warm);
+            }
+            else if (pid < 0)
+            {
+                perror("fork");
+                break;
+            }
+
+            idle++;
+        }
+
+        struct pollfd fds[] = {
+                { report[0], POLLIN, 0 },
+                { idle ? -1 : listenSock, POLLIN, 0 }
+            };
+        if (poll(fds, ARRAYSIZE(fds), -1) < 0)
+            continue;
+
+        char event;
+        if ((fds[0].revents & POLLIN) && read(report[0], &event, 1) == 1)
+        {
+            idle--;
+            if (event == 'h')
+                hits++;
+            else if (event == 'm')
+                misses++;
+            else if (event == 'i')
+                retired++;
+            hold = event == 'i';
+            print_pool();
+        }
+
+        if (!(fds[1].revents & POLLIN))
+            continue;
+
+        const int sock = vmMode ? nix_vsock_accept(listenSock) : nix_local_accept(listenSock);
+        if (sock < 0)
+            continue;
+
+        /* Pool is empty, connection gets a new shell */
+        if (pool.size)
+        {
+            misses++;
+            hold = false;
+            print_pool();
+        }
+
+        const pid_t pid = fork();
+        if (pid == 0)
+        {
+            signal(SIGCHLD, SIG_DFL);
+            close(listenSock);
+            close(report[0]);
+            close(report[1]);
+            if (!read_setup(sock, token, prog, setupArgv))
+                _exit(1);
+            return sock;
+        }
+        else if (pid < 0)
+            perror("fork");
+
+        close(sock);
+    }
+}
+
+/*
+ * Listen on a port chosen by kernel and report it in stdout, frontend
+ * connects to it. No port is guessed, so binding never fails or retries.
+ */
+static int accept_frontend(bool vmMode, unsigned int *port)
+{
+    *port = 0;
+    const int listenSock = vmMode ? nix_vsock_listen(port) : nix_local_listen(0);
+    if (!vmMode)
+    {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof addr;
+        if (getsockname(listenSock, (struct sockaddr *)&addr, &addrlen) != 0)
+            fatalPerror("getsockname");
+        *port = ntohs(addr.sin_port);
+    }
+
+    struct timeval tv = { ACCEPT_TIMEOUT_SEC, 0 };
+    setsockopt(listenSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+    /* Frontend waits for this line, stdout is a pipe */
+    printf(ACCEPT_PORT_LINE "%u\n", *port);
+    fflush(stdout);
+
+    const int sock = vmMode ? nix_vsock_accept(listenSock) : nix_local_accept(listenSock);
+    if (sock < 0)
+        fatal("error: frontend did not connect to port %u\n", *port);
+
+    close(listenSock);
+    return sock;
+}
+
 /* Structure only to hold socket file descriptors. */
 union IoSockets
 {
@@ -87,207 +807,573 @@ union IoSockets
 /* Global variable. */
 static volatile union IoSockets ioSockets = { 0 };
 
+/*
+ * Pty output is sent, exit status of child follows as the last frame of
+ * multiplexed connection, then sockets are shut down. A child that closed
+ * its pty but runs on has no exit status to send.
+ */
+static void end_session(OutputCoalescer &coalescer, ChildWatcher &watcher, bool muxMode)
+{
+    if (muxMode && watcher.wait(CHILD_EXIT_WAIT_MSEC))
+    {
+        char frame[FRAME_HEADER_LEN + 4];
+        if (coalescer.write(frame, frame_encode_exit(frame, watcher.exitStatus())))
+            coalescer.drain(true);
+    }
+
+    for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
+        shutdown(ioSockets.sock[i], SHUT_RDWR);
+}
+
 int main(int argc, char *argv[])
 {
+    uint64_t mainTime = StartupTrace::now();
+
     if (argc < 2)
         try_help(argv[0]);
 
     int ret;
-    struct winsize winp;
+    struct winsize winp = {};
     struct ChildParams childParams;
     volatile bool debugMode = false, loginMode = false, xtraMode = false;
+    bool loopbackMode = false, acceptMode = false, pipeMode = false;
+    bool bufferAuto = false, uringEngine = false, spliceEngine = false;
+    unsigned int bufferSize = 0, notsentLowat = 0;
     unsigned int inputPort = 0, outputPort = 0, controlPort = 0;
+    unsigned int coalesceUsec = COALESCE_DEFAULT_USEC;
+    int frameVersion = 0;
+    unsigned int muxPort = 0;
+    const char *unixPath = nullptr;
+    int compressLevel = 0;
+    unsigned int screenFps = 0;
+    unsigned int resizeMsec = RESIZE_DEFAULT_MSEC;
+    unsigned int daemonPort = 0;
+    int sessionSock = -1;
+    const char *sessionName = nullptr;
+    std::vector<char*> setupArgv;
+    struct PoolParams pool = { 0, POOL_IDLE_DEFAULT_SEC, nullptr, {} };
+    struct WarmShell warm = { 0, -1, "", -1 };
+    std::string daemonShell;
+    StartupTrace trace("wslbridge2-backend");
+    const char *tracePath = nullptr;
+    const char *logPath = nullptr;
+    int logLevel = LOG_LEVEL_DEBUG;
+    unsigned int recorderEvents = RECORDER_DEFAULT_EVENTS;
 
-    const char shortopts[] = "+0:1:3:c:e:hlp:r:sx";
+    const char shortopts[] = "+0:1:3:a:Ab:c:C:D:e:E:F:g:G:hI:k:lLM:nN:p:P:r:R:sS:T:u:xz:";
     const struct option longopts[] = {
+        { "accept", no_argument,      0, 'A' },
+        { "buffer", required_argument, 0, 'b' },
         { "cols",  required_argument, 0, 'c' },
+        { "coalesce", required_argument, 0, 'C' },
+        { "compress", required_argument, 0, 'z' },
+        { "daemon", required_argument, 0, 'D' },
+        { "engine", required_argument, 0, 'E' },
         { "env",   required_argument, 0, 'e' },
+        { "frames", required_argument, 0, 'F' },
         { "help",  no_argument,       0, 'h' },
+        { "log",   required_argument, 0, 'g' },
+        { "log-level", required_argument, 0, 'G' },
         { "login", no_argument,       0, 'l' },
+        { "loopback", no_argument,    0, 'L' },
+        { "mux",   required_argument, 0, 'M' },
         { "path",  required_argument, 0, 'p' },
+        { "notsent-lowat", required_argument, 0, 'N' },
+        { "pipe",  no_argument,       0, 'n' },
+        { "pool",  required_argument, 0, 'P' },
+        { "pool-idle", required_argument, 0, 'I' },
+        { "resize", required_argument, 0, 'R' },
+        { "recorder", required_argument, 0, 'k' },
         { "rows",  required_argument, 0, 'r' },
         { "show",  no_argument,       0, 's' },
+        { "screen", required_argument, 0, 'S' },
+        { "session", required_argument, 0, 'a' },
+        { "trace-startup", required_argument, 0, 'T' },
+        { "unix",  required_argument, 0, 'u' },
         { "xmod",  no_argument,       0, 'x' },
         { 0,       no_argument,       0,  0  },
     };
 
     int ch = 0;
-    while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+    while (1)
     {
-        switch (ch)
+        while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
         {
-            case '0': inputPort = atoi(optarg); break;
-            case '1': outputPort = atoi(optarg); break;
-            case '3': controlPort = atoi(optarg); break;
-            case 'c': winp.ws_col = atoi(optarg); break;
-            case 'e': childParams.env.push_back(strdup(optarg)); break;
-            case 'h': usage(argv[0]); break;
-            case 'l': loginMode = true; break;
-            case 'p': childParams.cwd = optarg; break;
-            case 'r': winp.ws_row = atoi(optarg); break;
-            case 's': debugMode = true; break;
-            case 'x': xtraMode = true; break;
-            default: try_help(argv[0]); break;
+            switch (ch)
+            {
+                case '0': inputPort = atoi(optarg); break;
+                case '1': outputPort = atoi(optarg); break;
+                case '3': controlPort = atoi(optarg); break;
+                case 'a': sessionName = optarg; break;
+                case 'A': acceptMode = true; break;
+                case 'b':
+                    bufferAuto = strcmp(optarg, "auto") == 0;
+                    bufferSize = bufferAuto ? 0 : atoi(optarg);
+                    break;
+                case 'c': winp.ws_col = atoi(optarg); break;
+                case 'C': coalesceUsec = atoi(optarg); break;
+                case 'D': daemonPort = atoi(optarg); break;
+                case 'e': childParams.env.push_back(strdup(optarg)); break;
+                case 'E':
+                    uringEngine = strcmp(optarg, "uring") == 0;
+                    spliceEngine = strcmp(optarg, "splice") == 0;
+                    if (!uringEngine && !spliceEngine && strcmp(optarg, "poll") != 0)
+                        fatal("unsupported engine: %s\n", optarg);
+                    break;
+                case 'F': frameVersion = atoi(optarg); break;
+                case 'g': logPath = optarg; break;
+                case 'G':
+                    logLevel = log_level(optarg);
+                    if (logLevel < 0)
+                        fatal("unsupported log level: %s\n", optarg);
+                    break;
+                case 'h': usage(argv[0]); break;
+                case 'I': pool.idleSec = atoi(optarg); break;
+                case 'k': recorderEvents = atoi(optarg); break;
+                case 'l': loginMode = true; break;
+                case 'L': loopbackMode = true; break;
+                case 'M': muxPort = atoi(optarg); break;
+                case 'n': pipeMode = true; break;
+                case 'N': notsentLowat = atoi(optarg); break;
+                case 'p': childParams.cwd = optarg; break;
+                case 'P': pool.size = atoi(optarg); break;
+                case 'r': winp.ws_row = atoi(optarg); break;
+                case 'R': resizeMsec = atoi(optarg); break;
+                case 's': debugMode = true; break;
+                case 'S': screenFps = atoi(optarg); break;
+                case 'T': tracePath = optarg; break;
+                case 'u': unixPath = optarg; break;
+                case 'x': xtraMode = true; break;
+                case 'z': compressLevel = atoi(optarg); break;
+                default: try_help(argv[0]); break;
+            }
         }
+
+        /* Daemon tunes connections it accepts, session those it makes */
+        nix_sock_tune(bufferSize, notsentLowat);
+
+        for (int i = optind; i < argc; ++i)
+            childParams.argv.push_back(argv[i]);
+
+        if (!daemonPort || sessionSock >= 0)
+            break;
+
+        /* Warm shells run what daemon itself is told to run */
+        pool.shell = &childParams;
+        pool.winp = winp;
+
+        /* Session is started with options received in its connection */
+        sessionSock = serve_sessions(daemonPort, !loopbackMode && IsVmMode(),
+                                     argv[0], setupArgv, pool, loginMode, &warm);
+        daemonShell = shell_key(childParams, loginMode);
+        childParams = ChildParams();
+        loginMode = false;
+        mainTime = StartupTrace::now();
+        argc = setupArgv.size() - 1;
+        argv = setupArgv.data();
+        optind = 0;
+    }
+
+    /* Daemon session is a multiplexed connection */
+    if (sessionSock >= 0)
+        muxPort = daemonPort;
+
+    if (tracePath)
+    {
+        trace.enable(tracePath);
+        if (sessionSock < 0)
+            trace.span("exec", process_start_time());
+        trace.span(sessionSock < 0 ? "options" : "setup", mainTime);
+    }
+
+    /* Warm shell of pool is used if session runs the same program */
+    if (warm.reportFd >= 0)
+    {
+        if (warm.child > 0 && waitpid(warm.child, NULL, WNOHANG) != 0)
+            warm.child = 0; /* It exited while waiting */
+
+        if (warm.child > 0 && (pipeMode || sessionName ||
+                              shell_key(childParams, loginMode) != daemonShell))
+            discard_warm(&warm);
+
+        if (write(warm.reportFd, warm.child > 0 ? "h" : "m", 1) != 1)
+            perror("write");
+        close(warm.reportFd);
     }
 
     if (xtraMode)
         return 0;
 
-    /* If size not provided use master window size */
-    if (winp.ws_col == 0 || winp.ws_row == 0)
+    /* Daemon prints its own lines, only its sessions get here and flush a log */
+    g_log.setLevel(logLevel);
+    if (!g_log.start(logPath))
+        perror(logPath ? logPath : "log");
+
+    if (frameVersion < 0 || frameVersion > FRAME_VERSION)
+        fatal("unsupported frame version: %d\n", frameVersion);
+
+    /* Port of --accept is known later, it is always multiplexed */
+    const bool willMux = muxPort || unixPath || acceptMode || sessionSock >= 0;
+    if (compressLevel < 0 || compressLevel > 9 || (compressLevel && !willMux))
+        fatal("unsupported compression level: %d\n", compressLevel);
+
+    if (pipeMode && !willMux)
+        fatal("pipe mode requires --mux\n");
+
+    if (sessionName && (!willMux || pipeMode || strlen(sessionName) > SESSION_NAME_MAX))
+        fatal("session requires --mux, a pty and a name of %d characters at most\n",
+            SESSION_NAME_MAX);
+
+    /* Deflate stream can not continue in the connection of next frontend */
+    if (sessionName && compressLevel)
+    {
+        g_log.write(LOG_LEVEL_WARN, LOG_COMPRESS_OFF);
+        compressLevel = 0;
+    }
+
+    /* If size not provided use master window size, pipes have none */
+    if (!pipeMode && (winp.ws_col == 0 || winp.ws_row == 0))
     {
         ret = ioctl(STDIN_FILENO, TIOCGWINSZ, &winp);
         assert(ret == 0);
     }
 
-    const bool vmMode = IsVmMode();
-    if (vmMode) /* WSL2 */
+    if (acceptMode && unixPath)
+        fatal("accept mode listens on a port, it is not used with --unix\n");
+
+    const bool vmMode = !loopbackMode && IsVmMode();
+    if (acceptMode && sessionSock < 0)
+    {
+        trace.phase("accept");
+        sessionSock = accept_frontend(vmMode, &muxPort);
+    }
+
+    const bool muxMode = muxPort || unixPath || sessionSock >= 0;
+    if (muxMode) /* All channels in one connection */
     {
+        trace.phase("connect");
+        const int sock = sessionSock >= 0 ? sessionSock :
+                         unixPath ? nix_unix_connect(unixPath) :
+                         vmMode ? nix_vsock_connect(muxPort) : nix_local_connect(muxPort);
+        ioSockets.inputSock = sock;
+        ioSockets.outputSock = dup(sock);
+        ioSockets.controlSock = dup(sock);
+        frameVersion = FRAME_VERSION;
+    }
+    else if (vmMode) /* WSL2 */
+    {
+        trace.phase("connect input");
         ioSockets.inputSock = nix_vsock_connect(inputPort);
+        trace.phase("connect output");
         ioSockets.outputSock = nix_vsock_connect(outputPort);
+        trace.phase("connect control");
         ioSockets.controlSock = nix_vsock_connect(controlPort);
     }
     else /* WSL1 */
     {
+        trace.phase("connect input");
         ioSockets.inputSock = nix_local_connect(inputPort);
+        trace.phase("connect output");
         ioSockets.outputSock = nix_local_connect(outputPort);
+        trace.phase("connect control");
         ioSockets.controlSock = nix_local_connect(controlPort);
     }
 
-    printf("cols: %d rows: %d in: %d out: %d con: %d\n",
-        winp.ws_col, winp.ws_row, inputPort, outputPort, controlPort);
+    g_log.write(LOG_LEVEL_DEBUG, LOG_CONNECTED,
+        { winp.ws_col, winp.ws_row, inputPort, outputPort, controlPort, muxPort });
+
+    /* Running session of this name takes the connection and sends its screen */
+    if (sessionName && SessionKeeper::handover(sessionName, ioSockets.inputSock, &winp))
+    {
+        g_log.write(LOG_LEVEL_INFO, LOG_SESSION_TOOK, sessionName);
+
+        /* Launcher of frontend stays as long as the session serves it */
+        struct pollfd pfd = { ioSockets.inputSock, 0, 0 };
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            ;
+
+        for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
+            close(ioSockets.sock[i]);
+        return 0;
+    }
+
+    if (pipeMode)
+    {
+        trace.phase("fork");
+        relay_pipes(ioSockets.inputSock, childParams, loginMode, trace);
+        for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
+            close(ioSockets.sock[i]);
+        return 0;
+    }
 
     int mfd;
     char ptyname[16];
-    const pid_t child = forkpty(&mfd, ptyname, NULL, &winp);
+    pid_t child;
+    trace.phase("forkpty");
+    if (warm.child > 0) /* Shell is already running in pty */
+    {
+        child = warm.child;
+        mfd = warm.mfd;
+        memcpy(ptyname, warm.ptyname, sizeof ptyname);
+        if (ioctl(mfd, TIOCSWINSZ, &winp) != 0)
+            perror("ioctl(TIOCSWINSZ)");
+    }
+    else
+        child = forkpty(&mfd, ptyname, NULL, &winp);
+
+    if (child > 0)
+        trace.phase("first output");
 
     if (child > 0) /* parent or master */
     {
         /*
-         * wslbridge2#23: Wait for any child process changed state.
-         * i.e. prevent zombies. Register sigaction after forkpty (musl).
+         * wslbridge2#23: Reap child to prevent zombies. Its exit is an event
+         * of relay loop, which sends what is left in pty before closing.
          */
-        struct sigaction act = { 0 };
-        act.sa_flags = SA_SIGINFO;
-        act.sa_sigaction = [](int signum, siginfo_t *info, void *ucontext)
-        {
-            for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
-                shutdown(ioSockets.sock[i], SHUT_RDWR);
+        ChildWatcher watcher(child);
+        if (!watcher.start())
+            perror("pidfd_open and signalfd");
 
-            int status;
-            wait(&status);
+        g_log.write(LOG_LEVEL_DEBUG, LOG_PTY_CHILD, { mfd, child }, ptyname);
 
-            char str[100];
-            int ret = sprintf(str, "signal: %d child status: %d child pid: %d\n",
-                        signum, status, info->si_pid);
-            ret = write(STDOUT_FILENO, str, ret);
-        };
-        sigaction(SIGCHLD, &act, NULL);
+        /* Last relay events are kept for a stall report or a crash, see FlightRecorder */
+        if (!g_recorder.start(recorderEvents, child))
+            perror(g_recorder.path());
+        else if (g_recorder.enabled())
+        {
+            g_log.write(LOG_LEVEL_DEBUG, LOG_RECORDER, { g_recorder.capacity() },
+                g_recorder.path());
 
-        printf("master fd: %d child pid: %d pty name: %s\n",
-            mfd, child, ptyname);
+            /* Signals that are ignored, e.g. with nohup, stay ignored */
+            for (int signum : { SIGTERM, SIGHUP })
+            {
+                struct sigaction act;
+                if (sigaction(signum, NULL, &act) == 0 && act.sa_handler != SIG_IGN)
+                    signal(signum, discard_recorder);
+            }
+        }
+        signal(SIGUSR2, dump_recorder);
 
         /* Use dupped master fd to read OR write */
         const int mfd_dp = dup(mfd);
         assert(mfd_dp > 0);
 
+        /* Named session outlives its connection, see SessionKeeper */
+        SessionKeeper session(sessionName, &winp);
+        if (sessionName)
+        {
+            if (!session.listen())
+                g_log.write(LOG_LEVEL_WARN, LOG_SESSION_KEPT, sessionName);
+            else /* Launcher of backend may go away with frontend */
+                signal(SIGHUP, SIG_IGN);
+        }
+
+        /* Control requests come in as frames in multiplexed connection */
         struct pollfd fds[] = {
                 { ioSockets.inputSock, POLLIN, 0 },
-                { ioSockets.controlSock, POLLIN, 0 },
-                { mfd, POLLIN, 0 }
+                { muxMode ? -1 : ioSockets.controlSock, POLLIN, 0 },
+                { mfd, POLLIN, 0 },
+                { session.fd(), POLLIN, 0 },
+                { -1, POLLOUT, 0 },     /* Output socket while output is queued */
+                { -1, POLLOUT, 0 },     /* Pty while input is queued */
+                { watcher.fd(), POLLIN, 0 },
             };
 
-        ssize_t readRet = 0, writeRet = 0;
-        char data[1024]; /* Buffer to hold raw data from pty */
+        ssize_t readRet = 0, writeRet = 1;
+        char data[1024]; /* Buffer to hold raw data from input socket */
         assert(sizeof data <= PIPE_BUF);
 
-        do
+        InbandDecoder inbandDecoder;
+        FrameDecoder frameDecoder;
+        InputQueue input(mfd_dp);
+        OutputCoalescer coalescer(ioSockets.outputSock, coalesceUsec, muxMode);
+        OutputCompressor compressor(ioSockets.outputSock);
+        BufferTuner tuner(ioSockets.outputSock, bufferAuto);
+        TrafficClassifier classifier(ioSockets.outputSock);
+        coalescer.setClassifier(&classifier);
+        if (compressLevel)
         {
-            ret = poll(fds, ARRAYSIZE(fds), -1);
-            assert(ret > 0);
+            if (!compressor.start(compressLevel))
+                fatal("deflateInit2 failed\n");
+            coalescer.setCompressor(&compressor);
+        }
+        ScreenThrottle screen(screenFps, &winp);
+        ResizeDebouncer resizer(resizeMsec);
+        struct RelayContext relay = { mfd, &input, FRAME_WINDOW_INITIAL,
+                                      screenFps ? &screen : nullptr, &resizer,
+                                      &session, false, false };
+        struct RelayStats stats = { StartupTrace::now(), 0, 0, 0 };
+        std::string screenUpdate;
+        unsigned long long inputGranted = 0;
+        struct timespec timeout, screenTimeout, resizeTimeout, classifyTimeout, sessionTimeout;
+        struct timespec drainTimeout = { 0, 0 };
+        bool firstOutput = false, inputOpen = true, childExited = watcher.exited();
+
+        /* Ring engine relays the whole session, poll loop is its fallback */
+        UringRelay ring(ioSockets.inputSock, ioSockets.outputSock, mfd, mfd_dp, input, resizer,
+                        watcher);
+        if (uringEngine && (!muxMode || compressLevel || screenFps || sessionName || bufferAuto))
+        {
+            g_log.write(LOG_LEVEL_WARN, LOG_URING_UNSUPPORTED);
+            uringEngine = false;
+        }
+        else if (uringEngine && !ring.setup())
+        {
+            g_log.write(LOG_LEVEL_WARN, LOG_URING_UNAVAILABLE);
+            uringEngine = false;
+        }
 
-            /* Receive input buffer and write it to master */
+        /* Splice path only moves pty output, nothing may read it on the way */
+        if (spliceEngine && (compressLevel || screenFps || sessionName))
+        {
+            g_log.write(LOG_LEVEL_WARN, LOG_SPLICE_UNSUPPORTED);
+            spliceEngine = false;
+        }
+        else if (spliceEngine && !coalescer.enableSplice())
+        {
+            g_log.write(LOG_LEVEL_WARN, LOG_SPLICE_UNAVAILABLE);
+            spliceEngine = false;
+        }
+        else if (spliceEngine)
+            g_log.write(LOG_LEVEL_INFO, LOG_ENGINE, "splice");
+
+        if (uringEngine)
+        {
+            g_log.write(LOG_LEVEL_INFO, LOG_ENGINE, "uring");
+
+            /* Closed reader shows up as EPIPE in completion */
+            signal(SIGPIPE, SIG_IGN);
+
+            /* Shutdown I/O sockets when child process terminates */
+            if (ring.run(trace))
+                end_session(coalescer, watcher, muxMode);
+            writeRet = 0;
+        }
+
+        while (writeRet > 0)
+        {
+            /*
+             * Stop reading pty when staging or queue is full or frontend is not reading.
+             * Output of a detached session is dropped, nobody grants window for it.
+             */
+            const bool canSend = !muxMode || !session.attached() ||
+                                 relay.outputWindow >= (long long)coalescer.length();
+            fds[2].fd = coalescer.full() || coalescer.blocked() || !canSend ? -1 : mfd;
+
+            /* Stop reading input while pty does not take queued input */
+            fds[0].fd = inputOpen && !input.full() ? ioSockets.inputSock : -1;
+            fds[4].fd = coalescer.queued() ? ioSockets.outputSock : -1;
+            fds[5].fd = input.empty() ? -1 : mfd_dp;
+
+            /* Session waits for a new connection or for the message of a handover */
+            fds[3].fd = session.fd();
+
+            struct timespec *wait = canSend ? coalescer.timeout(&timeout) : NULL;
+
+            /* Child exited, pty is read until it has nothing more */
+            if (childExited && fds[2].fd >= 0)
+                wait = &drainTimeout;
+            if (screenFps)
+                wait = screen.timeout(&screenTimeout, wait);
+            wait = resizer.timeout(&resizeTimeout, wait);
+            wait = session.timeout(&sessionTimeout, wait);
+            if (fds[2].fd >= 0)
+                wait = classifier.timeout(&classifyTimeout, wait);
+
+            const int waitFlags = (fds[4].fd >= 0 ? RECORD_WAIT_SOCKET : 0) |
+                                  (canSend ? 0 : RECORD_WAIT_WINDOW) |
+                                  (fds[5].fd >= 0 ? RECORD_WAIT_PTY : 0);
+            const uint64_t waitStart = g_recorder.begin(RECORD_WAIT, waitFlags);
+            ret = ppoll(fds, ARRAYSIZE(fds), wait, NULL);
+            g_recorder.finish(RECORD_WAIT, (ret > 0 ? ret : 0) | waitFlags, waitStart);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            assert(ret >= 0);
+            stats.pollWakeups++;
+
+            if (fds[6].revents && watcher.reap())
+            {
+                childExited = true;
+                fds[6].fd = -1;
+                g_recorder.mark(RECORD_CHILD_EXIT, watcher.exitStatus());
+            }
+
+            /* Queued output and input move first, they are older than new data */
+            if (fds[4].revents)
+            {
+                const size_t queued = coalescer.queueLength();
+                const uint64_t start = g_recorder.now();
+                if (!coalescer.drain())
+                    writeRet = -1;
+                g_recorder.record(RECORD_DRAIN, queued - coalescer.queueLength(), start);
+            }
+            if (fds[5].revents)
+            {
+                const unsigned long long written = input.written();
+                const uint64_t start = g_recorder.now();
+                if (!input.flush())
+                    writeRet = -1;
+                g_recorder.record(RECORD_PTY_WRITE, input.written() - written, start);
+            }
+
+            /* Receive input buffer, decode it and queue it for master */
             if (fds[0].revents & POLLIN)
             {
+                uint64_t start = g_recorder.now();
                 readRet = recv(ioSockets.inputSock, data, sizeof data, 0);
-                char * s = data;
-                int len = readRet;
-                writeRet = 1;
-                while (writeRet > 0 && len > 0)
+                g_recorder.record(RECORD_INPUT_READ, readRet < 0 ? -errno : readRet, start);
+                stats.inputReads++;
+                if (readRet > 0)
+                    stats.bytesIn += readRet;
+                const unsigned long long typedBefore = frameDecoder.dataBytes();
+                const unsigned long long written = input.written();
+                start = g_recorder.now();
+
+                if (readRet == 0 && !session.listening())
+                    inputOpen = false; /* Frontend closed input, keep output going */
+                else if (readRet <= 0)
+                    writeRet = -1;
+                else if (frameVersion)
                 {
-                    if (!*s)
-                    {
-                        // dispatch NUL escaped inband information
-                        s++;
-                        len--;
-
-                        if (len < 9 && s + 9 >= data + sizeof data)
-                        {
-                            // make room for additional loading
-                            memcpy(data, s, len);
-                            s = data;
-                        }
-
-                        // ensure 1 more byte is loaded to dispatch on
-                        if (!len)
-                        {
-                            readRet = recv(ioSockets.inputSock, s, 1, 0);
-                            if (readRet > 0)
-                            {
-                                len += readRet;
-                            }
-                            else
-                            {
-                                writeRet = -1;
-                                break;
-                            }
-                        }
-                        if (*s == 2)
-                        {
-                            // STX: escaped NUL
-                            s++;
-                            len--;
-                            writeRet = write(mfd_dp, "", 1);
-                        }
-                        else if (*s == 16)
-                        {
-                            // DLE: terminal window size change
-                            s++;
-                            len--;
-                            // ensure 8 more bytes are loaded for winsize
-                            while (readRet > 0 && len < 8)
-                            {
-                                readRet = recv(ioSockets.inputSock, s + len, 8 - len, 0);
-                                if (readRet > 0)
-                                {
-                                    len += readRet;
-                                }
-                            }
-                            if (readRet <= 0)
-                            {
-                                writeRet = -1;
-                                break;
-                            }
-                            struct winsize * winsp = (struct winsize *)s;
-                            s += 8;
-                            len -= 8;
-                            ret = ioctl(mfd, TIOCSWINSZ, winsp);
-                            if (ret != 0)
-                                perror("ioctl(TIOCSWINSZ)");
-                        }
-                    }
-                    else
-                    {
-                        int n = strnlen(s, len);
-                        writeRet = write(mfd_dp, s, n);
-                        if (writeRet > 0)
-                        {
-                            s += writeRet;
-                            len -= writeRet;
-                        }
-                    }
+                    if (!queue_frames(frameDecoder, data, readRet, &relay))
+                        writeRet = -1;
                 }
+                else if (!queue_inband(inbandDecoder, data, readRet, &relay))
+                    writeRet = -1;
+
+                /* Decoded input is written to pty at once if it has room */
+                if (readRet > 0)
+                    g_recorder.record(RECORD_PTY_WRITE, input.written() - written, start);
+
+                /* Keystrokes make next small output an echo, window grants do not */
+                if (readRet > 0 && (!frameVersion || frameDecoder.dataBytes() != typedBefore))
+                    classifier.input();
+            }
+
+            /* Let frontend send more input when half window is written to pty */
+            const unsigned long long consumed = input.written() - inputGranted;
+            if (muxMode && consumed >= FRAME_WINDOW_INITIAL / 2)
+            {
+                char frame[FRAME_HEADER_LEN + 4];
+                if (!coalescer.write(frame, frame_encode_window(frame, consumed)))
+                    writeRet = -1;
+                inputGranted += consumed;
+            }
+
+            /* Staged output may stay, worker of compressor may not be sending */
+            if (relay.statsRequested)
+            {
+                relay.statsRequested = false;
+                if ((compressLevel && !compressor.drain()) ||
+                    !send_stats(coalescer, &stats, resizer, classifier))
+                    writeRet = -1;
+            }
+
+            if (relay.recorderRequested)
+            {
+                relay.recorderRequested = false;
+                if ((compressLevel && !compressor.drain()) || !send_recorder(coalescer))
+                    writeRet = -1;
             }
 
             /* Resize window when buffer received in control socket */
@@ -297,101 +1383,200 @@ int main(int argc, char *argv[])
                 assert(ret > 0);
 
                 /* Remove "unused" pixel values ioctl_tty(2) */
-                ret = ioctl(mfd, TIOCSWINSZ, &winp);
-                if (ret != 0)
-                    perror("ioctl(TIOCSWINSZ)");
-
-                printf("cols: %d rows: %d\n", winp.ws_col, winp.ws_row);
+                resize_pty(&winp, &relay);
             }
 
-            /* Receive buffers from master and send to output socket */
-            if (fds[2].revents & POLLIN)
-            {
-                readRet = read(mfd, data, sizeof data);
-                if (readRet > 0)
-                    writeRet = send(ioSockets.outputSock, data, readRet, 0);
-            }
+            /* Window size of a resize storm settles before pty sees it */
+            apply_resize(&relay);
 
-            /* Shutdown I/O sockets when child process terminates */
-            if (fds[2].revents & (POLLERR | POLLHUP))
+            /* Frontend attached, it gets the screen before any new output */
+            struct winsize attachWinp;
+            int attachSock;
+            if ((fds[3].revents || session.expired()) &&
+                (attachSock = session.accept(&attachWinp)) >= 0)
             {
+                /* Old connection is replaced in place, helpers keep their fds */
                 for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
                     shutdown(ioSockets.sock[i], SHUT_RDWR);
+                dup2(attachSock, ioSockets.inputSock);
+                dup2(attachSock, ioSockets.outputSock);
+                dup2(attachSock, ioSockets.controlSock);
+                close(attachSock);
+                inputOpen = true;
+                frameDecoder = FrameDecoder();
+                input.clear();
+                inputGranted = input.written();
+                coalescer.discard();
 
-                break;
+                /* Size of new connection applies at once, a storm of the old one is over */
+                if (attachWinp.ws_col && attachWinp.ws_row)
+                {
+                    set_pty_size(&relay, &attachWinp);
+                    resizer.setApplied(&attachWinp);
+                }
+
+                g_log.write(LOG_LEVEL_INFO, LOG_SESSION_ATTACHED, { session.missedBytes() },
+                    sessionName);
+                g_recorder.mark(RECORD_ATTACH, session.missedBytes());
+                screen.reset();
+                screenUpdate.clear();
+                session.snapshot(screenUpdate);
+                const unsigned long long sentBefore = coalescer.bytesOut();
+                writeRet = coalescer.send(screenUpdate.data(), screenUpdate.size()) ? 1 : -1;
+                relay.outputWindow = charge_window(FRAME_WINDOW_INITIAL,
+                                                   coalescer.bytesOut() - sentBefore);
             }
-        }
-        while (writeRet > 0);
 
-        close(mfd_dp);
-        close(mfd);
-    }
-    else if (child == 0) /* child or slave */
-    {
-        int res;
+            /* Receive buffers from master and stage them for output socket */
+            ssize_t fillRet = 0;
+            if (fds[2].fd >= 0 && (fds[2].revents || childExited))
+            {
+                const uint64_t start = g_recorder.now();
+                fillRet = coalescer.fill(mfd);
+                g_recorder.record(RECORD_PTY_READ, fillRet < 0 ? -errno : fillRet, start);
+                if (fillRet > 0 && trace.enabled() && !firstOutput)
+                {
+                    trace.end();
+                    trace.instant("first pty byte");
+                    firstOutput = true;
+                }
 
-        for (char *const &setting : childParams.env)
-            putenv(setting);
+                if (fillRet > 0)
+                    session.feed(coalescer.data() + coalescer.length() - fillRet, fillRet);
 
-        /* Changed directory should affect in child process */
-        if (!childParams.cwd.empty())
-        {
-            wordexp_t expanded_cwd;
-            wordexp(childParams.cwd.c_str(), &expanded_cwd, 0);
-            if (expanded_cwd.we_wordc != 1)
+                /* Output of a flood is only kept in the screen model */
+                if (screenFps && fillRet > 0 &&
+                    screen.feed(coalescer.data() + coalescer.length() - fillRet, fillRet))
+                    coalescer.unfill(fillRet);
+
+                /* Output of detached session is only kept in its screen model */
+                if (!session.attached())
+                    coalescer.unfill(coalescer.length());
+            }
+
+            /* Send staged buffers when full, timed out or interactive */
+            if (coalescer.ready() && session.attached() &&
+                (!muxMode || relay.outputWindow >= (long long)coalescer.length()))
+            {
+                const size_t staged = coalescer.length();
+                const uint64_t start = g_recorder.now();
+                relay.outputWindow -= staged;
+                tuner.update(staged);
+                if (!coalescer.flush())
+                    writeRet = -1;
+                g_recorder.record(RECORD_SEND, staged, start);
+            }
+
+            /* Quiet pty ends bulk mode, uncorking pushes the tail out */
+            classifier.update(fds[2].fd >= 0);
+
+            /* Startup is over when first output is on its way */
+            if (firstOutput && coalescer.length() == 0 && trace.enabled())
+                trace.write();
+
+            /* Pty hung up or child exited, and nothing is left to read in pty */
+            const bool hangup = fds[2].fd >= 0 && (fds[2].revents || childExited) &&
+                                fillRet <= 0;
+
+            /* Send screen update when frame is due and frontend is reading */
+            if (session.attached() && screen.flooding() && (hangup || screen.frameDue()) &&
+                (!muxMode || relay.outputWindow > 0))
+            {
+                screenUpdate.clear();
+                screen.frame(screenUpdate);
+                const unsigned long long sentBefore = coalescer.bytesOut();
+                if (!coalescer.send(screenUpdate.data(), screenUpdate.size()))
+                    writeRet = -1;
+                relay.outputWindow = charge_window(relay.outputWindow,
+                                                   coalescer.bytesOut() - sentBefore);
+            }
+
+            /* Shutdown I/O sockets when child process terminates */
+            if (hangup)
             {
-                fprintf(stderr,
-                    "path expansion failed, word expanded to %ld paths",
-                    expanded_cwd.we_wordc);
+                coalescer.flush();
+                coalescer.drain(true);
+                compressor.drain();
+                end_session(coalescer, watcher, muxMode);
+                break;
             }
 
-            res = chdir(expanded_cwd.we_wordv[0]);
-            wordfree(&expanded_cwd);
-            if (res != 0)
-                perror("chdir");
+            /* Connection of session broke, child and its pty keep running */
+            if (writeRet <= 0 && session.listening())
+            {
+                for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
+                    shutdown(ioSockets.sock[i], SHUT_RDWR);
+                inputOpen = false;
+                coalescer.discard();
+                if (session.attached())
+                {
+                    session.detach();
+                    g_log.write(LOG_LEVEL_INFO, LOG_SESSION_DETACHED, sessionName);
+                    g_recorder.mark(RECORD_DETACH, 0);
+                }
+                writeRet = 1;
+            }
         }
 
-        for (int i = optind; i < argc; ++i)
-            childParams.argv.push_back(argv[i]);
+        trace.write();
+        g_log.write(LOG_LEVEL_INFO, LOG_CHILD_EXIT, { child, watcher.exitStatus() });
 
-        if (childParams.argv.empty())
+        if (uringEngine)
         {
-            const char *shell = "/bin/sh";
-#ifdef use_getpwuid
-            struct passwd *pw = getpwuid(getuid());
-            assert(pw != NULL);
-            if (pw->pw_shell != NULL)
-                shell = pw->pw_shell;
-#else
-            if (getenv("SHELL"))
-                shell = getenv("SHELL");
-#endif
-            childParams.argv.push_back(strdup(shell));
+            g_log.write(LOG_LEVEL_INFO, LOG_URING_READS,
+                { ring.ptyReads(), ring.sockSends(), ring.readArms() });
+            g_log.write(LOG_LEVEL_INFO, LOG_URING_BYTES,
+                { ring.bytesIn(), ring.bytesOut(), ring.enters() });
         }
-
-        childParams.prog = childParams.argv[0];
-        if (loginMode)
+        else
         {
-            std::string argv0 = childParams.argv[0];
-            const std::size_t pos = argv0.find_last_of('/');
-            if (pos != std::string::npos)
-                argv0 = argv0.substr(pos + 1);
+            /* Kernel refused splice of pty or socket, coalescer went on reading */
+            if (spliceEngine && !coalescer.spliced())
+                g_log.write(LOG_LEVEL_WARN, LOG_SPLICE_REFUSED);
+            else if (spliceEngine)
+                g_log.write(LOG_LEVEL_INFO, LOG_SPLICED, { coalescer.splicedBytes() });
 
-            argv0 = '-' + argv0;
-            childParams.argv[0] = strdup(argv0.c_str());
+            g_log.write(LOG_LEVEL_INFO, LOG_POLL_READS,
+                { coalescer.ptyReads(), coalescer.sockSends(), coalescer.sendsAvoided() });
+            g_log.write(LOG_LEVEL_INFO, LOG_POLL_BYTES, { stats.bytesIn, coalescer.bytesOut(),
+                stats.pollWakeups, coalescer.sendUsec() });
         }
-        childParams.argv.push_back(NULL);
 
-        res = execvp(childParams.prog.c_str(), childParams.argv.data());
-        if (res != 0)
-            perror("execvp");
+        if (compressLevel)
+        {
+            const unsigned long long bytesOut = compressor.bytesOut();
+            g_log.write(LOG_LEVEL_INFO, LOG_DEFLATE_STATS,
+                { compressor.deflateBatches(), compressor.plainBatches(),
+                  compressor.bytesIn(), bytesOut,
+                  bytesOut ? (double)compressor.bytesIn() / bytesOut : 0.0,
+                  compressor.cpuUsec() });
+        }
 
-        /*
-         * Do not use exit() because it performs clean-up
-         * related to user-mode constructs in the library
-         */
-        _exit(0);
+        g_log.write(LOG_LEVEL_INFO, LOG_QUEUE_STATS,
+            { input.peak(), coalescer.queuePeak(), input.stalls() });
+
+        g_log.write(LOG_LEVEL_INFO, LOG_RESIZE_STATS,
+            { resizer.applied(), resizer.collapsed() });
+
+        g_log.write(LOG_LEVEL_INFO, LOG_MODE_STATS,
+            { classifier.switches(), (unsigned long long)classifier.bulkUsec() / 1000 });
+
+        if (tuner.enabled())
+            g_log.write(LOG_LEVEL_INFO, LOG_BUFFER_STATS, { tuner.grows(), tuner.shrinks() });
+
+        if (screenFps)
+            g_log.write(LOG_LEVEL_INFO, LOG_SCREEN_STATS,
+                { screen.floods(), screen.frames(), screen.heldBytes() });
+
+        if (session.listening())
+            g_log.write(LOG_LEVEL_INFO, LOG_SESSION_STATS,
+                { session.detaches(), session.attaches(), session.missedBytes() });
+
+        close(mfd_dp);
+        close(mfd);
     }
+    else if (child == 0) /* child or slave */
+        exec_child(childParams, loginMode);
     else
         perror("fork");
 
@@ -399,6 +1584,8 @@ int main(int argc, char *argv[])
     for (size_t i = 0; i < ARRAYSIZE(ioSockets.sock); i++)
         close(ioSockets.sock[i]);
 
+    g_recorder.stop();
+    g_log.stop();
     if (debugMode)
     {
         printf("Press any key to continue...\n");
@@ -0,0 +1,1731 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+/*
+ * Throughput and latency benchmark of backend relay loop. Backend is started
+ * with a stand-in frontend over localhost, like in WSL1, so it runs in plain
+ * Linux. With --unix the connection is a unix socket instead of TCP. Each
+ * throughput workload prints its output in pty, which is received and
+ * dropped. Latency is measured from a keystroke sent to input until its
+ * echo comes back. Stress scenarios check that a side which does not read
+ * does not stop the other direction. Results are written to stdout as JSON
+ * to compare them across commits, across transport settings with --buffers
+ * or across relay engines with --engines. --startup measures the time from
+ * spawn of backend to its first output with three sockets and with one
+ * multiplexed connection. --codec checks and measures the inband codec of
+ * old frontends without a backend.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "FrameCodec.hpp"
+#include "InbandCodec.hpp"
+#include "ResizeDebouncer.hpp"
+#include "nix-sock.h"
+
+/* Output of each workload, except seq which prints 1e8 numbers for it */
+#define BENCH_DEFAULT_MB 256
+
+/* Keystrokes of each latency scenario */
+#define LATENCY_DEFAULT_KEYS 1000
+
+/* Keys are sent every 5-10 ms, echo later than this is lost */
+#define LATENCY_GAP_MIN_USEC 5000
+#define LATENCY_LOST_MSEC 2000
+
+/* Latency histogram has power of 2 buckets up to this, in microseconds */
+#define LATENCY_HISTOGRAM_MAX (1 << 20)
+
+/* Stress scenario that does not finish in this time is stuck */
+#define STRESS_LIMIT_MSEC 10000
+
+/* Paste scenario sends this while the program prints its output */
+#define STRESS_PASTE_BYTES (4 << 20)
+#define STRESS_OUTPUT_MB 32
+
+/* Transport buffers of stall scenario, smaller than output window */
+#define STRESS_BUFFER_SIZE 16384
+
+/* Exit scenario prints this and exits at once with the status */
+#define STRESS_EXIT_BYTES (10 << 20)
+#define STRESS_EXIT_STATUS 3
+
+/* Session scenario reattaches this often, each connection must get this output */
+#define STRESS_REATTACHES 5
+#define STRESS_REATTACH_BYTES (256 << 10)
+
+/* Resize scenario sends this many window sizes, one every few hundred microseconds */
+#define STRESS_RESIZES 5000
+#define STRESS_RESIZE_GAP_USEC 200
+
+/* Random cuts of codec check and chunk of its benchmark, like a recv of input */
+#define CODEC_RANDOM_SPLITS 5000
+#define CODEC_CHUNK_SIZE 65536
+
+/* Options added to every backend, e.g. transport setting of --buffers */
+static std::vector<std::string> backendOptions;
+
+/* Stand-in frontend listens on a unix socket, see --unix */
+static bool unixTransport = false;
+
+struct Workload
+{
+    const char *name;
+    std::string command;
+};
+
+struct Result
+{
+    unsigned long long bytes;
+    uint64_t usec;
+    unsigned long syscalls;     /* Counted by backend relay loop */
+    std::string engine;         /* Relay engine that backend used at last */
+    uint64_t cpuUsec;           /* Backend process only, not workload */
+    long long cycles;           /* -1 if perf events are not available */
+    unsigned long resizes;      /* Window sizes applied to pty */
+};
+
+/* Count CPU cycles of process, from its exec and not in its children */
+static int open_cycles(pid_t pid)
+{
+    struct perf_event_attr attr = {};
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+
+    const int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    if (fd >= 0)
+        return fd;
+
+    /* Unprivileged users may only count user space */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/* User and system time of exited but not yet reaped process */
+static uint64_t process_cpu_usec(pid_t pid)
+{
+    char path[32], stat[1024];
+    sprintf(path, "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return 0;
+
+    const size_t len = fread(stat, 1, sizeof stat - 1, file);
+    fclose(file);
+    stat[len] = '\0';
+
+    /* Fields 14 and 15 after comm, which may contain spaces */
+    const char *pos = strrchr(stat, ')');
+    unsigned long utime, stime;
+    if (!pos || sscanf(pos + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime) != 2)
+        return 0;
+
+    return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+/* Syscalls of relay loop from counters printed by backend at exit */
+static unsigned long relay_syscalls(const std::string &log)
+{
+    /* Reads and sends of io_uring engine are done inside its ring enters */
+    unsigned long enters = 0;
+    const size_t enters_pos = log.find("ring enters:");
+    if (enters_pos != std::string::npos &&
+        sscanf(log.c_str() + enters_pos, "ring enters: %lu", &enters) == 1)
+        return enters;
+
+    unsigned long reads = 0, sends = 0, wakeups = 0;
+    const size_t reads_pos = log.find("pty reads:");
+    const size_t wakeups_pos = log.find("poll wakeups:");
+    if (reads_pos != std::string::npos)
+        sscanf(log.c_str() + reads_pos, "pty reads: %lu socket sends: %lu", &reads, &sends);
+    if (wakeups_pos != std::string::npos)
+        sscanf(log.c_str() + wakeups_pos, "poll wakeups: %lu", &wakeups);
+    return reads + sends + wakeups;
+}
+
+/* Window sizes applied to pty from counters printed by backend at exit */
+static unsigned long relay_resizes(const std::string &log)
+{
+    unsigned long applied = 0;
+    const size_t pos = log.find("resizes applied:");
+    if (pos != std::string::npos)
+        sscanf(log.c_str() + pos, "resizes applied: %lu", &applied);
+    return applied;
+}
+
+/* Engine of last line about it in log, backend may fall back while it runs */
+static std::string relay_engine(const std::string &log)
+{
+    const size_t pos = log.rfind("engine: ");
+    if (pos == std::string::npos)
+        return "poll";
+
+    const size_t start = pos + strlen("engine: ");
+    return log.substr(start, log.find_first_of(",\n", start) - start);
+}
+
+/* Backend connected to stand-in frontend */
+struct Session
+{
+    pid_t pid;
+    int sock;
+    int logFd;          /* Stdout of backend, counters are printed at exit */
+    int cyclesFd;
+    FrameDecoder decoder;
+    unsigned long long granted;
+    long long inputWindow;
+    char watchByte;     /* Echo or marker is found in output, 0 if it is all of it */
+    bool watchSeen;
+    int exitStatus;     /* Last frame of backend, -1 until it comes */
+};
+
+static bool start_backend(const char *backend, const std::string &command,
+    Session *session)
+{
+    /* Flood scenario runs two backends, each one gets its own socket */
+    static unsigned int sockets = 0;
+    const char *tmp = getenv("TMPDIR");
+    const std::string path = std::string(tmp ? tmp : "/tmp") + "/wslbridge2-bench-" +
+        std::to_string(getpid()) + "-" + std::to_string(sockets++) + ".sock";
+
+    std::string port;
+    int listenSock;
+    if (unixTransport)
+    {
+        unlink(path.c_str());
+        listenSock = nix_unix_listen(path.c_str());
+    }
+    else
+    {
+        listenSock = nix_local_listen(0);
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof addr;
+        if (getsockname(listenSock, (struct sockaddr *)&addr, &addrlen) != 0)
+            fatalPerror("getsockname");
+        port = std::to_string(ntohs(addr.sin_port));
+    }
+
+    /* Backend waits until its cycles are counted */
+    int logPipe[2], goPipe[2];
+    if (pipe2(logPipe, O_CLOEXEC) != 0 || pipe2(goPipe, O_CLOEXEC) != 0)
+        fatalPerror("pipe2");
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        fatalPerror("fork");
+    if (pid == 0)
+    {
+        const int nullFd = open("/dev/null", O_RDWR);
+        dup2(nullFd, STDIN_FILENO);
+        dup2(logPipe[1], STDOUT_FILENO);
+
+        char go;
+        if (read(goPipe[0], &go, 1) != 1)
+            _exit(1);
+
+        std::vector<const char *> args = {
+            backend, "--loopback", "--cols", "80", "--rows", "24",
+            unixTransport ? "--unix" : "--mux", unixTransport ? path.c_str() : port.c_str() };
+        for (const std::string &option : backendOptions)
+            args.push_back(option.c_str());
+        args.insert(args.end(), { "--", "sh", "-c", command.c_str(), nullptr });
+        execv(backend, (char **)args.data());
+        _exit(127);
+    }
+
+    close(logPipe[1]);
+    close(goPipe[0]);
+    session->pid = pid;
+    session->logFd = logPipe[0];
+    session->cyclesFd = open_cycles(pid);
+    session->decoder = FrameDecoder();
+    session->granted = 0;
+    session->inputWindow = FRAME_WINDOW_INITIAL;
+    session->watchByte = 0;
+    session->watchSeen = false;
+    session->exitStatus = -1;
+    if (write(goPipe[1], "g", 1) != 1)
+        fatalPerror("write");
+    close(goPipe[1]);
+
+    session->sock = unixTransport ? nix_unix_accept(listenSock) : nix_local_accept(listenSock);
+    close(listenSock);
+    if (unixTransport)
+        unlink(path.c_str());
+    return session->sock >= 0;
+}
+
+/* Receive and drop output of backend, return recv result */
+static ssize_t receive_output(Session *session)
+{
+    static thread_local char data[262144];
+    const ssize_t ret = recv(session->sock, data, sizeof data, 0);
+    if (ret <= 0)
+        return ret;
+
+    FrameDecoder &decoder = session->decoder;
+    size_t pos = 0;
+    while (pos < (size_t)ret)
+    {
+        pos += decoder.decode(data + pos, ret - pos);
+        for (int i = 0; session->watchByte && i < decoder.iovcnt(); i++)
+            if (memchr(decoder.iov()[i].iov_base, session->watchByte, decoder.iov()[i].iov_len))
+                session->watchSeen = true;
+        decoder.clearIov();
+
+        uint8_t type, channel;
+        const char *payload;
+        size_t len;
+        if (!decoder.takeEvent(&type, &channel, &payload, &len) || len != 4)
+            continue;
+        if (type == FRAME_WINDOW && channel == CHANNEL_TERMINAL)
+            session->inputWindow += frame_get_u32(payload);
+        else if (type == FRAME_EXIT && channel == CHANNEL_CONTROL)
+            session->exitStatus = frame_get_u32(payload);
+    }
+
+    /* Let backend send more output when half window is received */
+    const unsigned long long received = decoder.dataBytes() - session->granted;
+    if (received >= FRAME_WINDOW_INITIAL / 2)
+    {
+        char frame[FRAME_HEADER_LEN + 4];
+        const size_t len = frame_encode_window(frame, received);
+        if (send(session->sock, frame, len, 0) != (ssize_t)len)
+            return -1;
+        session->granted += received;
+    }
+
+    return ret;
+}
+
+/* Wait until backend exits after closing connection, fill its counters */
+static void finish_backend(Session *session, Result *result)
+{
+    close(session->sock);
+
+    /* Backend has exited but is kept to read its CPU time */
+    siginfo_t info;
+    if (waitid(P_PID, session->pid, &info, WEXITED | WNOWAIT) != 0)
+        fatalPerror("waitid");
+    if (result)
+        result->cpuUsec = process_cpu_usec(session->pid);
+
+    long long cycles = -1;
+    if (session->cyclesFd >= 0)
+    {
+        if (read(session->cyclesFd, &cycles, sizeof cycles) != sizeof cycles)
+            cycles = -1;
+        close(session->cyclesFd);
+    }
+
+    std::string log;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(session->logFd, buf, sizeof buf)) > 0)
+        log.append(buf, len);
+    close(session->logFd);
+
+    if (result)
+    {
+        result->cycles = cycles;
+        result->syscalls = relay_syscalls(log);
+        result->engine = relay_engine(log);
+        result->resizes = relay_resizes(log);
+    }
+
+    int status;
+    waitpid(session->pid, &status, 0);
+}
+
+static bool run_workload(const char *backend, const Workload &work, Result *result)
+{
+    Session session;
+    if (!start_backend(backend, work.command, &session))
+        return false;
+
+    const uint64_t start = monotonic_usec();
+    while (receive_output(&session) > 0)
+        ;
+
+    result->usec = monotonic_usec() - start;
+    result->bytes = session.decoder.dataBytes();
+    finish_backend(&session, result);
+    return result->bytes > 0;
+}
+
+/* Send one key, return echo latency in microseconds or 0 if it is lost */
+static uint64_t echo_latency(Session *session)
+{
+    char frame[FRAME_HEADER_LEN + 1];
+    frame_encode_header(frame, FRAME_DATA, 1);
+    frame[FRAME_HEADER_LEN] = 'k';
+
+    const unsigned long long before = session->decoder.dataBytes();
+    const uint64_t start = monotonic_usec();
+    session->watchSeen = false;
+    if (send(session->sock, frame, sizeof frame, 0) != sizeof frame)
+        return 0;
+
+    while (session->watchByte ? !session->watchSeen : session->decoder.dataBytes() == before)
+    {
+        struct pollfd pfd = { session->sock, POLLIN, 0 };
+        if (poll(&pfd, 1, LATENCY_LOST_MSEC) <= 0 || receive_output(session) <= 0)
+            return 0;
+    }
+
+    return monotonic_usec() - start;
+}
+
+/* Drain pending output for a while, e.g. echo of stray keys */
+static void settle(Session *session, int msec)
+{
+    const uint64_t end = monotonic_usec() + msec * 1000;
+    struct pollfd pfd = { session->sock, POLLIN, 0 };
+    while (poll(&pfd, 1, msec) > 0 && receive_output(session) > 0 &&
+           monotonic_usec() < end)
+        ;
+}
+
+/*
+ * Type keys at human rate into a program that echoes them, like a shell
+ * line editor does, while load of scenario runs. Keys are sent as
+ * terminal data frames and echo is timed when it comes back. In bulk
+ * scenario the same pty prints a flood, and the echo waits behind the
+ * output queued in the connection.
+ */
+static bool run_latency(const char *backend, const char *scenario,
+    unsigned int keys, std::vector<uint64_t> *samples)
+{
+    const bool bulk = strcmp(scenario, "bulk") == 0;
+    Session session;
+    if (!start_backend(backend, bulk ? "stty raw -echo; yes 0123456789 & exec cat" :
+                       "stty raw -echo; exec cat", &session))
+        return false;
+    session.watchByte = bulk ? 'k' : 0;
+
+    /* First echo comes once cat runs */
+    if (echo_latency(&session) == 0)
+        return false;
+    settle(&session, 100);
+
+    Session flood;
+    std::thread floodThread;
+    std::vector<pid_t> spinners;
+    if (strcmp(scenario, "flood") == 0)
+    {
+        /* Output flood in another pty, drained like frontend does */
+        if (!start_backend(backend, "cat /dev/zero", &flood))
+            return false;
+        floodThread = std::thread([&flood] {
+            while (receive_output(&flood) > 0)
+                ;
+        });
+    }
+    else if (strcmp(scenario, "cpu") == 0)
+    {
+        /* Busy loop in every CPU */
+        const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < cpus; i++)
+        {
+            const pid_t pid = fork();
+            if (pid == 0)
+                while (1)
+                    ;
+            spinners.push_back(pid);
+        }
+    }
+    settle(&session, 100);
+
+    bool lost = false;
+    for (unsigned int i = 0; i < keys && !lost; i++)
+    {
+        /* Time between keystrokes of a fast typist */
+        usleep(LATENCY_GAP_MIN_USEC + rand() % LATENCY_GAP_MIN_USEC);
+
+        const uint64_t usec = echo_latency(&session);
+        lost = usec == 0;
+        samples->push_back(usec);
+    }
+
+    if (floodThread.joinable())
+    {
+        shutdown(flood.sock, SHUT_RDWR);
+        floodThread.join();
+        kill(flood.pid, SIGTERM);
+        finish_backend(&flood, nullptr);
+    }
+    for (const pid_t pid : spinners)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+
+    shutdown(session.sock, SHUT_RDWR);
+    kill(session.pid, SIGTERM);
+    finish_backend(&session, nullptr);
+    return !lost;
+}
+
+/*
+ * Slow consumer: paste into a program that prints a flood before it reads
+ * its input. Backend has to forward the output while the paste waits for
+ * the pty, or for stdin with --pipe, or neither the program nor the paste
+ * ever finishes. Return time
+ * until the program got all of the paste, 0 if it is stuck.
+ */
+static uint64_t paste_flood(const char *backend, bool pipeMode)
+{
+    /* Pipe of --pipe is 1 MB, paste is more than it and a window */
+    const std::vector<std::string> savedOptions = backendOptions;
+    if (pipeMode)
+        backendOptions.push_back("--pipe");
+    Session session;
+    const bool started = start_backend(backend, std::string(pipeMode ? "" : "stty raw -echo; ") +
+                       "head -c " + std::to_string(STRESS_OUTPUT_MB) +
+                       "M /dev/zero | tr '\\0' x; head -c " + std::to_string(STRESS_PASTE_BYTES) +
+                       " > /dev/null; echo done; exec cat", &session);
+    backendOptions = savedOptions;
+    if (!started)
+        return 0;
+    session.watchByte = 'd';
+
+    /* Frames leave whole, a send that can not finish means backend is stuck */
+    struct timeval tv = { STRESS_LIMIT_MSEC / 1000, 0 };
+    setsockopt(session.sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    char frame[FRAME_HEADER_LEN + 16384];
+    memset(frame + FRAME_HEADER_LEN, 'p', sizeof frame - FRAME_HEADER_LEN);
+    unsigned long long pasted = 0;
+    const uint64_t start = monotonic_usec();
+    uint64_t usec = 0;
+    while (monotonic_usec() - start < STRESS_LIMIT_MSEC * 1000ULL)
+    {
+        /* Line discipline drops a long line, paste starts once pty is raw */
+        const bool sending = session.decoder.dataBytes() > 0 &&
+            pasted < STRESS_PASTE_BYTES && session.inputWindow > 0;
+        struct pollfd pfd = { session.sock, (short)(POLLIN | (sending ? POLLOUT : 0)), 0 };
+        if (poll(&pfd, 1, STRESS_LIMIT_MSEC) <= 0)
+            break;
+        if ((pfd.revents & POLLIN) && receive_output(&session) <= 0)
+            break;
+        if (session.watchSeen)
+        {
+            usec = monotonic_usec() - start;
+            break;
+        }
+
+        if (pfd.revents & POLLOUT)
+        {
+            const size_t len = std::min({ sizeof frame - FRAME_HEADER_LEN,
+                (size_t)(STRESS_PASTE_BYTES - pasted), (size_t)session.inputWindow });
+            frame_encode_header(frame, FRAME_DATA, len);
+            if (send(session.sock, frame, FRAME_HEADER_LEN + len, 0) !=
+                (ssize_t)(FRAME_HEADER_LEN + len))
+                break;
+            pasted += len;
+            session.inputWindow -= len;
+        }
+    }
+
+    shutdown(session.sock, SHUT_RDWR);
+    kill(session.pid, SIGTERM);
+    finish_backend(&session, nullptr);
+    return usec;
+}
+
+static uint64_t stress_paste(const char *backend)
+{
+    return paste_flood(backend, false);
+}
+
+/* Same with --pipe, window grants behind input for a full stdin still come in */
+static uint64_t stress_pipein(const char *backend)
+{
+    return paste_flood(backend, true);
+}
+
+/*
+ * Slow frontend: it stops reading output while a program prints a flood,
+ * then types a key that makes the program create a file. Transport buffers
+ * are smaller than output window, so the output waits in the backend, which
+ * still has to pass the key. Return time from the key to the file, 0 if
+ * the key is stuck.
+ */
+static uint64_t stress_stall(const char *backend)
+{
+    const char *tmp = getenv("TMPDIR");
+    const std::string path = std::string(tmp ? tmp : "/tmp") + "/wslbridge2-bench-" +
+        std::to_string(getpid()) + ".key";
+    unlink(path.c_str());
+
+    const std::vector<std::string> savedOptions = backendOptions;
+    const std::string size = std::to_string(STRESS_BUFFER_SIZE);
+    backendOptions.insert(backendOptions.end(), { "--buffer", size });
+    Session session;
+    const bool started = start_backend(backend, "stty raw -echo; yes & head -c 1 > /dev/null; "
+                                       "touch '" + path + "'; kill $!", &session);
+    backendOptions = savedOptions;
+    if (!started)
+        return 0;
+
+    /* Fixed buffer is not grown by the kernel while nothing is read */
+    const int rcvbuf = STRESS_BUFFER_SIZE;
+    setsockopt(session.sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    usleep(300 * 1000);
+
+    char frame[FRAME_HEADER_LEN + 1];
+    frame_encode_header(frame, FRAME_DATA, 1);
+    frame[FRAME_HEADER_LEN] = 'k';
+    const uint64_t start = monotonic_usec();
+    uint64_t usec = 0;
+    if (send(session.sock, frame, sizeof frame, 0) == sizeof frame)
+    {
+        while (monotonic_usec() - start < STRESS_LIMIT_MSEC * 1000ULL)
+        {
+            if (access(path.c_str(), F_OK) == 0)
+            {
+                usec = monotonic_usec() - start;
+                break;
+            }
+            usleep(1000);
+        }
+    }
+
+    unlink(path.c_str());
+    shutdown(session.sock, SHUT_RDWR);
+    kill(session.pid, SIGTERM);
+    finish_backend(&session, nullptr);
+    return usec;
+}
+
+/* Sample at percentile p of sorted samples */
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+{
+    size_t index = (size_t)(p * sorted.size() + 0.999999);
+    return sorted[index ? index - 1 : 0];
+}
+
+/* Plain text file for cat workload */
+static std::string make_file(unsigned long long size)
+{
+    const char *tmp = getenv("TMPDIR");
+    std::string path = std::string(tmp ? tmp : "/tmp") + "/wslbridge2-bench.txt";
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+        fatalPerror(path.c_str());
+
+    const char line[] = "The quick brown fox jumps over the lazy dog 0123456789 abcdefgh\n";
+    for (unsigned long long i = 0; i < size; i += sizeof line - 1)
+        fwrite(line, 1, sizeof line - 1, file);
+    fclose(file);
+    return path;
+}
+
+/* Run latency scenarios and print their percentiles and histograms */
+static void latency_main(const char *backend, const char *label,
+    const char *only, unsigned int keys)
+{
+    const char *scenarios[] = { "idle", "flood", "bulk", "cpu" };
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"transport\": \"%s\",\n"
+        "  \"keys\": %u,\n  \"results\": [", STRINGIFY(WSLBRIDGE2_VERSION), label,
+        unixTransport ? "unix" : "tcp", keys);
+
+    const char *sep = "";
+    for (const char *scenario : scenarios)
+    {
+        if (only && strcmp(only, scenario) != 0)
+            continue;
+
+        std::vector<uint64_t> samples;
+        if (!run_latency(backend, scenario, keys, &samples))
+            fatal("error: echo of %s scenario is lost\n", scenario);
+        std::sort(samples.begin(), samples.end());
+
+        const uint64_t p50 = percentile(samples, 0.5);
+        const uint64_t p99 = percentile(samples, 0.99);
+        const uint64_t p999 = percentile(samples, 0.999);
+        fprintf(stderr, "%-5s p50 %6lu us  p99 %6lu us  p99.9 %6lu us  max %6lu us\n",
+            scenario, (unsigned long)p50, (unsigned long)p99, (unsigned long)p999,
+            (unsigned long)samples.back());
+
+        printf("%s\n    { \"scenario\": \"%s\", \"p50_usec\": %lu, \"p99_usec\": %lu, "
+            "\"p999_usec\": %lu, \"max_usec\": %lu,\n      \"histogram\": [",
+            sep, scenario, (unsigned long)p50, (unsigned long)p99,
+            (unsigned long)p999, (unsigned long)samples.back());
+
+        /* Buckets of samples up to each power of 2, the last one has the rest */
+        size_t i = 0;
+        const char *bucketSep = "";
+        for (uint64_t bound = 16; i < samples.size(); bound *= 2)
+        {
+            const bool last = bound >= LATENCY_HISTOGRAM_MAX;
+            size_t count = 0;
+            while (i < samples.size() && (last || samples[i] <= bound))
+                i++, count++;
+            if (count == 0)
+                continue;
+
+            fprintf(stderr, "  %s%8lu us %6zu %.*s\n", last ? ">" : "<=",
+                (unsigned long)(last ? bound / 2 : bound), count,
+                (int)(count * 50 / samples.size()),
+                "##################################################");
+            printf("%s{ \"le_usec\": %s, \"count\": %zu }", bucketSep,
+                last ? "null" : std::to_string(bound).c_str(), count);
+            bucketSep = ", ";
+        }
+        printf("] }");
+        sep = ",";
+    }
+
+    printf("\n  ]\n}\n");
+}
+
+/*
+ * Throughput of cat workload and echo latency of bulk scenario at each
+ * transport setting of a comma separated list. Setting is SIZE[/LOWAT],
+ * SIZE is default, auto or bytes of --buffer and LOWAT is bytes of
+ * --notsent-lowat.
+ */
+static void buffers_main(const char *backend, const char *label,
+    const char *list, unsigned long long sizeMb, unsigned int keys)
+{
+    const std::string filePath = make_file(sizeMb << 20);
+    const Workload work = { "cat", "cat '" + filePath + "'" };
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"size_mb\": %llu,\n"
+        "  \"keys\": %u,\n  \"results\": [",
+        STRINGIFY(WSLBRIDGE2_VERSION), label, sizeMb, keys);
+
+    const char *sep = "";
+    std::string settings = list;
+    size_t pos = 0;
+    while (pos <= settings.size())
+    {
+        size_t end = settings.find(',', pos);
+        if (end == std::string::npos)
+            end = settings.size();
+        const std::string setting = settings.substr(pos, end - pos);
+        pos = end + 1;
+
+        const size_t slash = setting.find('/');
+        const std::string size = setting.substr(0, slash);
+        backendOptions.clear();
+        if (size != "default")
+            backendOptions.insert(backendOptions.end(), { "--buffer", size });
+        if (slash != std::string::npos)
+            backendOptions.insert(backendOptions.end(),
+                { "--notsent-lowat", setting.substr(slash + 1) });
+
+        Result result;
+        if (!run_workload(backend, work, &result))
+            fatal("error: cat workload produced no output with %s\n", setting.c_str());
+
+        std::vector<uint64_t> samples;
+        if (!run_latency(backend, "bulk", keys, &samples))
+            fatal("error: echo is lost with %s\n", setting.c_str());
+        std::sort(samples.begin(), samples.end());
+
+        const double mbPerSec = result.bytes / 1048576.0 / (result.usec / 1e6);
+        const uint64_t p50 = percentile(samples, 0.5);
+        const uint64_t p99 = percentile(samples, 0.99);
+        fprintf(stderr, "%-16s %8.1f MB/s  bulk echo p50 %6lu us  p99 %6lu us  max %6lu us\n",
+            setting.c_str(), mbPerSec, (unsigned long)p50, (unsigned long)p99,
+            (unsigned long)samples.back());
+
+        printf("%s\n    { \"setting\": \"%s\", \"mb_per_s\": %.1f, \"p50_usec\": %lu, "
+            "\"p99_usec\": %lu, \"max_usec\": %lu }",
+            sep, setting.c_str(), mbPerSec, (unsigned long)p50, (unsigned long)p99,
+            (unsigned long)samples.back());
+        sep = ",";
+    }
+
+    printf("\n  ]\n}\n");
+    unlink(filePath.c_str());
+}
+
+/*
+ * Throughput and relay syscalls of cat and yes workloads and echo latency
+ * of idle and bulk scenarios with each relay engine of a comma separated
+ * list, e.g. poll,uring,splice. Backend falls back to poll if it can not use an
+ * engine, results show the engine that relayed.
+ */
+static void engines_main(const char *backend, const char *label,
+    const char *list, unsigned long long sizeMb, unsigned int keys)
+{
+    const std::string filePath = make_file(sizeMb << 20);
+    const Workload workloads[] = {
+        { "cat", "cat '" + filePath + "'" },
+        { "yes", "yes | head -c " + std::to_string(sizeMb << 20) },
+    };
+    const char *scenarios[] = { "idle", "bulk" };
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"transport\": \"%s\",\n"
+        "  \"size_mb\": %llu,\n  \"keys\": %u,\n  \"results\": [",
+        STRINGIFY(WSLBRIDGE2_VERSION), label, unixTransport ? "unix" : "tcp", sizeMb, keys);
+
+    const char *sep = "";
+    std::string engines = list;
+    size_t pos = 0;
+    while (pos <= engines.size())
+    {
+        size_t end = engines.find(',', pos);
+        if (end == std::string::npos)
+            end = engines.size();
+        const std::string engine = engines.substr(pos, end - pos);
+        pos = end + 1;
+        backendOptions = { "--engine", engine };
+
+        std::string relayedBy;
+        printf("%s\n    { \"engine\": \"%s\", \"workloads\": [", sep, engine.c_str());
+        const char *itemSep = "";
+        for (const Workload &work : workloads)
+        {
+            Result result;
+            if (!run_workload(backend, work, &result))
+                fatal("error: %s workload produced no output with %s\n",
+                    work.name, engine.c_str());
+            relayedBy = result.engine;
+
+            const double mb = result.bytes / 1048576.0;
+            fprintf(stderr, "%-6s %-5s %8.1f MB/s %8.1f syscalls/MB %6.2f ns/byte\n",
+                engine.c_str(), work.name, mb / (result.usec / 1e6), result.syscalls / mb,
+                result.cpuUsec * 1e3 / result.bytes);
+            printf("%s\n        { \"workload\": \"%s\", \"mb_per_s\": %.1f, "
+                "\"syscalls_per_mb\": %.1f, \"cpu_ns_per_byte\": %.3f }",
+                itemSep, work.name, mb / (result.usec / 1e6), result.syscalls / mb,
+                result.cpuUsec * 1e3 / result.bytes);
+            itemSep = ",";
+        }
+
+        printf(" ],\n      \"latency\": [");
+        itemSep = "";
+        for (const char *scenario : scenarios)
+        {
+            std::vector<uint64_t> samples;
+            if (!run_latency(backend, scenario, keys, &samples))
+                fatal("error: echo of %s scenario is lost with %s\n", scenario, engine.c_str());
+            std::sort(samples.begin(), samples.end());
+
+            const uint64_t p50 = percentile(samples, 0.5);
+            const uint64_t p99 = percentile(samples, 0.99);
+            fprintf(stderr, "%-6s %-5s echo p50 %6lu us  p99 %6lu us  max %6lu us\n",
+                engine.c_str(), scenario, (unsigned long)p50, (unsigned long)p99,
+                (unsigned long)samples.back());
+            printf("%s\n        { \"scenario\": \"%s\", \"p50_usec\": %lu, \"p99_usec\": %lu, "
+                "\"max_usec\": %lu }", itemSep, scenario, (unsigned long)p50,
+                (unsigned long)p99, (unsigned long)samples.back());
+            itemSep = ",";
+        }
+
+        printf(" ],\n      \"relayed_by\": \"%s\" }", relayedBy.c_str());
+        sep = ",";
+    }
+
+    backendOptions.clear();
+    printf("\n  ]\n}\n");
+    unlink(filePath.c_str());
+}
+
+/* Accept a connection of backend, -1 if it does not come in time */
+static int startup_accept(int listenSock, bool unixSock)
+{
+    struct pollfd pfd = { listenSock, POLLIN, 0 };
+    if (poll(&pfd, 1, STRESS_LIMIT_MSEC) != 1)
+        return -1;
+    return unixSock ? nix_unix_accept(listenSock) : nix_local_accept(listenSock);
+}
+
+/*
+ * Session startup like a frontend does it: listen, spawn backend of `echo x`
+ * and accept its connections, three of them without --mux, then wait for the
+ * first byte of output. Times are microseconds from the first to the last
+ * accept and from spawn to the first byte, false if backend is stuck.
+ */
+static bool startup_run(const char *backend, bool mux, uint64_t *handshakeUsec,
+    uint64_t *firstByteUsec)
+{
+    const char *tmp = getenv("TMPDIR");
+    const std::string path = std::string(tmp ? tmp : "/tmp") + "/wslbridge2-bench-" +
+        std::to_string(getpid()) + "-startup.sock";
+    const bool unixSock = mux && unixTransport;
+    const int channels = mux ? 1 : 3;
+
+    int listenSock[3];
+    std::string ports[3];
+    for (int i = 0; i < channels; i++)
+    {
+        if (unixSock)
+        {
+            unlink(path.c_str());
+            listenSock[i] = nix_unix_listen(path.c_str());
+            continue;
+        }
+
+        listenSock[i] = nix_local_listen(0);
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof addr;
+        if (getsockname(listenSock[i], (struct sockaddr *)&addr, &addrlen) != 0)
+            fatalPerror("getsockname");
+        ports[i] = std::to_string(ntohs(addr.sin_port));
+    }
+
+    /* Ports of input, output and control channels, as old frontends pass them */
+    std::vector<const char *> args = { backend, "--loopback", "--cols", "80", "--rows", "24" };
+    if (mux)
+        args.insert(args.end(), { unixSock ? "--unix" : "--mux",
+                                  unixSock ? path.c_str() : ports[0].c_str() });
+    else
+        args.insert(args.end(), { "-0", ports[0].c_str(), "-1", ports[1].c_str(),
+                                  "-3", ports[2].c_str() });
+    args.insert(args.end(), { "--", "echo", "x", nullptr });
+
+    const uint64_t start = monotonic_usec();
+    const pid_t pid = fork();
+    if (pid < 0)
+        fatalPerror("fork");
+    if (pid == 0)
+    {
+        const int nullFd = open("/dev/null", O_RDWR);
+        dup2(nullFd, STDIN_FILENO);
+        dup2(nullFd, STDOUT_FILENO);
+        execv(backend, (char **)args.data());
+        _exit(127);
+    }
+
+    int socks[3] = { -1, -1, -1 };
+    uint64_t firstAccept = 0;
+    bool ok = true;
+    for (int i = 0; i < channels && ok; i++)
+    {
+        socks[i] = startup_accept(listenSock[i], unixSock);
+        if (i == 0)
+            firstAccept = monotonic_usec();
+        ok = socks[i] >= 0;
+    }
+    *handshakeUsec = monotonic_usec() - firstAccept;
+
+    /* Output is plain bytes in its own socket or data frames in the only one */
+    const int outputSock = socks[mux ? 0 : 1];
+    FrameDecoder decoder;
+    *firstByteUsec = 0;
+    while (ok && *firstByteUsec == 0)
+    {
+        char data[4096];
+        struct pollfd pfd = { outputSock, POLLIN, 0 };
+        const ssize_t ret = poll(&pfd, 1, STRESS_LIMIT_MSEC) == 1 ?
+                            recv(outputSock, data, sizeof data, 0) : -1;
+        ok = ret > 0;
+        if (ok && mux)
+        {
+            size_t pos = 0;
+            while (pos < (size_t)ret)
+            {
+                pos += decoder.decode(data + pos, ret - pos);
+                decoder.clearIov();
+
+                uint8_t type, channel;
+                const char *payload;
+                size_t len;
+                decoder.takeEvent(&type, &channel, &payload, &len);
+            }
+        }
+        if (ok && (!mux || decoder.dataBytes() > 0))
+            *firstByteUsec = monotonic_usec() - start;
+    }
+
+    /* Backend closes its sockets when echo exits, like the end of a session */
+    char rest[4096];
+    struct pollfd pfd = { outputSock, POLLIN, 0 };
+    while (ok && poll(&pfd, 1, STRESS_LIMIT_MSEC) == 1 &&
+           recv(outputSock, rest, sizeof rest, 0) > 0)
+        ;
+
+    if (!ok)
+        kill(pid, SIGTERM);
+    for (int i = 0; i < channels; i++)
+    {
+        close(socks[i]);
+        close(listenSock[i]);
+    }
+    waitpid(pid, NULL, 0);
+    if (unixSock)
+        unlink(path.c_str());
+    return ok;
+}
+
+/*
+ * Time from spawn of backend to its first byte of output, and from its
+ * first to its last connection, with three sockets and with one
+ * multiplexed connection. Setups take turns in each round, so a busy
+ * moment of the system does not favor one of them.
+ */
+static void startup_main(const char *backend, const char *label, unsigned int runs)
+{
+    const char *setups[] = { "sockets", "mux" };
+    std::vector<uint64_t> handshakes[2], firstBytes[2];
+
+    for (unsigned int i = 0; i < runs; i++)
+    {
+        for (int setup = 0; setup < 2; setup++)
+        {
+            uint64_t handshake, firstByte;
+            if (!startup_run(backend, setup == 1, &handshake, &firstByte))
+                fatal("error: backend of %s setup sent no output\n", setups[setup]);
+            handshakes[setup].push_back(handshake);
+            firstBytes[setup].push_back(firstByte);
+        }
+    }
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"transport\": \"%s\",\n"
+        "  \"runs\": %u,\n  \"results\": [", STRINGIFY(WSLBRIDGE2_VERSION), label,
+        unixTransport ? "unix" : "tcp", runs);
+
+    const char *sep = "";
+    for (int setup = 0; setup < 2; setup++)
+    {
+        std::vector<uint64_t> &handshake = handshakes[setup];
+        std::vector<uint64_t> &firstByte = firstBytes[setup];
+        std::sort(handshake.begin(), handshake.end());
+        std::sort(firstByte.begin(), firstByte.end());
+
+        const uint64_t p50 = percentile(firstByte, 0.5);
+        const uint64_t p99 = percentile(firstByte, 0.99);
+        fprintf(stderr, "%-7s handshake p50 %6lu us  first byte p50 %6lu us  "
+            "p99 %6lu us  max %6lu us\n", setups[setup],
+            (unsigned long)percentile(handshake, 0.5), (unsigned long)p50,
+            (unsigned long)p99, (unsigned long)firstByte.back());
+        printf("%s\n    { \"setup\": \"%s\", \"handshake_p50_usec\": %lu, "
+            "\"handshake_p99_usec\": %lu, \"first_byte_p50_usec\": %lu, "
+            "\"first_byte_p99_usec\": %lu, \"first_byte_max_usec\": %lu }",
+            sep, setups[setup], (unsigned long)percentile(handshake, 0.5),
+            (unsigned long)percentile(handshake, 0.99), (unsigned long)p50,
+            (unsigned long)p99, (unsigned long)firstByte.back());
+        sep = ",";
+    }
+
+    printf("\n  ]\n}\n");
+}
+
+/*
+ * Abrupt exit: a program prints a flood and exits at once. Backend has to
+ * send all output left in the pty and then the exit status before it
+ * closes the connection. Return time until it is closed, 0 if output or
+ * exit status is lost.
+ */
+static uint64_t stress_exit(const char *backend)
+{
+    Session session;
+    if (!start_backend(backend, "head -c " + std::to_string(STRESS_EXIT_BYTES) +
+                       " /dev/zero | tr '\\0' x; exit " + std::to_string(STRESS_EXIT_STATUS),
+                       &session))
+        return 0;
+
+    const uint64_t start = monotonic_usec();
+    struct pollfd pfd = { session.sock, POLLIN, 0 };
+    ssize_t ret = 1;
+    while (ret > 0 && poll(&pfd, 1, STRESS_LIMIT_MSEC) > 0)
+        ret = receive_output(&session);
+    const uint64_t usec = monotonic_usec() - start;
+
+    /* Backend that did not close the connection is stuck */
+    if (ret > 0)
+    {
+        shutdown(session.sock, SHUT_RDWR);
+        kill(session.pid, SIGTERM);
+    }
+    finish_backend(&session, nullptr);
+
+    const unsigned long long bytes = session.decoder.dataBytes();
+    if (bytes != STRESS_EXIT_BYTES || session.exitStatus != STRESS_EXIT_STATUS)
+    {
+        fprintf(stderr, "exit  got %llu of %d bytes and exit status %d\n",
+            bytes, STRESS_EXIT_BYTES, session.exitStatus);
+        return 0;
+    }
+
+    return ret > 0 ? 0 : usec;
+}
+
+/* Send a window size change like frontend does when its window is resized */
+static bool send_resize(Session *session, unsigned short cols, unsigned short rows)
+{
+    const struct winsize winp = { rows, cols, 0, 0 };
+    char frame[FRAME_HEADER_LEN + sizeof winp];
+    const size_t len = frame_encode(frame, FRAME_RESIZE, &winp, sizeof winp);
+    return send(session->sock, frame, len, 0) == (ssize_t)len;
+}
+
+/* Receive until bytes more output came, false if it stops */
+static bool receive_more(Session *session, unsigned long long bytes)
+{
+    const unsigned long long until = session->decoder.dataBytes() + bytes;
+    struct pollfd pfd = { session->sock, POLLIN, 0 };
+    while (session->decoder.dataBytes() < until)
+        if (poll(&pfd, 1, STRESS_LIMIT_MSEC) <= 0 || receive_output(session) <= 0)
+            return false;
+    return true;
+}
+
+/*
+ * Reattach: a program prints a flood in a named session while the frontend
+ * drops its connection and a new backend passes the next one to the
+ * session, several times. Each connection must get output at once. Then a
+ * window size that was applied before the first drop is requested again,
+ * the program checks that its pty has it and prints a marker for a key.
+ * Return time until the marker came, 0 if output stopped or size is lost.
+ */
+static uint64_t stress_session(const char *backend)
+{
+    const std::vector<std::string> savedOptions = backendOptions;
+    backendOptions.insert(backendOptions.end(),
+        { "--session", "bench-" + std::to_string(getpid()) });
+
+    Session owner, conn;
+    const uint64_t start = monotonic_usec();
+    bool passed = start_backend(backend, "stty raw -echo; yes tick & head -c 1 > /dev/null; "
+                                "kill $!; [ \"$(stty size)\" = '30 100' ] && echo '#'; exec cat",
+                                &owner);
+    conn = owner;
+    passed = passed && send_resize(&conn, 100, 30) && receive_more(&conn, STRESS_REATTACH_BYTES);
+
+    /* Output of detached session goes on into its screen model */
+    for (int i = 0; passed && i < STRESS_REATTACHES; i++)
+    {
+        if (i == 0)
+        {
+            close(owner.sock);
+            owner.sock = -1;
+        }
+        else
+            finish_backend(&conn, nullptr);
+        usleep(50 * 1000);
+
+        /* Handover connection has size of --cols and --rows, not the one set above */
+        passed = start_backend(backend, "true", &conn) &&
+                 receive_more(&conn, STRESS_REATTACH_BYTES);
+        if (!passed)
+            fprintf(stderr, "session output stopped after reattach %d\n", i + 1);
+    }
+    backendOptions = savedOptions;
+
+    uint64_t usec = 0;
+    if (passed && send_resize(&conn, 100, 30))
+    {
+        settle(&conn, 200);
+        conn.watchByte = '#';
+        conn.watchSeen = false;
+        char frame[FRAME_HEADER_LEN + 1];
+        frame_encode_header(frame, FRAME_DATA, 1);
+        frame[FRAME_HEADER_LEN] = 'k';
+        struct pollfd pfd = { conn.sock, POLLIN, 0 };
+        if (send(conn.sock, frame, sizeof frame, 0) == sizeof frame)
+            while (!conn.watchSeen && poll(&pfd, 1, STRESS_LIMIT_MSEC) > 0 &&
+                   receive_output(&conn) > 0)
+                ;
+        if (conn.watchSeen)
+            usec = monotonic_usec() - start;
+        else
+            fprintf(stderr, "session lost window size or key after reattach\n");
+    }
+
+    /* Backend that passed the connection waits for its hangup, a killed session does not send it */
+    shutdown(conn.sock, SHUT_RDWR);
+    kill(owner.pid, SIGTERM);
+    if (conn.pid != owner.pid)
+    {
+        kill(conn.pid, SIGTERM);
+        finish_backend(&conn, nullptr);
+    }
+    finish_backend(&owner, nullptr);
+    return usec;
+}
+
+/*
+ * Resize storm: frontend window is dragged for a while and sends thousands
+ * of window sizes, the last one differs from all others. A program counts
+ * SIGWINCH it gets until it is told to stop, then writes its count and pty
+ * size to a file and exits. Backend must apply the last size, and sizes
+ * applied and signals must stay within one per resize interval. Return time
+ * of the storm and the check, 0 if a bound is broken or the size is lost.
+ */
+static uint64_t stress_resize(const char *backend)
+{
+    const char *tmp = getenv("TMPDIR");
+    const std::string path = std::string(tmp ? tmp : "/tmp") + "/wslbridge2-bench-" +
+        std::to_string(getpid()) + ".winch";
+    const std::string stopPath = path + ".stop";
+    unlink(path.c_str());
+    unlink(stopPath.c_str());
+
+    Session session;
+    if (!start_backend(backend, "n=0; trap 'n=$((n+1))' WINCH; while [ ! -e '" + stopPath +
+                       "' ]; do sleep 0.01; done; echo $n $(stty size) > '" + path + "'",
+                       &session))
+        return 0;
+    settle(&session, 100);
+
+    /* Program wakes from each sleep, signals of one sleep count once */
+    const uint64_t start = monotonic_usec();
+    bool sent = true;
+    for (int i = 0; sent && i < STRESS_RESIZES; i++)
+    {
+        const bool last = i == STRESS_RESIZES - 1;
+        sent = send_resize(&session, last ? 100 : 80 + i % 20, last ? 30 : 24 + i % 8);
+        usleep(STRESS_RESIZE_GAP_USEC);
+    }
+    settle(&session, 3 * RESIZE_DEFAULT_MSEC);
+    const uint64_t stormUsec = monotonic_usec() - start;
+
+    /* Program exits after it wrote its count, then backend closes connection */
+    FILE *stop = fopen(stopPath.c_str(), "w");
+    if (stop)
+        fclose(stop);
+    struct pollfd pfd = { session.sock, POLLIN, 0 };
+    ssize_t ret = 1;
+    while (ret > 0 && poll(&pfd, 1, STRESS_LIMIT_MSEC) > 0)
+        ret = receive_output(&session);
+    if (ret > 0)
+    {
+        shutdown(session.sock, SHUT_RDWR);
+        kill(session.pid, SIGTERM);
+    }
+    Result result = {};
+    finish_backend(&session, &result);
+    const uint64_t usec = monotonic_usec() - start;
+
+    unsigned long signals = 0;
+    unsigned int rows = 0, cols = 0;
+    FILE *file = fopen(path.c_str(), "r");
+    const bool counted = file && fscanf(file, "%lu %u %u", &signals, &rows, &cols) == 3;
+    if (file)
+        fclose(file);
+    unlink(path.c_str());
+    unlink(stopPath.c_str());
+
+    /* Storm starts with a resize at once, then one per interval at most */
+    const unsigned long bound = stormUsec / (RESIZE_DEFAULT_MSEC * 1000) + 2;
+    fprintf(stderr, "resize %d sizes in %.1f ms, applied %lu, SIGWINCH %lu, bound %lu\n",
+        STRESS_RESIZES, stormUsec / 1e3, result.resizes, signals, bound);
+    if (!sent || !counted || rows != 30 || cols != 100 || signals == 0 ||
+        signals > bound || result.resizes > bound)
+    {
+        fprintf(stderr, "resize got size %ux%u, sent all sizes: %s\n", cols, rows,
+            sent ? "yes" : "no");
+        return 0;
+    }
+
+    return usec;
+}
+
+/*
+ * Pipe mode: a command closes its stdout and stderr and then waits for a
+ * key in its stdin before it exits. Backend has to go on passing input
+ * after output is over, then send the exit status. Return time from the
+ * key until the connection is closed, 0 if status is lost or input stuck.
+ */
+static uint64_t stress_pipe(const char *backend)
+{
+    const std::vector<std::string> savedOptions = backendOptions;
+    backendOptions.push_back("--pipe");
+    Session session;
+    const bool started = start_backend(backend, "exec >&- 2>&-; head -c 1 > /dev/null; exit " +
+                                       std::to_string(STRESS_EXIT_STATUS), &session);
+    backendOptions = savedOptions;
+    if (!started)
+        return 0;
+    settle(&session, 200);
+
+    char frame[FRAME_HEADER_LEN + 1];
+    frame_encode_header(frame, FRAME_DATA, 1);
+    frame[FRAME_HEADER_LEN] = 'k';
+    const uint64_t start = monotonic_usec();
+    struct pollfd pfd = { session.sock, POLLIN, 0 };
+    ssize_t ret = send(session.sock, frame, sizeof frame, 0) == sizeof frame;
+    while (ret > 0 && poll(&pfd, 1, STRESS_LIMIT_MSEC) > 0)
+        ret = receive_output(&session);
+    const uint64_t usec = monotonic_usec() - start;
+
+    if (ret > 0)
+    {
+        shutdown(session.sock, SHUT_RDWR);
+        kill(session.pid, SIGTERM);
+    }
+    finish_backend(&session, nullptr);
+
+    if (session.exitStatus != STRESS_EXIT_STATUS)
+    {
+        fprintf(stderr, "pipe  got exit status %d\n", session.exitStatus);
+        return 0;
+    }
+    return ret > 0 ? 0 : usec;
+}
+
+/* Run stress scenarios, return false if any of them is stuck */
+static bool stress_main(const char *backend, const char *label, const char *only)
+{
+    const struct
+    {
+        const char *name;
+        uint64_t (*run)(const char *backend);
+    } scenarios[] = {
+        { "paste", stress_paste },
+        { "stall", stress_stall },
+        { "exit", stress_exit },
+        { "session", stress_session },
+        { "resize", stress_resize },
+        { "pipe", stress_pipe },
+        { "pipein", stress_pipein },
+    };
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"transport\": \"%s\",\n"
+        "  \"results\": [", STRINGIFY(WSLBRIDGE2_VERSION), label,
+        unixTransport ? "unix" : "tcp");
+
+    bool passed = true;
+    const char *sep = "";
+    for (size_t i = 0; i < ARRAYSIZE(scenarios); i++)
+    {
+        if (only && strcmp(only, scenarios[i].name) != 0)
+            continue;
+
+        const uint64_t usec = scenarios[i].run(backend);
+        if (usec)
+            fprintf(stderr, "%-7s passed in %8.1f ms\n", scenarios[i].name, usec / 1e3);
+        else
+            fprintf(stderr, "%-7s failed or stuck for %6d ms\n", scenarios[i].name,
+                STRESS_LIMIT_MSEC);
+
+        printf("%s\n    { \"scenario\": \"%s\", \"passed\": %s, \"msec\": %.1f }",
+            sep, scenarios[i].name, usec ? "true" : "false", usec / 1e3);
+        passed = passed && usec;
+        sep = ",";
+    }
+
+    printf("\n  ]\n}\n");
+    return passed;
+}
+
+/* Encode data into stream of old frontend, expected has it decoded */
+static void codec_append(std::string *stream, std::string *expected, const std::string &data)
+{
+    std::vector<char> out(INBAND_ENCODED_MAX(data.size()) + 1);
+    stream->append(out.data(), inband_encode(data.data(), data.size(), out.data()));
+    *expected += data;
+}
+
+static void codec_append_winsize(std::string *stream, std::string *expected,
+    unsigned short cols, unsigned short rows)
+{
+    const struct winsize winp = { rows, cols, 0, 0 };
+    char out[2 + INBAND_WINSIZE_LEN];
+    stream->append(out, inband_encode_winsize(&winp, out));
+    *expected += "[" + std::to_string(cols) + "x" + std::to_string(rows) + "]";
+}
+
+/*
+ * Decode stream received in chunks that end at each offset of ends, like
+ * backend does. Window sizes are put in data as text, so a size that is
+ * lost or taken at the wrong place makes it differ from expected data.
+ */
+static std::string codec_decode(const std::string &stream, const std::vector<size_t> &ends)
+{
+    InbandDecoder decoder;
+    std::string out;
+    size_t from = 0;
+
+    for (size_t i = 0; i <= ends.size(); i++)
+    {
+        /* Runs point into the chunk, a copy of it is gone like a recv buffer */
+        const size_t to = i < ends.size() ? ends[i] : stream.size();
+        std::vector<char> chunk(stream.begin() + from, stream.begin() + to);
+        size_t pos = 0;
+        while (pos < chunk.size())
+        {
+            pos += decoder.decode(chunk.data() + pos, chunk.size() - pos);
+            for (int j = 0; j < decoder.iovcnt(); j++)
+                out.append((const char *)decoder.iov()[j].iov_base, decoder.iov()[j].iov_len);
+            decoder.clearIov();
+
+            struct winsize winp;
+            if (decoder.takeWinsize(&winp))
+                out += "[" + std::to_string(winp.ws_col) + "x" + std::to_string(winp.ws_row) + "]";
+        }
+        std::fill(chunk.begin(), chunk.end(), '#');
+        from = to;
+    }
+
+    return out;
+}
+
+/*
+ * Check that input of old frontend decodes the same wherever recv splits
+ * it: in one chunk, cut at every offset, in chunks of every length and at
+ * random cuts. Stream has NUL characters at the end of text, window sizes
+ * whose payload has NUL, STX and DLE bytes, an unknown escape and more
+ * runs than one decode() takes. Return count of failed checks.
+ */
+static unsigned long codec_check(unsigned long *checks)
+{
+    std::string stream, expected;
+    codec_append(&stream, &expected, "ls -l\r");
+    codec_append(&stream, &expected, std::string("\0", 1));
+    codec_append_winsize(&stream, &expected, 120, 40);
+    codec_append(&stream, &expected, std::string("vi\0\0x\0", 6));
+    codec_append_winsize(&stream, &expected, 0x1000, 0x0210);
+    codec_append_winsize(&stream, &expected, 0x0200, 0x1002);
+    std::string runs;
+    for (int i = 0; i < 3 * INBAND_IOV_MAX; i++)
+        runs += i % 3 ? std::string("a\0", 2) : std::string("\0", 1);
+    codec_append(&stream, &expected, runs);
+
+    /* Unknown escape drops its NUL */
+    stream += std::string("\0z", 2);
+    expected += "z";
+    codec_append_winsize(&stream, &expected, 80, 24);
+    codec_append(&stream, &expected, "exit\r");
+
+    unsigned long failed = 0;
+    *checks = 0;
+    auto check = [&](const std::vector<size_t> &ends, const char *how)
+    {
+        (*checks)++;
+        if (codec_decode(stream, ends) == expected)
+            return;
+        if (failed++ == 0)
+        {
+            fprintf(stderr, "codec decodes stream of %zu bytes wrong when %s at", stream.size(), how);
+            for (size_t end : ends)
+                fprintf(stderr, " %zu", end);
+            fprintf(stderr, "\n");
+        }
+    };
+
+    check({}, "whole");
+    for (size_t cut = 0; cut <= stream.size(); cut++)
+        check({ cut }, "cut");
+    for (size_t len = 1; len < stream.size(); len++)
+    {
+        std::vector<size_t> ends;
+        for (size_t end = len; end < stream.size(); end += len)
+            ends.push_back(end);
+        check(ends, "split");
+    }
+
+    srand(1);
+    for (int i = 0; i < CODEC_RANDOM_SPLITS; i++)
+    {
+        std::vector<size_t> ends(1 + rand() % 8);
+        for (size_t &end : ends)
+            end = rand() % (stream.size() + 1);
+        std::sort(ends.begin(), ends.end());
+        check(ends, "cut");
+    }
+
+    return failed;
+}
+
+/* Sum of codec results, keeps the work from being optimized away */
+static volatile unsigned long long codecSink;
+
+/* Encode and decode sizeMb of data, return throughput in MB/s of decoded data */
+static void codec_bench(const std::string &data, unsigned long long sizeMb,
+    double *encodeMbs, double *decodeMbs)
+{
+    const unsigned long long size = sizeMb << 20;
+    std::vector<char> encoded(INBAND_ENCODED_MAX(data.size()));
+    unsigned long long sum = 0;
+
+    uint64_t start = monotonic_usec();
+    size_t encodedLen = 0;
+    for (unsigned long long done = 0; done < size; done += data.size())
+    {
+        encodedLen = inband_encode(data.data(), data.size(), encoded.data());
+        sum += encoded[encodedLen - 1];
+    }
+    *encodeMbs = sizeMb / ((monotonic_usec() - start + 1) / 1e6);
+
+    /* Runs are only summed, backend writes them to the pty */
+    InbandDecoder decoder;
+    start = monotonic_usec();
+    for (unsigned long long done = 0; done < size; done += data.size())
+    {
+        size_t pos = 0;
+        while (pos < encodedLen)
+        {
+            pos += decoder.decode(encoded.data() + pos, encodedLen - pos);
+            for (int j = 0; j < decoder.iovcnt(); j++)
+                sum += decoder.iov()[j].iov_len;
+            decoder.clearIov();
+        }
+    }
+    *decodeMbs = sizeMb / ((monotonic_usec() - start + 1) / 1e6);
+    codecSink = sum;
+}
+
+/*
+ * Check inband codec of old frontends with input split at every boundary,
+ * then measure its encode and decode speed of typed text, of a paste with
+ * some NUL characters and of binary data with many of them.
+ */
+static bool codec_main(const char *label, unsigned long long sizeMb)
+{
+    unsigned long checks;
+    const unsigned long failed = codec_check(&checks);
+    fprintf(stderr, "check %lu of %lu splits %s\n", checks - failed, checks,
+        failed ? "failed" : "passed");
+
+    std::string text, paste, binary;
+    const char line[] = "The quick brown fox jumps over the lazy dog 0123456789 abcdefgh\n";
+    while (text.size() < CODEC_CHUNK_SIZE)
+        text += line;
+    text.resize(CODEC_CHUNK_SIZE);
+    paste = text;
+    for (size_t i = 0; i < paste.size(); i += 4096)
+        paste[i] = '\0';
+    binary.resize(CODEC_CHUNK_SIZE);
+    for (size_t i = 0; i < binary.size(); i++)
+        binary[i] = i % 4 ? (char)(i * 131) : '\0';
+
+    const struct
+    {
+        const char *name;
+        const std::string &data;
+    } cases[] = {
+        { "text", text },
+        { "paste", paste },
+        { "binary", binary },
+    };
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"size_mb\": %llu,\n"
+        "  \"checks\": %lu,\n  \"failed\": %lu,\n  \"results\": [",
+        STRINGIFY(WSLBRIDGE2_VERSION), label, sizeMb, checks, failed);
+
+    const char *sep = "";
+    for (size_t i = 0; i < ARRAYSIZE(cases); i++)
+    {
+        double encodeMbs, decodeMbs;
+        codec_bench(cases[i].data, sizeMb, &encodeMbs, &decodeMbs);
+        fprintf(stderr, "%-6s encode %8.1f MB/s decode %8.1f MB/s\n", cases[i].name,
+            encodeMbs, decodeMbs);
+        printf("%s\n    { \"data\": \"%s\", \"encode_mb_per_s\": %.1f, "
+            "\"decode_mb_per_s\": %.1f }", sep, cases[i].name, encodeMbs, decodeMbs);
+        sep = ",";
+    }
+
+    printf("\n  ]\n}\n");
+    return failed == 0;
+}
+
+static void usage(const char *prog)
+{
+    printf("\nwslbridge2-bench %s : Throughput and latency benchmark of wslbridge2-backend.\n",
+        STRINGIFY(WSLBRIDGE2_VERSION));
+    printf("\n");
+    printf("Usage: %s [options] BACKEND\n", prog);
+    printf("Options:\n");
+    printf("  -b, --buffers LIST\n");
+    printf("                 Measures cat throughput and bulk echo latency at each\n");
+    printf("                 transport setting of LIST, e.g. default,65536,auto/16384.\n");
+    printf("  -c, --codec    Checks inband codec of old frontends with input split at\n");
+    printf("                 every boundary and measures its speed, needs no BACKEND.\n");
+    printf("  -e, --engines LIST\n");
+    printf("                 Measures throughput, relay syscalls and echo latency\n");
+    printf("                 with each relay engine of LIST, e.g. poll,splice.\n");
+    printf("  -h, --help     Shows this usage information.\n");
+    printf("  -k, --keys N   Keystrokes of each latency scenario (default %d).\n",
+        LATENCY_DEFAULT_KEYS);
+    printf("  -l, --label TEXT\n");
+    printf("                 Adds TEXT to results, e.g. commit of backend.\n");
+    printf("  -L, --latency  Measures keystroke echo latency instead of throughput.\n");
+    printf("  -s, --size MB  Output size of each workload (default %d).\n",
+        BENCH_DEFAULT_MB);
+    printf("  -S, --stress   Checks that a paste into a busy program and a frontend\n");
+    printf("                 that stops reading do not stop the other direction,\n");
+    printf("                 that output and status of an exit are not lost, that a\n");
+    printf("                 session keeps relaying across reattaches and that a\n");
+    printf("                 resize storm sends a bounded count of SIGWINCH, and\n");
+    printf("                 that --pipe passes input after output is closed and\n");
+    printf("                 takes the paste too.\n");
+    printf("  -t, --startup RUNS\n");
+    printf("                 Measures time from spawn of backend to its first byte of\n");
+    printf("                 output and between its connections, with three sockets\n");
+    printf("                 and with --mux (or --unix), in RUNS alternating rounds.\n");
+    printf("  -u, --unix     Connects backend through a unix socket instead of TCP.\n");
+    printf("  -w, --workload NAME\n");
+    printf("                 Runs only NAME: workload cat, yes, seq or ansi,\n");
+    printf("                 latency scenario idle, flood, bulk or cpu,\n");
+    printf("                 or stress scenario paste, stall, exit, session, resize,\n");
+    printf("                 pipe or pipein.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *label = "";
+    const char *only = nullptr;
+    const char *buffers = nullptr;
+    const char *engines = nullptr;
+    unsigned long long sizeMb = BENCH_DEFAULT_MB;
+    unsigned int keys = LATENCY_DEFAULT_KEYS;
+    unsigned int startupRuns = 0;
+    bool codecMode = false, latencyMode = false, stressMode = false;
+
+    const char shortopts[] = "+b:ce:hk:l:Ls:St:uw:";
+    const struct option longopts[] = {
+        { "buffers",  required_argument, 0, 'b' },
+        { "codec",    no_argument,       0, 'c' },
+        { "engines",  required_argument, 0, 'e' },
+        { "help",     no_argument,       0, 'h' },
+        { "keys",     required_argument, 0, 'k' },
+        { "label",    required_argument, 0, 'l' },
+        { "latency",  no_argument,       0, 'L' },
+        { "size",     required_argument, 0, 's' },
+        { "startup",  required_argument, 0, 't' },
+        { "stress",   no_argument,       0, 'S' },
+        { "unix",     no_argument,       0, 'u' },
+        { "workload", required_argument, 0, 'w' },
+        { 0,          no_argument,       0,  0  },
+    };
+
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'b': buffers = optarg; break;
+            case 'c': codecMode = true; break;
+            case 'e': engines = optarg; break;
+            case 'h': usage(argv[0]); break;
+            case 'k': keys = atoi(optarg); break;
+            case 'l': label = optarg; break;
+            case 'L': latencyMode = true; break;
+            case 's': sizeMb = strtoull(optarg, NULL, 10); break;
+            case 'S': stressMode = true; break;
+            case 't': startupRuns = atoi(optarg); break;
+            case 'u': unixTransport = true; break;
+            case 'w': only = optarg; break;
+            default:
+                fatal("Try '%s --help' for more information.\n", argv[0]);
+        }
+    }
+
+    if (codecMode && optind == argc && sizeMb)
+        return codec_main(label, sizeMb) ? 0 : 1;
+
+    if (optind != argc - 1 || sizeMb == 0 || keys == 0)
+        fatal("Try '%s --help' for more information.\n", argv[0]);
+    const char *backend = argv[optind];
+
+    /* Frontend is gone if backend fails, do not die with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (buffers)
+    {
+        buffers_main(backend, label, buffers, sizeMb, keys);
+        return 0;
+    }
+
+    if (engines)
+    {
+        engines_main(backend, label, engines, sizeMb, keys);
+        return 0;
+    }
+
+    if (startupRuns)
+    {
+        startup_main(backend, label, startupRuns);
+        return 0;
+    }
+
+    if (latencyMode)
+    {
+        latency_main(backend, label, only, keys);
+        return 0;
+    }
+
+    if (stressMode)
+        return stress_main(backend, label, only) ? 0 : 1;
+
+    const unsigned long long size = sizeMb << 20;
+    const std::string sizeArg = std::to_string(size);
+    const std::string filePath = make_file(size);
+
+    /* Colors, cursor movement and erase in every line, like a busy TUI */
+    const char ansiLine[] = "\\033[1;31mERROR\\033[0m \\033[38;5;208mwarn\\033[0m "
+        "\\033[48;2;10;20;30m rgb \\033[0m\\033[12;40H\\033[Kstatus \\033[7mbar\\033[27m";
+
+    const std::vector<Workload> workloads = {
+        { "cat", "cat '" + filePath + "'" },
+        { "yes", "yes | head -c " + sizeArg },
+        { "seq", "seq " + std::to_string(sizeMb * 100000000 / BENCH_DEFAULT_MB) },
+        { "ansi", "yes \"$(printf '" + std::string(ansiLine) + "')\" | head -c " + sizeArg },
+    };
+
+    printf("{\n  \"version\": \"%s\",\n  \"label\": \"%s\",\n  \"transport\": \"%s\",\n"
+        "  \"size_mb\": %llu,\n  \"results\": [", STRINGIFY(WSLBRIDGE2_VERSION), label,
+        unixTransport ? "unix" : "tcp", sizeMb);
+
+    const char *sep = "";
+    for (const Workload &work : workloads)
+    {
+        if (only && strcmp(only, work.name) != 0)
+            continue;
+
+        Result result;
+        if (!run_workload(backend, work, &result))
+            fatal("error: %s workload produced no output\n", work.name);
+
+        const double mb = result.bytes / 1048576.0;
+        const double seconds = result.usec / 1e6;
+        fprintf(stderr, "%-5s %8.1f MB %8.1f MB/s %8.1f syscalls/MB %6.2f ns/byte",
+            work.name, mb, mb / seconds, result.syscalls / mb,
+            result.cpuUsec * 1e3 / result.bytes);
+        if (result.cycles >= 0)
+            fprintf(stderr, " %6.2f cycles/byte", (double)result.cycles / result.bytes);
+        fprintf(stderr, "\n");
+
+        printf("%s\n    { \"workload\": \"%s\", \"bytes\": %llu, \"seconds\": %.3f, "
+            "\"mb_per_s\": %.1f, \"syscalls\": %lu, \"syscalls_per_mb\": %.1f, "
+            "\"cpu_ns_per_byte\": %.3f, ",
+            sep, work.name, result.bytes, seconds, mb / seconds,
+            result.syscalls, result.syscalls / mb, result.cpuUsec * 1e3 / result.bytes);
+        if (result.cycles >= 0)
+            printf("\"cycles_per_byte\": %.3f }", (double)result.cycles / result.bytes);
+        else
+            printf("\"cycles_per_byte\": null }");
+        sep = ",";
+    }
+
+    printf("\n  ]\n}\n");
+    unlink(filePath.c_str());
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+/*
+ * Text of binary log written by wslbridge2-backend --log. Each record is
+ * printed as a line with its wall clock time, pid of its backend and level.
+ * Sessions of a daemon append to the same log, --pid picks one of them.
+ * Log of a unix socket sink can be piped in, e.g. from socat.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "BinaryLog.hpp"
+#include "common.hpp"
+
+static const char *const level_names[] = { "debug", "info ", "warn " };
+
+static void usage(const char *prog)
+{
+    printf("\nwslbridge2-logdump %s : Text of wslbridge2-backend binary log.\n",
+        STRINGIFY(WSLBRIDGE2_VERSION));
+    printf("\n");
+    printf("Usage: %s [options] [FILE]...\n", prog);
+    printf("Reads standard input without FILE or if FILE is -.\n");
+    printf("Options:\n");
+    printf("  -h, --help     Shows this usage information.\n");
+    printf("  -l, --level debug|info|warn\n");
+    printf("                 Prints records of LEVEL and above.\n");
+    printf("  -p, --pid PID  Prints records of backend PID only.\n");
+    exit(0);
+}
+
+/* Print records of one log, return false if it is not a log of this format */
+static bool dump_log(FILE *file, const char *name, int level, unsigned int pid)
+{
+    struct LogRecord record;
+    unsigned long long count = 0;
+    while (fread(&record, sizeof record, 1, file) == 1)
+    {
+        /* Log starts with the record of its format, appended logs repeat it */
+        if (count++ == 0 && (record.event != LOG_OPENED || record.argc < 3 ||
+            record.args[0].u != LOG_VERSION || record.args[1].u != sizeof record ||
+            record.args[2].u != LOG_MAGIC))
+        {
+            fprintf(stderr, "%s: not a wslbridge2 log of version %d\n", name, LOG_VERSION);
+            return false;
+        }
+
+        if (record.level < level || (pid && record.pid != pid))
+            continue;
+
+        char text[128];
+        log_format(record, text, sizeof text);
+
+        char date[32];
+        const time_t sec = record.usec / 1000000;
+        struct tm tm;
+        strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+
+        printf("%s.%06u %u %s %s\n", date, (unsigned int)(record.usec % 1000000),
+            record.pid, record.level < ARRAYSIZE(level_names) ?
+            level_names[record.level] : "?    ", text);
+    }
+
+    if (ferror(file))
+    {
+        perror(name);
+        return false;
+    }
+
+    if (count == 0)
+    {
+        fprintf(stderr, "%s: not a wslbridge2 log of version %d\n", name, LOG_VERSION);
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int level = LOG_LEVEL_DEBUG;
+    unsigned int pid = 0;
+
+    const char shortopts[] = "+hl:p:";
+    const struct option longopts[] = {
+        { "help",  no_argument,       0, 'h' },
+        { "level", required_argument, 0, 'l' },
+        { "pid",   required_argument, 0, 'p' },
+        { 0,       no_argument,       0,  0  },
+    };
+
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'h': usage(argv[0]); break;
+            case 'l':
+                level = log_level(optarg);
+                if (level < 0)
+                    fatal("unsupported log level: %s\n", optarg);
+                break;
+            case 'p': pid = atoi(optarg); break;
+            default:
+                fatal("Try '%s --help' for more information.\n", argv[0]);
+        }
+    }
+
+    if (optind == argc)
+        return dump_log(stdin, "stdin", level, pid) ? 0 : 1;
+
+    bool valid = true;
+    for (int i = optind; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-") == 0)
+        {
+            valid = dump_log(stdin, "stdin", level, pid) && valid;
+            continue;
+        }
+
+        FILE *file = fopen(argv[i], "rb");
+        if (!file)
+        {
+            perror(argv[i]);
+            valid = false;
+            continue;
+        }
+
+        valid = dump_log(file, argv[i], level, pid) && valid;
+        fclose(file);
+    }
+
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,323 @@
+/*
+ * This file is part of wslbridge2 project.
+ * Licensed under the terms of the GNU General Public License v3 or later.
+ * Copyright (C) 2024 Biswapriyo Nath.
+ */
+
+/*
+ * Timeline of flight recorder file of wslbridge2-backend --recorder, the
+ * live file of a running or crashed backend or a dump of it. Each event
+ * is printed with its wall clock time, time since first event, value and
+ * duration. Stalls of the relay loop are marked: an event or a time with
+ * no event longer than --stall, or a wait that long for a frontend which
+ * does not take output. Summary of each event type follows.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common.hpp"
+#include "FlightRecorder.hpp"
+
+/* Default time of a stall, in milliseconds */
+#define TIMELINE_STALL_MSEC 100
+
+static const char *const record_names[RECORD_TYPES] = {
+    "wait", "input read", "pty write", "pty read", "send", "drain", "window",
+    "resize", "signal", "child exit", "attach", "detach", "dump",
+};
+
+struct TypeSummary
+{
+    unsigned long long count;
+    unsigned long long totalNsec;
+    unsigned long long maxNsec;
+};
+
+static void usage(const char *prog)
+{
+    printf("\nwslbridge2-timeline %s : Timeline of wslbridge2-backend flight recorder.\n",
+        STRINGIFY(WSLBRIDGE2_VERSION));
+    printf("\n");
+    printf("Usage: %s [options] FILE\n", prog);
+    printf("FILE is TMPDIR/wslbridge2-backend.PID.rec of a backend or a dump of it.\n");
+    printf("Options:\n");
+    printf("  -h, --help     Shows this usage information.\n");
+    printf("  -n, --last N   Prints last N events only, summary has all of them.\n");
+    printf("  -s, --stall MSEC\n");
+    printf("                 Marks events and gaps of MSEC milliseconds or longer,\n");
+    printf("                 0 disables (default %d).\n", TIMELINE_STALL_MSEC);
+    exit(0);
+}
+
+/* Value of event as text */
+static void format_value(const struct RecordEvent &event, char *out, size_t size)
+{
+    const long long value = event.value;
+    switch (event.type)
+    {
+        case RECORD_WAIT:
+            snprintf(out, size, "ready %lld%s%s%s", value & 0xFF,
+                value & RECORD_WAIT_SOCKET ? " socket-full" : "",
+                value & RECORD_WAIT_WINDOW ? " window-empty" : "",
+                value & RECORD_WAIT_PTY ? " pty-full" : "");
+            break;
+
+        case RECORD_INPUT_READ:
+        case RECORD_PTY_READ:
+            if (value < 0)
+                snprintf(out, size, "%s", strerror(-value));
+            else if (value == 0)
+                snprintf(out, size, "end of file");
+            else
+                snprintf(out, size, "%lld bytes", value);
+            break;
+
+        case RECORD_RESIZE:
+            snprintf(out, size, "%lldx%lld", value >> 16, value & 0xFFFF);
+            break;
+
+        case RECORD_SIGNAL:
+            snprintf(out, size, "%lld (%s)", value, strsignal(value));
+            break;
+
+        case RECORD_CHILD_EXIT:
+            snprintf(out, size, "status %lld", value);
+            break;
+
+        case RECORD_ATTACH:
+            snprintf(out, size, "missed %lld bytes", value);
+            break;
+
+        case RECORD_DETACH:
+            out[0] = '\0';
+            break;
+
+        case RECORD_DUMP:
+            snprintf(out, size, "number %lld", value);
+            break;
+
+        default: /* Sends of io_uring fail with -errno */
+            if (value < 0)
+                snprintf(out, size, "%s", strerror(-value));
+            else
+                snprintf(out, size, "%lld bytes", value);
+            break;
+    }
+}
+
+static void format_duration(unsigned long long nsec, char *out, size_t size)
+{
+    if (nsec < 1000)
+        snprintf(out, size, "%llu ns", nsec);
+    else if (nsec < 1000000)
+        snprintf(out, size, "%.1f us", nsec / 1e3);
+    else
+        snprintf(out, size, "%.3f ms", nsec / 1e6);
+}
+
+static void format_time(const struct RecordHeader &header, uint64_t time,
+    char *out, size_t size)
+{
+    const uint64_t wall = time + header.wallOffset;
+    const time_t sec = wall / 1000000000;
+    struct tm tm;
+    const size_t len = strftime(out, size, "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+    snprintf(out + len, size - len, ".%06u", (unsigned int)(wall % 1000000000 / 1000));
+}
+
+/* Read header and complete events ordered by start, false if it is not a recorder file */
+static bool read_recorder(const char *name, struct RecordHeader *header,
+    std::vector<struct RecordEvent> &events, unsigned long *torn)
+{
+    FILE *file = fopen(name, "rb");
+    if (!file)
+    {
+        perror(name);
+        return false;
+    }
+
+    std::vector<struct RecordEvent> slots;
+    bool valid = fread(header, sizeof *header, 1, file) == 1 &&
+                 memcmp(header->magic, RECORDER_MAGIC, sizeof header->magic) == 0 &&
+                 header->version == RECORDER_VERSION &&
+                 header->eventSize == sizeof(struct RecordEvent) &&
+                 header->capacity && header->capacity <= RECORDER_MAX_EVENTS &&
+                 (header->capacity & (header->capacity - 1)) == 0;
+    if (valid)
+    {
+        slots.resize(header->capacity);
+        valid = fread(slots.data(), sizeof slots[0], slots.size(), file) == slots.size();
+    }
+    fclose(file);
+
+    if (!valid)
+    {
+        fprintf(stderr, "%s: not a wslbridge2 flight recorder of version %d\n",
+            name, RECORDER_VERSION);
+        return false;
+    }
+
+    /* Slot of an event follows from its seq, a torn event does not match it */
+    const uint64_t mask = header->capacity - 1;
+    uint64_t last = 0;
+    *torn = 0;
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        const struct RecordEvent &event = slots[i];
+        if (event.seq && (event.check != (uint16_t)event.seq ||
+            ((event.seq - 1) & mask) != i || event.type >= RECORD_TYPES))
+            (*torn)++;
+        else if (event.seq)
+        {
+            events.push_back(event);
+            last = std::max(last, event.seq);
+        }
+    }
+
+    /* Slot written while it was copied is in the copy as the event it replaced */
+    events.erase(std::remove_if(events.begin(), events.end(),
+        [last, header](const struct RecordEvent &event)
+        { return event.seq + header->capacity <= last; }), events.end());
+
+    /* Events during another one, e.g. a signal in decoded input, are recorded before it ends */
+    std::sort(events.begin(), events.end(),
+        [](const struct RecordEvent &a, const struct RecordEvent &b)
+        { return a.time != b.time ? a.time < b.time : a.seq < b.seq; });
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int stallMsec = TIMELINE_STALL_MSEC;
+    size_t lastEvents = 0;
+
+    const char shortopts[] = "+hn:s:";
+    const struct option longopts[] = {
+        { "help",  no_argument,       0, 'h' },
+        { "last",  required_argument, 0, 'n' },
+        { "stall", required_argument, 0, 's' },
+        { 0,       no_argument,       0,  0  },
+    };
+
+    int ch = 0;
+    while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+    {
+        switch (ch)
+        {
+            case 'h': usage(argv[0]); break;
+            case 'n': lastEvents = atoi(optarg); break;
+            case 's': stallMsec = atoi(optarg); break;
+            default:
+                fatal("Try '%s --help' for more information.\n", argv[0]);
+        }
+    }
+
+    if (optind + 1 != argc)
+        fatal("Try '%s --help' for more information.\n", argv[0]);
+
+    struct RecordHeader header;
+    std::vector<struct RecordEvent> events;
+    unsigned long torn;
+    if (!read_recorder(argv[optind], &header, events, &torn))
+        return 1;
+
+    char date[64];
+    format_time(header, events.empty() ? header.startTime : events.front().time,
+        date, sizeof date);
+    printf("backend pid: %u child pid: %u events: %zu of %u torn: %lu from %s\n",
+        header.pid, header.child, events.size(), header.capacity, torn, date);
+    if (events.empty())
+        return 0;
+
+    const unsigned long long stallNsec = stallMsec * 1000000ULL;
+    struct TypeSummary summary[RECORD_TYPES] = {};
+    unsigned long stalls = 0;
+    unsigned long long longestStall = 0;
+    const uint64_t first = events.front().time;
+    uint64_t busyUntil = first;
+    const size_t printFrom = lastEvents && lastEvents < events.size() ?
+                             events.size() - lastEvents : 0;
+
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        const struct RecordEvent &event = events[i];
+
+        /*
+         * Duration of a long wait is cut, next event shows when it ended.
+         * Last one may not have ended, a dump knows how long it lasted.
+         */
+        const bool unfinished = event.duration == UINT32_MAX && i + 1 == events.size();
+        unsigned long long duration = event.duration;
+        if (event.duration == UINT32_MAX && !unfinished)
+            duration = events[i + 1].time - event.time;
+        else if (unfinished)
+            duration = header.dumpTime > event.time ? header.dumpTime - event.time : 0;
+
+        struct TypeSummary &type = summary[event.type];
+        type.count++;
+        type.totalNsec += duration;
+        type.maxNsec = std::max(type.maxNsec, duration);
+
+        /* Loop did something it does not record, or did not run */
+        const unsigned long long gap = event.time > busyUntil ? event.time - busyUntil : 0;
+        if (stallNsec && gap >= stallNsec)
+        {
+            stalls++;
+            longestStall = std::max(longestStall, gap);
+            if (i >= printFrom)
+                printf("%*s--- %.3f ms without events <-- stall\n", 38, "", gap / 1e6);
+        }
+        busyUntil = std::max<uint64_t>(busyUntil, event.time + duration);
+
+        /* Idle wait is no stall, a wait for the frontend to take output is */
+        const bool stalled = stallNsec && duration >= stallNsec &&
+            (event.type != RECORD_WAIT ||
+             (event.value & (RECORD_WAIT_SOCKET | RECORD_WAIT_WINDOW)));
+        if (stalled)
+        {
+            stalls++;
+            longestStall = std::max(longestStall, duration);
+        }
+
+        if (i < printFrom)
+            continue;
+
+        char value[64];
+        format_time(header, event.time, date, sizeof date);
+        format_value(event, value, sizeof value);
+        printf("%s %10.3f  %-10s", date + 11, (event.time - first) / 1e6,
+            record_names[event.type]);
+
+        /* Marks have no duration, waits always have one */
+        if (duration || event.type == RECORD_WAIT || unfinished)
+        {
+            char length[32] = "unfinished";
+            if (duration)
+                format_duration(duration, length, sizeof length);
+            printf(" %-32s %10s%s%s\n", value, length, unfinished && duration ?
+                " until dump" : "", stalled ? " <-- stall" : "");
+        }
+        else
+            printf(" %s\n", value);
+    }
+
+    const double span = (events.back().time - first) / 1e6;
+    printf("\n%zu events in %.3f ms, stalls: %lu longest: %.3f ms\n",
+        events.size(), span, stalls, longestStall / 1e6);
+    for (size_t i = 0; i < RECORD_TYPES; i++)
+    {
+        const struct TypeSummary &type = summary[i];
+        if (type.count)
+            printf("  %-10s %8llu  total: %10.3f ms  max: %10.3f ms\n", record_names[i],
+                type.count, type.totalNsec / 1e6, type.maxNsec / 1e6);
+    }
+
+    return 0;
+}
@@ -7,6 +7,8 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
@@ -17,14 +19,20 @@
 #include <unistd.h>
 
 #include <array>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "common.hpp"
+#include "DeflateStream.hpp"
 #include "GetVmId.hpp"
 #include "Helpers.hpp"
 #include "Environment.hpp"
+#include "FrameCodec.hpp"
+#include "InbandCodec.hpp"
+#include "StartupTrace.hpp"
 #include "TerminalState.hpp"
 #include "windows-sock.h"
 
@@ -42,11 +50,133 @@ union IoSockets
 
 /* global variable */
 static volatile union IoSockets g_ioSockets = { 0 };
+static StartupTrace g_trace("wslbridge2");
+
+/* Command runs with pipes instead of pty */
+static bool g_pipeMode = false;
+
+/* Exit status of command, backend sends it after the last output */
+static volatile int g_exitStatus = 0;
 
 #define dont_debug_inband
 #define dont_use_controlsocket
+#define use_frames
+#define use_mux /* requires use_frames */
+
+/* Input socket is written by input thread, by output thread and by main thread. */
+static std::mutex g_inputMutex;
+
+/*
+ * Signal handlers only queue the signal number in this pipe, main thread
+ * reads it and sends the frames, a handler may not take the lock above.
+ * Output thread sets the flag and queues 0 when backend closed output.
+ */
+static int g_signalPipe[2] = { -1, -1 };
+static volatile sig_atomic_t g_outputDone = 0;
+
+/* Send whole buffer to input socket, return false if socket is broken. */
+static bool send_input(const char *buf, size_t len)
+{
+    std::lock_guard<std::mutex> lock(g_inputMutex);
+
+    while (len > 0)
+    {
+        const int ret = send(g_ioSockets.inputSock, buf, len, 0);
+        if (ret <= 0)
+            return false;
+        buf += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+#ifdef use_mux
+/* Input data backend can accept, granted with window frames */
+static std::mutex g_windowMutex;
+static std::condition_variable g_windowCond;
+static long long g_inputWindow = FRAME_WINDOW_INITIAL;
+static bool g_outputClosed = false;
+
+static void wait_input_window(size_t len)
+{
+    std::unique_lock<std::mutex> lock(g_windowMutex);
+    g_windowCond.wait(lock, [len]
+        { return g_inputWindow >= (long long)len || g_outputClosed; });
+    g_inputWindow -= len;
+}
+
+/* Print relay counters of backend, terminal is in raw mode */
+static void print_stats(const char *payload, size_t len)
+{
+    unsigned long long stat[STAT_BULK_USEC + 1] = {};
+    for (size_t i = 0; i + FRAME_STAT_LEN <= len; i += FRAME_STAT_LEN)
+    {
+        const uint8_t id = payload[i];
+        if (id < ARRAYSIZE(stat))
+            stat[id] = frame_get_u64(payload + i + 1);
+    }
+
+    /* Average bytes moved by each syscall */
+    auto avg = [](unsigned long long bytes, unsigned long long calls)
+        { return calls ? (double)bytes / calls : 0.0; };
+
+    fprintf(stderr, "\r\nwslbridge2 stats: uptime: %.1f s bytes in: %llu out: %llu\r\n",
+        stat[STAT_UPTIME_USEC] / 1e6, stat[STAT_BYTES_IN], stat[STAT_BYTES_OUT]);
+    fprintf(stderr, "  input reads: %llu (%.0f B) pty reads: %llu (%.0f B) "
+        "socket sends: %llu (%.0f B)\r\n",
+        stat[STAT_INPUT_READS], avg(stat[STAT_BYTES_IN], stat[STAT_INPUT_READS]),
+        stat[STAT_PTY_READS], avg(stat[STAT_BYTES_OUT], stat[STAT_PTY_READS]),
+        stat[STAT_SOCKET_SENDS], avg(stat[STAT_BYTES_OUT], stat[STAT_SOCKET_SENDS]));
+    fprintf(stderr, "  poll wakeups: %llu send blocked: %.1f ms resizes: %llu\r\n",
+        stat[STAT_POLL_WAKEUPS], stat[STAT_SEND_USEC] / 1e3, stat[STAT_RESIZES]);
+    fprintf(stderr, "  output mode switches: %llu bulk: %.1f ms\r\n",
+        stat[STAT_MODE_SWITCHES], stat[STAT_BULK_USEC] / 1e3);
+}
 
-static void resize_window(int signum)
+static void handle_output_frame(uint8_t type, uint8_t channel,
+    const char *payload, size_t len, void *ctx)
+{
+    if (type == FRAME_WINDOW && channel == CHANNEL_TERMINAL && len == 4)
+    {
+        std::lock_guard<std::mutex> lock(g_windowMutex);
+        g_inputWindow += frame_get_u32(payload);
+        g_windowCond.notify_all();
+    }
+    else if (type == FRAME_STATS && channel == CHANNEL_CONTROL)
+        print_stats(payload, len);
+    else if (type == FRAME_RECORDER && channel == CHANNEL_CONTROL)
+    {
+        if (len)
+            fprintf(stderr, "\r\nwslbridge2 flight recorder: %.*s\r\n", (int)len, payload);
+        else
+            fprintf(stderr, "\r\nwslbridge2 flight recorder is off\r\n");
+    }
+    else if (type == FRAME_DATA && channel == CHANNEL_STDERR)
+    {
+        if (write(STDERR_FILENO, payload, len) < 0)
+            perror("write");
+    }
+    else if (type == FRAME_EXIT && channel == CHANNEL_CONTROL && len == 4)
+        g_exitStatus = frame_get_u32(payload);
+}
+
+/* Ask backend for its counters, output thread prints them */
+static void request_stats(void)
+{
+    char frame[FRAME_HEADER_LEN];
+    send_input(frame, frame_encode_header(frame, FRAME_STATS, 0, CHANNEL_CONTROL));
+}
+
+/* Ask backend to dump its flight recorder, output thread prints its path */
+static void request_recorder(void)
+{
+    char frame[FRAME_HEADER_LEN];
+    send_input(frame, frame_encode_header(frame, FRAME_RECORDER, 0, CHANNEL_CONTROL));
+}
+#endif
+
+static void resize_window(void)
 {
 #ifdef use_controlsocket
 #warning this may crash for unknown reason, maybe terminate the backend
@@ -56,64 +186,129 @@ static void resize_window(int signum)
     /* Send terminal window size to control socket */
     send(g_ioSockets.controlSock, (char *)&winp, sizeof winp, 0);
 #else
-    static char wins[2 + sizeof(struct winsize)] = {0, 16};
-    static struct winsize * winsp = (struct winsize *)&wins[2];
-    ioctl(STDIN_FILENO, TIOCGWINSZ, winsp);
+    struct winsize winp;
+    ioctl(STDIN_FILENO, TIOCGWINSZ, &winp);
 
-#ifdef debug_inband
+#if defined(use_frames)
+    /* Send terminal window size as resize frame */
+    char frame[FRAME_HEADER_LEN + sizeof winp];
+    send_input(frame, frame_encode(frame, FRAME_RESIZE, &winp, sizeof winp));
+#elif defined(debug_inband)
     /* Send terminal window size inband, visualized as ESC sequence */
     char resizesc[55];
     //sprintf(resizesc, "\e_8;%u;%u\a", winsp->ws_row, winsp->ws_col);
-    sprintf(resizesc, "^[_8;%u;%u^G", winsp->ws_row, winsp->ws_col);
-    send(g_ioSockets.inputSock, resizesc, strlen(resizesc), 0);
+    sprintf(resizesc, "^[_8;%u;%u^G", winp.ws_row, winp.ws_col);
+    send_input(resizesc, strlen(resizesc));
 #else
     /* Send terminal window size inband, with NUL escape */
-    send(g_ioSockets.inputSock, wins, sizeof wins, 0);
+    char wins[2 + INBAND_WINSIZE_LEN];
+    send_input(wins, inband_encode_winsize(&winp, wins));
+#endif
+#endif
+}
+
+#ifdef use_frames
+/* Forward signals sent to frontend to foreground process in WSL */
+static void forward_signal(int signum)
+{
+    const char sig = signum;
+    char frame[FRAME_HEADER_LEN + 1];
+    send_input(frame, frame_encode(frame, FRAME_SIGNAL, &sig, 1));
+}
 #endif
+
+/* Handler of all relayed signals, write() is async signal safe */
+static void queue_signal(int signum)
+{
+    const int savedErrno = errno;
+    const char sig = signum;
+
+    /* Full pipe already wakes main thread, a resize is sent once anyway */
+    const ssize_t ret = write(g_signalPipe[1], &sig, 1);
+    (void)ret;
+    errno = savedErrno;
+}
+
+/* Send frames of queued signals in main thread until output thread is done */
+static void relay_signals(void)
+{
+    char sigs[64];
+
+    while (!g_outputDone)
+    {
+        const ssize_t ret = read(g_signalPipe[0], sigs, sizeof sigs);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+
+        /* Window size is read when it is sent, a storm of resizes sends it once */
+        bool resized = false;
+        for (ssize_t i = 0; i < ret; i++)
+        {
+            switch (sigs[i])
+            {
+                case SIGWINCH: resized = true; break;
+#ifdef use_frames
+                case SIGINT:
+                case SIGQUIT: forward_signal(sigs[i]); break;
 #endif
+#ifdef use_mux
+                case SIGUSR1: request_stats(); break;
+                case SIGUSR2: request_recorder(); break;
+#endif
+                default: break;
+            }
+        }
+
+        if (resized)
+            resize_window();
+    }
 }
 
 static void* send_buffer(void *param)
 {
     int ret;
+#ifdef use_frames
+    /* Terminal input is read after frame header and sent in one piece */
+    static char frame[FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX];
+    char *data = frame + FRAME_HEADER_LEN;
+
+    /* Bulk input of pipe mode is read in whole frames */
+    const size_t size = g_pipeMode ? FRAME_PAYLOAD_MAX : 1024;
+#else
     char data[1024];
-    assert(sizeof data <= PIPE_BUF);
+    char encoded[INBAND_ENCODED_MAX(sizeof data)];
+    const size_t size = sizeof data;
+#endif
+    assert(g_pipeMode || size <= PIPE_BUF);
 
     while (1)
     {
-        ret = read(STDIN_FILENO, data, sizeof data);
+        ret = read(STDIN_FILENO, data, size);
         if (ret < 0)
         {
             closesocket(g_ioSockets.inputSock);
             break;
         }
-            char * s = data;
-            int len = ret;
-            while (ret > 0 && len > 0)
-            {
-                if (!*s)
-                {
-                    // send NUL STX
-#ifdef debug_inband
-                    ret = send(g_ioSockets.inputSock, (void*)"nul", 3, 0);
+
+#ifdef use_frames
+        if (ret == 0)
+        {
+            const char control = CONTROL_EOF;
+            send_input(frame, frame_encode(frame, FRAME_CONTROL, &control, 1));
+            break;
+        }
+
+#ifdef use_mux
+        wait_input_window(ret);
+#endif
+        frame_encode_header(frame, FRAME_DATA, ret);
+        send_input(frame, FRAME_HEADER_LEN + ret);
 #else
-                    static char NUL_STX[] = {0, 2};
-                    ret = send(g_ioSockets.inputSock, NUL_STX, 2, 0);
+        /* Escape NUL characters and send whole buffer at once */
+        send_input(encoded, inband_encode(data, ret, encoded));
 #endif
-                    s++;
-                    len--;
-                }
-                else
-                {
-                    int n = strnlen(s, len);
-                    ret = send(g_ioSockets.inputSock, s, n, 0);
-                    if (ret > 0)
-                    {
-                        s += ret;
-                        len -= ret;
-                    }
-                }
-            }
     }
 
     pthread_exit(&ret);
@@ -123,20 +318,67 @@ static void* send_buffer(void *param)
 static void* receive_buffer(void *param)
 {
     int ret;
-    char data[1024];
+    static char data[FRAME_HEADER_LEN + FRAME_PAYLOAD_MAX];
+    const size_t size = g_pipeMode ? sizeof data : 1024;
+#ifdef use_mux
+    FrameDecoder decoder;
+    Inflater inflater;
+    unsigned long long granted = 0;
+#endif
 
     while (1)
     {
-        ret = recv(g_ioSockets.outputSock, data, sizeof data, 0);
+        ret = recv(g_ioSockets.outputSock, data, size, 0);
         if (ret <= 0)
             break;
 
+#ifdef use_mux
+        if (!frame_decode_to(decoder, data, ret, STDOUT_FILENO,
+                handle_output_frame, nullptr, &inflater))
+        {
+            shutdown(g_ioSockets.outputSock, SD_BOTH);
+            break;
+        }
+
+        /* Let backend send more output when half window is written */
+        const unsigned long long written = decoder.dataBytes() - granted;
+        if (written >= FRAME_WINDOW_INITIAL / 2)
+        {
+            char frame[FRAME_HEADER_LEN + 4];
+            send_input(frame, frame_encode_window(frame, written));
+            granted += written;
+        }
+#else
         if(!write(STDOUT_FILENO, data, ret))
         {
             shutdown(g_ioSockets.outputSock, SD_BOTH);
             break;
         }
+#endif
+
+        /* Main thread is done with trace once session runs */
+        if (g_trace.enabled())
+        {
+            g_trace.end();
+            g_trace.instant("first output byte");
+            g_trace.write();
+        }
+    }
+
+#ifdef use_mux
+    /* Wake up input thread waiting for window */
+    {
+        std::lock_guard<std::mutex> lock(g_windowMutex);
+        g_outputClosed = true;
+        g_windowCond.notify_all();
     }
+#endif
+
+    /* Wake up main thread, a full pipe wakes it too and it sees the flag */
+    g_outputDone = 1;
+    const char done = 0;
+    if (write(g_signalPipe[1], &done, 1) < 0 && errno != EAGAIN)
+        perror("write");
 
     pthread_exit(&ret);
     return nullptr;
@@ -164,21 +406,52 @@ static void usage(const char *prog)
     printf("\n");
     printf("Usage: %s [options] [--] [command]...\n", prog);
     printf("Options:\n");
+    printf("  -a, --session NAME\n");
+    printf("                Keeps session NAME running when terminal closes, next one\n");
+    printf("                with NAME shows its screen and continues it.\n");
     printf("  -b, --backend BACKEND\n");
     printf("                Overrides the default path of wslbridge2-backend to BACKEND.\n");
+    printf("  -B, --buffer SIZE|auto\n");
+    printf("                Sets connection buffers in WSL to SIZE bytes, auto sizes\n");
+    printf("                them for bulk or interactive output.\n");
     printf("  -d, --distribution Distribution Name\n");
     printf("                Run the specified distribution.\n");
+    printf("  -D, --daemon  Starts session from a backend daemon, launches it if needed.\n");
+    printf("                Not used with --user or --windir.\n");
     printf("  -e VAR        Copies VAR into the WSL environment.\n");
     printf("  -e VAR=VAL    Sets VAR to VAL in the WSL environment.\n");
+    printf("  -E, --engine poll|uring|splice\n");
+    printf("                Relays pty in WSL with poll, with io_uring or with splice\n");
+    printf("                of output, falls back to poll if WSL kernel does not allow it.\n");
+    printf("  -g, --log FILE\n");
+    printf("                Backend writes its log to FILE in WSL as binary records,\n");
+    printf("                wslbridge2-logdump prints them.\n");
     printf("  -h, --help    Show this usage information.\n");
     printf("  -l, --login   Start a login shell.\n");
+    printf("  -N, --notsent-lowat BYTES\n");
+    printf("                Keeps at most BYTES unsent in WSL1 connection.\n");
+    printf("  -p, --pipe    Connects command to pipes instead of pty, for scripts.\n");
+    printf("                Output is binary safe and exit status is returned.\n");
+    printf("  -r, --reverse Backend listens on a free port and frontend connects to it.\n");
+    printf("                Not used with --show.\n");
+    printf("  -R, --resize MSEC\n");
+    printf("                Applies window resizes at most once per MSEC milliseconds.\n");
     printf("  -s, --show    Shows hidden backend window and debug output.\n");
+    printf("  -S, --screen FPS\n");
+    printf("                Sends screen updates at most FPS times per second\n");
+    printf("                instead of output floods.\n");
+    printf("  -T, --trace-startup FILE\n");
+    printf("                Writes startup phases to FILE as Chrome trace JSON.\n");
     printf("  -u, --user    WSL User Name\n");
     printf("                Run as the specified user.\n");
+    printf("  -U, --unix    Connects WSL1 backend with a unix socket instead of TCP.\n");
+    printf("                Not used with --reverse.\n");
     printf("  -w, --windir  Folder\n");
     printf("                Changes the working directory to Windows style path.\n");
     printf("  -W, --wsldir  Folder\n");
     printf("                Changes the working directory to Unix style path.\n");
+    printf("  -z, --compress LEVEL\n");
+    printf("                Compresses bulk output with deflate LEVEL 1-9.\n");
 
     exit(0);
 }
@@ -228,8 +501,288 @@ static void start_dummy(std::wstring wslPath, std::wstring wslCmdLine,
     CloseHandle(pi.hThread);
 }
 
+#ifdef use_mux
+/* Shells kept started by daemon for next sessions */
+#define DAEMON_POOL_SIZE 2
+
+/* Port of daemon of a distribution, they may share a VM or localhost */
+static unsigned int daemon_port(const std::string &distroName)
+{
+    if (distroName.empty())
+        return DAEMON_DEFAULT_PORT;
+
+    unsigned int hash = 2166136261U; /* FNV-1a */
+    for (const unsigned char ch : distroName)
+        hash = (hash ^ ch) * 16777619U;
+
+    return DAEMON_DEFAULT_PORT + 1 + hash % 1024;
+}
+
+/* Token of daemon is kept in a file readable only by user */
+static std::string daemon_token_path(const std::string &distroName)
+{
+    const char *home = getenv("HOME");
+    std::string path = home ? home : "/tmp";
+    path.append("/.wslbridge2-daemon");
+    if (!distroName.empty())
+    {
+        path.push_back('-');
+        path.append(distroName);
+    }
+
+    return path;
+}
+
+static std::string read_token(const std::string &path)
+{
+    char buf[64];
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return "";
+
+    const ssize_t ret = read(fd, buf, sizeof buf);
+    close(fd);
+    return ret > 0 ? std::string(buf, ret) : "";
+}
+
+static std::string new_token(const std::string &path)
+{
+    unsigned char random[16];
+    const int rfd = open("/dev/urandom", O_RDONLY);
+    if (rfd < 0 || read(rfd, random, sizeof random) != sizeof random)
+        fatalPerror("/dev/urandom");
+    close(rfd);
+
+    char token[2 * sizeof random + 1];
+    for (size_t i = 0; i < sizeof random; i++)
+        sprintf(&token[2 * i], "%02x", random[i]);
+
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, token, strlen(token)) != (ssize_t)strlen(token))
+        fatalPerror(path.c_str());
+    close(fd);
+
+    return token;
+}
+
+/* Setup frame with token and backend options, NUL terminated */
+static std::string daemon_setup(const std::string &token,
+    const std::vector<std::wstring> &args)
+{
+    std::string payload = token;
+    payload.push_back('\0');
+    for (const std::wstring &arg : args)
+    {
+        payload.append(wcsToMbs(arg));
+        payload.push_back('\0');
+    }
+
+    if (payload.size() > FRAME_PAYLOAD_MAX)
+        fatal("error: arguments are too long for daemon session\n");
+
+    std::string setup(FRAME_HEADER_LEN, '\0');
+    frame_encode_header(&setup[0], FRAME_SETUP, payload.size(), CHANNEL_CONTROL);
+    return setup + payload;
+}
+
+/* Connect to daemon and send setup, return INVALID_SOCKET if it is not running */
+static SOCKET connect_daemon(const bool wslTwo, GUID *DistroId,
+    const int LiftedWSLVersion, const unsigned int port, const std::string &setup)
+{
+    SOCKET sock;
+    if (wslTwo)
+    {
+        GUID VmId;
+        if (GetVmId(DistroId, &VmId, LiftedWSLVersion) != 0)
+            return INVALID_SOCKET;
+        sock = win_vsock_connect(&VmId, port);
+    }
+    else
+        sock = win_local_connect(port);
+
+    if (sock != INVALID_SOCKET &&
+        send(sock, setup.data(), setup.size(), 0) != (int)setup.size())
+    {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+/* Launch backend daemon in background, it keeps running after this session */
+static void start_daemon(std::wstring wslPath, std::wstring backendExec,
+    std::string distroName, const std::string &token, const unsigned int port,
+    const std::vector<std::wstring> &daemonArgs, const bool debugMode)
+{
+    std::wstring cmdLine;
+    cmdLine.append(L"\"");
+    cmdLine.append(wslPath);
+    cmdLine.append(L"\"");
+
+    if (!distroName.empty())
+    {
+        cmdLine.append(L" -d ");
+        cmdLine.append(mbsToWcs(distroName));
+    }
+
+    appendWslArg(backendExec, L"--daemon");
+    appendWslArg(backendExec, std::to_wstring(port));
+    appendWslArg(backendExec, L"--pool");
+    appendWslArg(backendExec, WSTRINGIFY(DAEMON_POOL_SIZE));
+
+    /* Warm shells run what this session runs */
+    for (const std::wstring &arg : daemonArgs)
+        appendWslArg(backendExec, arg);
+    cmdLine.append(L" /bin/sh -c");
+    appendWslArg(cmdLine, backendExec);
+
+    if (debugMode)
+        wprintf(L"Daemon CommandLine: %ls\n", &cmdLine[0]);
+
+    /* Token goes through environment, command line is visible to everyone */
+    const std::wstring tokenEnv = mbsToWcs(DAEMON_TOKEN_ENV);
+    std::wstring wslEnv(4096, L'\0');
+    const DWORD len = GetEnvironmentVariableW(L"WSLENV", &wslEnv[0], wslEnv.size());
+    wslEnv.resize(len < wslEnv.size() ? len : 0);
+    SetEnvironmentVariableW(L"WSLENV",
+        (wslEnv.empty() ? tokenEnv : wslEnv + L":" + tokenEnv).c_str());
+    SetEnvironmentVariableW(tokenEnv.c_str(), mbsToWcs(token).c_str());
+
+    PROCESS_INFORMATION pi = {};
+    STARTUPINFOW si = {};
+    si.cb = sizeof si;
+    const DWORD flags = CREATE_NEW_PROCESS_GROUP |
+                        (debugMode ? CREATE_NEW_CONSOLE : CREATE_NO_WINDOW);
+
+    /* Leave job of terminal if allowed, closing terminal kills its job */
+    if (CreateProcessW(wslPath.c_str(), &cmdLine[0], NULL, NULL, FALSE,
+            flags | CREATE_BREAKAWAY_FROM_JOB, NULL, NULL, &si, &pi) == FALSE &&
+        CreateProcessW(wslPath.c_str(), &cmdLine[0], NULL, NULL, FALSE,
+            flags, NULL, NULL, &si, &pi) == FALSE)
+    {
+        LOG_WIN32_ERROR("CreateProcessW");
+    }
+
+    SetEnvironmentVariableW(tokenEnv.c_str(), NULL);
+    SetEnvironmentVariableW(L"WSLENV", wslEnv.empty() ? NULL : wslEnv.c_str());
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+}
+#endif
+
+#ifdef use_mux
+/* Read backend output until it reports its port, 0 if it exits before */
+static unsigned int read_accept_port(HANDLE rh)
+{
+    std::string out;
+    char buf[256];
+    DWORD len;
+    while (ReadFile(rh, buf, sizeof buf, &len, nullptr) && len > 0)
+    {
+        out.append(buf, len);
+        const size_t pos = out.find(ACCEPT_PORT_LINE);
+        if (pos != std::string::npos && out.find('\n', pos) != std::string::npos)
+            return atoi(out.c_str() + pos + strlen(ACCEPT_PORT_LINE));
+    }
+
+    return 0;
+}
+#endif
+
+/* Relay terminal and sockets until backend closes output */
+static void run_session(TerminalState &termState)
+{
+    int ret;
+
+    /* Handlers of signals queue them for main thread, see relay_signals() */
+    if (pipe(g_signalPipe) != 0)
+        fatalPerror("pipe");
+    fcntl(g_signalPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(g_signalPipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(g_signalPipe[1], F_SETFL, O_NONBLOCK);
+
+    /* Signals sending to input socket are handled only in main thread */
+    sigset_t inputSignals, oldSignals;
+    sigemptyset(&inputSignals);
+    sigaddset(&inputSignals, SIGWINCH);
+    sigaddset(&inputSignals, SIGINT);
+    sigaddset(&inputSignals, SIGQUIT);
+    sigaddset(&inputSignals, SIGUSR1);
+    sigaddset(&inputSignals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &inputSignals, &oldSignals);
+
+    /* Create thread to send input buffer to input socket */
+    pthread_t tidInput;
+    ret = pthread_create(&tidInput, nullptr, send_buffer, nullptr);
+    assert(ret == 0);
+
+    /* Create thread to send input buffer to input socket */
+    pthread_t tidOutput;
+    ret = pthread_create(&tidOutput, nullptr, receive_buffer, nullptr);
+    assert(ret == 0);
+
+    pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+
+    /* Pipes have no window, console keeps its mode for the whole run */
+    struct sigaction act = {};
+    act.sa_flags = SA_RESTART;
+    act.sa_mask = inputSignals;
+    if (!g_pipeMode)
+    {
+        termState.enterRawMode();
+
+        /* Main thread sends window size when it changes */
+        act.sa_handler = queue_signal;
+        ret = sigaction(SIGWINCH, &act, NULL);
+        assert(ret == 0);
+    }
+
+#ifdef use_frames
+    act.sa_handler = queue_signal;
+    ret = sigaction(SIGINT, &act, NULL);
+    assert(ret == 0);
+    ret = sigaction(SIGQUIT, &act, NULL);
+    assert(ret == 0);
+#endif
+
+#ifdef use_mux
+    act.sa_handler = queue_signal;
+    ret = sigaction(SIGUSR1, &act, NULL);
+    assert(ret == 0);
+    ret = sigaction(SIGUSR2, &act, NULL);
+    assert(ret == 0);
+#endif
+
+    /* Notify initial size in case it's changed since starting */
+    //resize_window(0);
+    if (!g_pipeMode)
+        kill(getpid(), SIGWINCH);
+
+    /* Frames of signals are sent here until backend closes output */
+    relay_signals();
+
+    /*
+     * wsltty#254: WORKAROUND: Terminates input thread forcefully
+     * when output thread exits. Need some inter-thread syncing.
+     */
+    pthread_join(tidOutput, nullptr);
+    pthread_kill(tidInput, 0);
+    // pthread_join(tidInput, nullptr);
+
+    /* Close connection with backend */
+#ifdef use_mux
+    closesocket(g_ioSockets.inputSock);
+#else
+    for (size_t i = 0; i < ARRAYSIZE(g_ioSockets.sock); i++)
+        closesocket(g_ioSockets.sock[i]);
+#endif
+}
+
 int main(int argc, char *argv[])
 {
+    const uint64_t mainTime = StartupTrace::now();
+
     /* Minimum requirement Windows 10 build 17763 aka. version 1809 */
     if (GetWindowsBuild() < 17763)
         fatal("Windows 10 version is older than minimal requirement.\n");
@@ -251,18 +804,31 @@ int main(int argc, char *argv[])
     }
 
     int ret;
-    const char shortopts[] = "+b:d:e:hlsu:V:w:W:";
+    const char shortopts[] = "+a:b:B:d:De:E:g:hlN:prR:sS:T:u:UV:w:W:z:";
     const struct option longopts[] = {
         { "backend",       required_argument, 0, 'b' },
+        { "buffer",        required_argument, 0, 'B' },
         { "distribution",  required_argument, 0, 'd' },
+        { "daemon",        no_argument,       0, 'D' },
         { "env",           required_argument, 0, 'e' },
+        { "engine",        required_argument, 0, 'E' },
         { "help",          no_argument,       0, 'h' },
+        { "log",           required_argument, 0, 'g' },
         { "login",         no_argument,       0, 'l' },
+        { "notsent-lowat", required_argument, 0, 'N' },
+        { "pipe",          no_argument,       0, 'p' },
+        { "reverse",       no_argument,       0, 'r' },
+        { "resize",        required_argument, 0, 'R' },
         { "show",          required_argument, 0, 's' },
+        { "screen",        required_argument, 0, 'S' },
+        { "session",       required_argument, 0, 'a' },
+        { "trace-startup", required_argument, 0, 'T' },
         { "user",          required_argument, 0, 'u' },
+        { "unix",          no_argument,       0, 'U' },
         { "wslver",        required_argument, 0, 'V' },
         { "windir",        required_argument, 0, 'w' },
         { "wsldir",        required_argument, 0, 'W' },
+        { "compress",      required_argument, 0, 'z' },
         { 0,               no_argument,       0,  0  },
     };
 
@@ -270,7 +836,11 @@ int main(int argc, char *argv[])
     class TerminalState termState;
     std::string distroName, customBackendPath;
     std::string winDir, wslDir, userName;
-    volatile bool debugMode = false, loginMode = false;
+    volatile bool debugMode = false, loginMode = false, daemonMode = false;
+    bool reverseMode = false, unixMode = false;
+    int compressLevel = 0;
+    std::string screenFps, resizeMsec, tracePath, sessionName;
+    std::string bufferSize, notsentLowat, engineName, logPath;
 
     if (argv[0][0] == '-')
         loginMode = true;
@@ -284,12 +854,24 @@ int main(int argc, char *argv[])
                 /* Ignore long option. */
                 break;
 
+            case 'a':
+                sessionName = optarg;
+                if (sessionName.empty())
+                    invalid_arg("session");
+                break;
+
             case 'b':
                 customBackendPath = optarg;
                 if (customBackendPath.empty())
                     invalid_arg("backend");
                 break;
 
+            case 'B':
+                bufferSize = optarg;
+                if (bufferSize != "auto" && atoi(optarg) <= 0)
+                    fatal("error: the buffer option requires a size or auto\n");
+                break;
+
             case 'd':
                 distroName = optarg;
                 if (distroName.empty())
@@ -312,16 +894,56 @@ int main(int argc, char *argv[])
                 break;
             }
 
+            case 'E':
+                engineName = optarg;
+                if (engineName != "poll" && engineName != "uring" && engineName != "splice")
+                    fatal("error: the engine option requires poll, uring or splice\n");
+                break;
+
+            case 'D': daemonMode = true; break;
+            case 'g':
+                logPath = optarg;
+                if (logPath.empty())
+                    invalid_arg("log");
+                break;
             case 'h': usage(argv[0]); break;
             case 'l': loginMode = true; break;
+
+            case 'N':
+                notsentLowat = optarg;
+                if (atoi(optarg) <= 0)
+                    fatal("error: the notsent-lowat option requires a positive size\n");
+                break;
+
+            case 'p': g_pipeMode = true; break;
+            case 'r': reverseMode = true; break;
             case 's': debugMode = true; break;
 
+            case 'R':
+                resizeMsec = optarg;
+                if (resizeMsec.empty() || atoi(optarg) < 0)
+                    invalid_arg("resize");
+                break;
+
+            case 'S':
+                screenFps = optarg;
+                if (atoi(optarg) <= 0)
+                    fatal("error: the screen option requires a positive frame rate\n");
+                break;
+
+            case 'T':
+                tracePath = optarg;
+                if (tracePath.empty())
+                    invalid_arg("trace-startup");
+                break;
+
             case 'u':
                 userName = optarg;
                 if (userName.empty())
                     invalid_arg("user");
                 break;
 
+            case 'U': unixMode = true; break;
             case 'V': break; /* empty */
 
             case 'w':
@@ -336,70 +958,243 @@ int main(int argc, char *argv[])
                     invalid_arg("wsldir");
                 break;
 
+            case 'z':
+                compressLevel = atoi(optarg);
+                if (compressLevel < 1 || compressLevel > 9)
+                    fatal("error: the compress option requires a level 1-9\n");
+                break;
+
             default:
                 fatal("Try '%s --help' for more information.\n", argv[0]);
         }
     }
 
+    /* Port is printed in backend output, debug window shows it instead */
+    if (debugMode)
+        reverseMode = false;
+
+    if (!tracePath.empty())
+    {
+        g_trace.enable(tracePath.c_str());
+        g_trace.span("options", mainTime);
+    }
+
     const std::wstring wslPath = findSystemProgram(L"wsl.exe");
     const std::wstring backendPathWin = normalizePath(
                 findBackendProgram(customBackendPath, L"wslbridge2-backend"));
 
     /* Prepare the backend command line. */
-    std::wstring wslCmdLine;
-    wslCmdLine.append(L"exec \"$(wslpath -u");
-    appendWslArg(wslCmdLine, backendPathWin);
-    wslCmdLine.append(L")\"");
+    std::wstring backendExec;
+    backendExec.append(L"exec \"$(wslpath -u");
+    appendWslArg(backendExec, backendPathWin);
+    backendExec.append(L")\"");
+    std::wstring wslCmdLine = backendExec;
+
+    /*
+     * Backend options, in backend command line or in daemon setup. Options
+     * deciding what runs in pty are kept apart, daemon gets them for its
+     * pool of warm shells.
+     */
+    std::vector<std::wstring> shellArgs, backendArgs, commandArgs;
 
     for (const auto &envPair : env.pairs())
     {
-        appendWslArg(wslCmdLine, L"--env");
-        appendWslArg(wslCmdLine, envPair.first + L"=" + envPair.second);
+        shellArgs.push_back(L"--env");
+        shellArgs.push_back(envPair.first + L"=" + envPair.second);
     }
 
     if (loginMode)
-        appendWslArg(wslCmdLine, L"--login");
+        shellArgs.push_back(L"--login");
 
+    /* Backend expands the path like shell does */
     if (!wslDir.empty())
     {
-        wslCmdLine.append(L" --path \"");
-        wslCmdLine.append(mbsToWcs(wslDir));
-        wslCmdLine.append(L"\"");
+        shellArgs.push_back(L"--path");
+        shellArgs.push_back(mbsToWcs(wslDir));
+    }
+
+#ifdef use_frames
+    /* Use length prefixed frames in input socket */
+    backendArgs.push_back(L"--frames");
+    backendArgs.push_back(WSTRINGIFY(FRAME_VERSION));
+#endif
+
+    if (!resizeMsec.empty())
+    {
+        backendArgs.push_back(L"--resize");
+        backendArgs.push_back(mbsToWcs(resizeMsec));
+    }
+
+    if (!screenFps.empty())
+    {
+        backendArgs.push_back(L"--screen");
+        backendArgs.push_back(mbsToWcs(screenFps));
+    }
+
+    if (!bufferSize.empty())
+    {
+        backendArgs.push_back(L"--buffer");
+        backendArgs.push_back(mbsToWcs(bufferSize));
+    }
+
+    if (!engineName.empty())
+    {
+        backendArgs.push_back(L"--engine");
+        backendArgs.push_back(mbsToWcs(engineName));
+    }
+
+    if (!logPath.empty())
+    {
+        backendArgs.push_back(L"--log");
+        backendArgs.push_back(mbsToWcs(logPath));
+    }
+
+    if (!notsentLowat.empty())
+    {
+        backendArgs.push_back(L"--notsent-lowat");
+        backendArgs.push_back(mbsToWcs(notsentLowat));
+    }
+
+#ifdef use_mux
+    /* Compressed output is only understood in multiplexed connection */
+    if (compressLevel)
+    {
+        backendArgs.push_back(L"--compress");
+        backendArgs.push_back(std::wstring(1, L'0' + compressLevel));
+    }
+
+    if (g_pipeMode)
+        backendArgs.push_back(L"--pipe");
+
+    /* Backend of the session hands later connections to the running one */
+    if (!sessionName.empty())
+    {
+        backendArgs.push_back(L"--session");
+        backendArgs.push_back(mbsToWcs(sessionName));
     }
+#else
+    if (g_pipeMode || !sessionName.empty())
+        fatal("error: the pipe and session options require multiplexed connection\n");
+#endif
+
+    /* Append remaining non-option arguments as is */
+    commandArgs.push_back(L"--");
+    for (int i = optind; i < argc; ++i)
+        commandArgs.push_back(mbsToWcs(argv[i]));
 
     /* Initialize WinSock. */
     win_sock_init();
 
     /* Initialize COM. */
+    g_trace.phase("ComInit");
     int LiftedWSLVersion = 0;
     ComInit(&LiftedWSLVersion);
 
     GUID DistroId, VmId;
+#ifdef use_mux
+    SOCKET inputSock = 0; /* The only socket used for all channels */
+    std::string unixPath; /* Socket file of --unix in WSL1 */
+#else
     SOCKET inputSock = 0, outputSock = 0, controlSock = 0;
+#endif
 
     /* Detect WSL version. Assume distroName is initialized empty. */
+    g_trace.phase("IsWslTwo");
     const bool wslTwo = IsWslTwo(&DistroId, mbsToWcs(distroName), LiftedWSLVersion);
 
+#ifdef use_mux
+    /* Session of a running daemon only needs a connection */
+    if (daemonMode && userName.empty() && winDir.empty())
+    {
+        struct winsize winp = {};
+        ioctl(STDIN_FILENO, TIOCGWINSZ, &winp);
+
+        std::vector<std::wstring> sessionArgs = {
+            L"--cols", std::to_wstring(winp.ws_col),
+            L"--rows", std::to_wstring(winp.ws_row) };
+        sessionArgs.insert(sessionArgs.end(), shellArgs.begin(), shellArgs.end());
+        sessionArgs.insert(sessionArgs.end(), backendArgs.begin(), backendArgs.end());
+        sessionArgs.insert(sessionArgs.end(), commandArgs.begin(), commandArgs.end());
+
+        const unsigned int port = daemon_port(distroName);
+        const std::string tokenPath = daemon_token_path(distroName);
+        std::string token = read_token(tokenPath);
+        SOCKET sock = INVALID_SOCKET;
+        g_trace.phase("connect daemon");
+        if (!token.empty())
+            sock = connect_daemon(wslTwo, &DistroId, LiftedWSLVersion, port,
+                        daemon_setup(token, sessionArgs));
+
+        if (sock == INVALID_SOCKET)
+        {
+            g_trace.phase("start daemon");
+            token = new_token(tokenPath);
+            std::vector<std::wstring> daemonArgs = shellArgs;
+            daemonArgs.insert(daemonArgs.end(), commandArgs.begin(), commandArgs.end());
+            start_daemon(wslPath, backendExec, distroName, token, port,
+                         daemonArgs, debugMode);
+
+            const std::string setup = daemon_setup(token, sessionArgs);
+            for (int i = 0; i < 100 && sock == INVALID_SOCKET; i++)
+            {
+                usleep(100 * 1000);
+                sock = connect_daemon(wslTwo, &DistroId, LiftedWSLVersion, port, setup);
+            }
+
+            if (sock == INVALID_SOCKET)
+                fatal("error: backend daemon did not start\n");
+        }
+
+        g_ioSockets.inputSock = sock;
+        g_ioSockets.outputSock = sock;
+        g_ioSockets.controlSock = sock;
+        g_trace.phase("first output");
+        run_session(termState);
+
+        WSACleanup();
+        termState.exitCleanly(g_exitStatus);
+    }
+#endif
+
     if (wslTwo) /* WSL2: Use Hyper-V sockets. */
     {
         // wsltty#302: Start dummy process after ComInit, otherwise RPC_E_TOO_LATE.
         // wslbridge2#38: Do this only for WSL2 as WSL1 does not need the VM context.
         // wslbridge2#42: Required for WSL2 to get the VM ID.
+        g_trace.phase("start_dummy");
         if (LiftedWSLVersion)
             start_dummy(wslPath, wslCmdLine, distroName, debugMode);
 
+        g_trace.phase("GetVmId");
         const HRESULT hRes = GetVmId(&DistroId, &VmId, LiftedWSLVersion);
         if (hRes != 0)
             fatal("GetVmId: %s\n", GetErrorMessage(hRes).c_str());
 
+        g_trace.phase("listen");
+#ifdef use_mux
+        if (!reverseMode)
+            inputSock = win_vsock_create();
+#else
         inputSock = win_vsock_create();
         outputSock = win_vsock_create();
         controlSock = win_vsock_create();
+#endif
 
         struct winsize winp = {};
         ioctl(STDIN_FILENO, TIOCGWINSZ, &winp);
 
         std::array<wchar_t, 1024> buffer;
+#ifdef use_mux
+        ret = swprintf(
+                buffer.data(),
+                buffer.size(),
+                reverseMode ? L" %ls--cols %d --rows %d --accept"
+                            : L" %ls--cols %d --rows %d --mux %d",
+                debugMode ? L"--show " : L"",
+                winp.ws_col,
+                winp.ws_row,
+                reverseMode ? 0 : win_vsock_listen(inputSock, &VmId));
+#else
         ret = swprintf(
                 buffer.data(),
                 buffer.size(),
@@ -410,19 +1205,62 @@ int main(int argc, char *argv[])
                 win_vsock_listen(inputSock, &VmId),
                 win_vsock_listen(outputSock, &VmId),
                 win_vsock_listen(controlSock, &VmId));
+#endif
         assert(ret > 0);
         wslCmdLine.append(buffer.data());
     }
     else /* WSL1: use localhost IPv4 sockets. */
     {
+        g_trace.phase("listen");
+#ifdef use_mux
+        /* Socket file is in Windows temp folder, backend sees it with wslpath */
+        if (unixMode && !reverseMode)
+        {
+            std::array<char, MAX_PATH> tempDir;
+            const DWORD tempLen = GetTempPathA(tempDir.size(), tempDir.data());
+            if (tempLen == 0 || tempLen >= tempDir.size())
+                fatal("GetTempPathA: %s", GetErrorMessage(GetLastError()).c_str());
+            unixPath = std::string(tempDir.data()) + "wslbridge2-" +
+                       std::to_string(GetCurrentProcessId()) + ".sock";
+            DeleteFileA(unixPath.c_str());
+            inputSock = win_unix_listen(unixPath.c_str());
+        }
+        else if (!reverseMode)
+            inputSock = win_local_create();
+#else
         inputSock = win_local_create();
         outputSock = win_local_create();
         controlSock = win_local_create();
+#endif
 
         struct winsize winp = {};
         ioctl(STDIN_FILENO, TIOCGWINSZ, &winp);
 
         std::array<wchar_t, 1024> buffer;
+#ifdef use_mux
+        if (!unixPath.empty())
+        {
+            ret = swprintf(
+                    buffer.data(),
+                    buffer.size(),
+                    L" %ls--cols %d --rows %d --unix \"$(wslpath -u",
+                    debugMode ? L"--show " : L"",
+                    winp.ws_col,
+                    winp.ws_row);
+        }
+        else
+        {
+            ret = swprintf(
+                    buffer.data(),
+                    buffer.size(),
+                    reverseMode ? L" %ls--cols %d --rows %d --accept"
+                                : L" %ls--cols %d --rows %d --mux %d",
+                    debugMode ? L"--show " : L"",
+                    winp.ws_col,
+                    winp.ws_row,
+                    reverseMode ? 0 : win_local_listen(inputSock, 0));
+        }
+#else
         ret = swprintf(
                 buffer.data(),
                 buffer.size(),
@@ -433,14 +1271,38 @@ int main(int argc, char *argv[])
                 win_local_listen(inputSock, 0),
                 win_local_listen(outputSock, 0),
                 win_local_listen(controlSock, 0));
+#endif
         assert(ret > 0);
         wslCmdLine.append(buffer.data());
+#ifdef use_mux
+        if (!unixPath.empty())
+        {
+            appendWslArg(wslCmdLine, mbsToWcs(unixPath));
+            wslCmdLine.append(L")\"");
+        }
+#endif
     }
 
-    /* Append remaining non-option arguments as is */
-    appendWslArg(wslCmdLine, L"--");
-    for (int i = optind; i < argc; ++i)
-        appendWslArg(wslCmdLine, mbsToWcs(argv[i]));
+    for (const std::wstring &arg : shellArgs)
+        appendWslArg(wslCmdLine, arg);
+    for (const std::wstring &arg : backendArgs)
+        appendWslArg(wslCmdLine, arg);
+    if (!tracePath.empty())
+    {
+        /* Backend trace is kept next to this one */
+        const std::string backendTrace = tracePath + ".backend.json";
+        wchar_t *winPath = static_cast<wchar_t*>(cygwin_create_path(
+                CCP_POSIX_TO_WIN_W | CCP_ABSOLUTE, backendTrace.c_str()));
+        if (winPath == nullptr)
+            fatalPerror(("error: bad path: '" + backendTrace + "'").c_str());
+
+        wslCmdLine.append(L" --trace-startup \"$(wslpath -u");
+        appendWslArg(wslCmdLine, winPath);
+        wslCmdLine.append(L")\"");
+        free(winPath);
+    }
+    for (const std::wstring &arg : commandArgs)
+        appendWslArg(wslCmdLine, arg);
 
     /* Append wsl.exe options and its arguments */
     std::wstring cmdLine;
@@ -509,6 +1371,7 @@ int main(int argc, char *argv[])
         si.StartupInfo.hStdError = errorPipe.wh;
     }
 
+    g_trace.phase("CreateProcessW");
     ret = CreateProcessW(
             wslPath.c_str(),
             &cmdLine[0],
@@ -526,6 +1389,16 @@ int main(int argc, char *argv[])
     HeapFree(GetProcessHeap(), 0, AttrList);
     CloseHandle(outputPipe.wh);
     CloseHandle(errorPipe.wh);
+
+#ifdef use_mux
+    /* Backend reports the port it listens on, before watchdog reads output */
+    unsigned int acceptPort = 0;
+    if (reverseMode)
+    {
+        g_trace.phase("read port");
+        acceptPort = read_accept_port(outputPipe.rh);
+    }
+#endif
     ret = SetHandleInformation(pi.hProcess, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
     if (!ret)
         fatal("SetHandleInformation: %s", GetErrorMessage(GetLastError()).c_str());
@@ -556,55 +1429,63 @@ int main(int argc, char *argv[])
             termState.fatal("%s", msg.c_str());
     });
 
+    /* Waits for wsl.exe to start the backend */
+#ifdef use_mux
+    if (reverseMode)
+    {
+        /* Watchdog reports why backend exited without a port */
+        if (acceptPort == 0)
+            watchdog.join();
+
+        g_trace.phase("connect");
+        g_ioSockets.inputSock = wslTwo ? win_vsock_connect(&VmId, acceptPort)
+                                       : win_local_connect(acceptPort);
+        if (g_ioSockets.inputSock == INVALID_SOCKET)
+            termState.fatal("error: cannot connect to backend port %u\n", acceptPort);
+    }
+    else
+    {
+        g_trace.phase("accept");
+        if (!unixPath.empty())
+        {
+            /* Connected socket does not need its file */
+            g_ioSockets.inputSock = win_unix_accept(inputSock);
+            DeleteFileA(unixPath.c_str());
+        }
+        else
+            g_ioSockets.inputSock = wslTwo ? win_vsock_accept(inputSock)
+                                           : win_local_accept(inputSock);
+    }
+
+    /* All channels share one connection */
+    g_ioSockets.outputSock = g_ioSockets.inputSock;
+    g_ioSockets.controlSock = g_ioSockets.inputSock;
+#else
     if (wslTwo)
     {
+        g_trace.phase("accept input");
         g_ioSockets.inputSock = win_vsock_accept(inputSock);
+        g_trace.phase("accept output");
         g_ioSockets.outputSock = win_vsock_accept(outputSock);
+        g_trace.phase("accept control");
         g_ioSockets.controlSock = win_vsock_accept(controlSock);
     }
     else
     {
+        g_trace.phase("accept input");
         g_ioSockets.inputSock = win_local_accept(inputSock);
+        g_trace.phase("accept output");
         g_ioSockets.outputSock = win_local_accept(outputSock);
+        g_trace.phase("accept control");
         g_ioSockets.controlSock = win_local_accept(controlSock);
     }
+#endif
 
-    /* Create thread to send input buffer to input socket */
-    pthread_t tidInput;
-    ret = pthread_create(&tidInput, nullptr, send_buffer, nullptr);
-    assert(ret == 0);
-
-    /* Create thread to send input buffer to input socket */
-    pthread_t tidOutput;
-    ret = pthread_create(&tidOutput, nullptr, receive_buffer, nullptr);
-    assert(ret == 0);
-
-    termState.enterRawMode();
-
-    /* Create thread to send window size through control socket */
-    struct sigaction act = {};
-    act.sa_handler = resize_window;
-    act.sa_flags = SA_RESTART;
-    ret = sigaction(SIGWINCH, &act, NULL);
-    assert(ret == 0);
-
-    /* Notify initial size in case it's changed since starting */
-    //resize_window(0);
-    kill(getpid(), SIGWINCH);
-
-    /*
-     * wsltty#254: WORKAROUND: Terminates input thread forcefully
-     * when output thread exits. Need some inter-thread syncing.
-     */
-    pthread_join(tidOutput, nullptr);
-    pthread_kill(tidInput, 0);
-    // pthread_join(tidInput, nullptr);
+    g_trace.phase("first output");
+    run_session(termState);
 
-    /* cleanup */
-    for (size_t i = 0; i < ARRAYSIZE(g_ioSockets.sock); i++)
-        closesocket(g_ioSockets.sock[i]);
     CloseHandle(pi.hProcess);
     CloseHandle(pi.hThread);
     WSACleanup();
-    termState.exitCleanly(0);
+    termState.exitCleanly(g_exitStatus);
 }